@@ -0,0 +1,74 @@
+#include "Arena.hpp"
+
+namespace {
+
+// Smallest block taken from the heap, so many small buffers share one block
+const uint64_t MIN_BLOCK_SIZE = 64 * 1024;
+
+uint8_t* alignUp(uint8_t* pointer) {
+    return reinterpret_cast<uint8_t*>((uintptr_t(pointer) + Arena::ALIGNMENT - 1) & ~uintptr_t(Arena::ALIGNMENT - 1));
+}
+
+}
+
+Arena::Arena(uint64_t initialSize) : used(0), blockAllocations(0) {
+    if (initialSize > 0) {
+        this->blocks.push_back(Block{new uint8_t[initialSize + ALIGNMENT], initialSize + ALIGNMENT});
+        this->blockAllocations++;
+    }
+}
+
+Arena::~Arena() {
+    for (Block& block : this->blocks)
+        delete[] block.memory;
+}
+
+uint8_t* Arena::allocate(uint64_t size) {
+    if (!this->blocks.empty()) {
+        Block& last = this->blocks.back();
+        uint8_t* pointer = alignUp(last.memory + this->used);
+        if (uint64_t(pointer - last.memory) + size <= last.size) {
+            this->used = uint64_t(pointer - last.memory) + size;
+            return pointer;
+        }
+    }
+
+    // New block at least doubles the capacity, so a growing job needs only a few of them
+    uint64_t blockSize = size + ALIGNMENT;
+    uint64_t capacity = this->getCapacity();
+    if (blockSize < capacity)
+        blockSize = capacity;
+    if (blockSize < MIN_BLOCK_SIZE)
+        blockSize = MIN_BLOCK_SIZE;
+    this->blocks.push_back(Block{new uint8_t[blockSize], blockSize});
+    this->blockAllocations++;
+
+    Block& last = this->blocks.back();
+    uint8_t* pointer = alignUp(last.memory);
+    this->used = uint64_t(pointer - last.memory) + size;
+    return pointer;
+}
+
+void Arena::reset() {
+    this->used = 0;
+    if (this->blocks.size() <= 1)
+        return;
+    // Largest job so far fits into one block from now on
+    uint64_t capacity = this->getCapacity();
+    for (Block& block : this->blocks)
+        delete[] block.memory;
+    this->blocks.clear();
+    this->blocks.push_back(Block{new uint8_t[capacity], capacity});
+    this->blockAllocations++;
+}
+
+uint64_t Arena::getCapacity() const {
+    uint64_t capacity = 0;
+    for (const Block& block : this->blocks)
+        capacity += block.size;
+    return capacity;
+}
+
+uint64_t Arena::getBlockAllocations() const {
+    return this->blockAllocations;
+}
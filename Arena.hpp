@@ -0,0 +1,34 @@
+#pragma once
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator for buffers of one job. Nothing is freed one by one: reset releases everything at once
+// and keeps the memory, so a job no larger than the previous ones makes no heap allocations
+class Arena {
+    struct Block {
+        uint8_t* memory; // new[] allocated
+        uint64_t size;
+    };
+    std::vector<Block> blocks;
+    uint64_t used;        // Bytes taken from the last block
+    uint64_t blockAllocations;
+    public:
+        static const uint64_t ALIGNMENT = 64; // Cache line, enough for any SIMD load
+        Arena(uint64_t initialSize = 0);
+        ~Arena();
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        // Returns uninitialized buffer aligned to ALIGNMENT, valid until reset
+        uint8_t* allocate(uint64_t size);
+        // Releases all buffers; memory of several blocks is merged into one that fits all of them
+        void reset();
+        // Bytes held by arena, used or not
+        uint64_t getCapacity() const;
+        // Number of blocks taken from the heap since arena was created
+        uint64_t getBlockAllocations() const;
+};
+#endif
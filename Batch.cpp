@@ -0,0 +1,407 @@
+#include "Batch.hpp"
+#include "Arena.hpp"
+#include "Codec.hpp"
+#include "FilterSelector.hpp"
+#include "Image.hpp"
+#include "MappedFile.hpp"
+#include "PNGWriter.hpp"
+#include "Palette.hpp"
+#include "ThreadPool.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// State kept by one worker between its jobs; once it has seen the largest of same sized covers,
+// processing of image data makes no heap allocations
+struct Worker {
+    z_stream inflater;
+    Arena arena; // Reconstructed and compressed image data of current job
+    Image image;
+    std::string message;
+    std::unique_ptr<FilterSelector> selector;
+    uint64_t selectorLength; // Row size and bytes per pixel the selector was made for
+    int selectorBpp;
+    std::unique_ptr<Codec> codec;
+    ChunkCRC checksums;
+    Worker(const std::string& codecName, uint32_t idatSize)
+        : inflater{}, selectorLength(0), selectorBpp(0), checksums(idatSize) {
+        this->inflater.zalloc = Z_NULL;
+        this->inflater.zfree = Z_NULL;
+        this->inflater.opaque = Z_NULL;
+        if (inflateInit(&this->inflater) != Z_OK)
+            throw std::runtime_error("Could not initialize inflate");
+        // Images are compressed in parallel already, so every one of them is deflated serially
+        CodecOptions codecOptions;
+        codecOptions.threads = 1;
+        this->codec = createCodec(codecName, codecOptions);
+    }
+    ~Worker() {
+        inflateEnd(&this->inflater);
+    }
+    FilterSelector& getSelector(const m_data& metadata, FilterStrategy strategy) {
+        uint64_t length = getScanlineSize(metadata);
+        int bpp = getBytesPerPixel(metadata);
+        if (!this->selector || this->selectorLength != length || this->selectorBpp != bpp) {
+            this->selector.reset(new FilterSelector(length, bpp, strategy));
+            this->selectorLength = length;
+            this->selectorBpp = bpp;
+        }
+        return *this->selector;
+    }
+};
+
+// Reads whole file into content, reusing its memory
+void readFile(const std::string& path, std::string& content) {
+    std::ifstream input(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!input.is_open())
+        throw std::runtime_error("Could not open payload " + path);
+    content.resize(size_t(input.tellg()));
+    input.seekg(0);
+    input.read(&content[0], content.size());
+    if (!input)
+        throw std::runtime_error("Could not read payload " + path);
+}
+
+// Part of payload stream embedded into one cover: frame header followed by message bytes;
+// cover is mapped and parsed once, when its capacity is found, and handed to the job as it is
+struct Shard {
+    FrameHeader header;
+    std::string payload;
+    std::unique_ptr<MappedFile> file;
+    Image image;
+    m_data metadata;
+};
+
+// Returns embed mode of options for image
+EmbedMode getBatchMode(const BatchOptions& options, const m_data& metadata) {
+    EmbedMode mode = {options.bits, DEFAULT_EMBED_MODE.channels};
+    if (!options.channels.empty())
+        mode.channels = parseChannels(options.channels.c_str(), metadata);
+    return mode;
+}
+
+// Embeds message of payload file of job, or shard when given
+void embedJob(const BatchJob& job, Worker& worker, const BatchOptions& options, Shard* shard = nullptr) {
+    Stats* stats = options.stats;
+    std::unique_ptr<MappedFile> mapping;
+    const MappedFile* file = nullptr;
+    Image* cover = nullptr;
+    m_data metadata{};
+    std::string& message = worker.message;
+    if (shard == nullptr) {
+        StageTimer timer(stats, Stage::Read);
+        mapping.reset(new MappedFile(job.cover.c_str()));
+        file = mapping.get();
+        readFile(job.payload, message);
+        timer.setBytesOut(file->getSize() + message.length());
+
+        timer.restart(Stage::Parse, file->getSize());
+        cover = &worker.image;
+        // Images are parsed in parallel already, so CRCs of every one of them are checked serially
+        metadata = readPNG(file->getData(), file->getSize(), *cover, options.checkingCRC, 1);
+        timer.setBytesOut(cover->getIDATSize());
+    } else {
+        // Shards and their covers are read before their jobs start
+        file = shard->file.get();
+        cover = &shard->image;
+        metadata = shard->metadata;
+    }
+    Image& image = *cover;
+
+    EmbedMode mode = getBatchMode(options, metadata);
+
+    // Buffers of previous job are released here, not when it ends, so a failed job leaves nothing behind either
+    worker.arena.reset();
+    uint64_t size = getImageSize(metadata);
+    StageTimer timer(stats, Stage::Inflate, image.getIDATSize(), size);
+    uint8_t* raw = worker.arena.allocate(size);
+    if (!decompress(&worker.inflater, image.getIDATChunks(), raw, size))
+        throw ImageDataError("Image data is truncated or corrupted");
+    timer.restart(Stage::Unfilter, size, size);
+    filter(raw, size, metadata, true, 1);
+    timer.restart(Stage::Embed, shard == nullptr ? message.length() : shard->header.length, size);
+    if (metadata.color == 3) {
+        Palette palette(image, metadata, mode.bits);
+        palette.remap(raw, metadata);
+        palette.store(image);
+    }
+    if (shard == nullptr)
+        encodeMessage(raw, size, message, metadata, mode, options.password, options.packing);
+    else
+        encodeFrame(raw, size, shard->payload, shard->header, metadata, options.password);
+    timer.restart(Stage::ChooseFilters, size);
+    if (options.strategy != FilterStrategy::Keep)
+        chooseFilters(raw, size, metadata, worker.getSelector(metadata, options.strategy));
+    timer.restart(Stage::Filter, size, size);
+    filter(raw, size, metadata, false, 1);
+
+    timer.restart(Stage::Deflate, size);
+    worker.checksums.reset();
+    auto p = worker.codec->compress(raw, size, &worker.arena, &worker.checksums);
+    timer.setBytesOut(p.second);
+
+    timer.restart(Stage::Write, p.second);
+    // Signature and all other chunks except IEND, then image data and IEND;
+    // frame left in payload chunk would be read before pixels
+    image.removeChunks(PAYLOAD_CHUNK_TYPE);
+    PNGWriter output(job.output);
+    output.writeSignature(file->getData());
+    auto& otherChunks = image.getOtherChunks();
+    output.writeChunks(otherChunks.data(), otherChunks.size() - 1);
+    output.writeIDAT(p.first, p.second, worker.checksums);
+    output.finish();
+}
+
+// Returns PNG files of directory; directory order is arbitrary, sorted files make reports comparable
+std::vector<std::filesystem::path> listImages(const char* directory) {
+    namespace fs = std::filesystem;
+    std::vector<fs::path> images;
+    for (auto& entry : fs::directory_iterator(directory)) {
+        std::string extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (entry.is_regular_file() && extension == ".png")
+            images.push_back(entry.path());
+    }
+    std::sort(images.begin(), images.end());
+    return images;
+}
+
+}
+
+
+Batch::Batch(const BatchOptions& options) : options(options) {}
+
+void Batch::addJob(const BatchJob& job) {
+    this->jobs.push_back(job);
+}
+
+void Batch::readManifest(const char* path) {
+    std::ifstream input(path);
+    if (!input.is_open())
+        throw std::runtime_error(std::string("Could not open manifest ") + path);
+
+    std::string line;
+    for (size_t number = 1; std::getline(input, line); ++number) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+        BatchJob job;
+        std::istringstream fields(line);
+        if (!std::getline(fields, job.cover, '\t') || !std::getline(fields, job.payload, '\t') ||
+            !std::getline(fields, job.output, '\t') || job.output.empty())
+            throw std::runtime_error("Manifest line " + std::to_string(number) + " is not cover, payload and output");
+        this->jobs.push_back(job);
+    }
+}
+
+void Batch::addDirectory(const char* directory, const char* payload, const char* outputDirectory) {
+    namespace fs = std::filesystem;
+    std::vector<fs::path> covers = listImages(directory);
+    fs::create_directories(outputDirectory);
+    for (auto& cover : covers) {
+        BatchJob job;
+        job.cover = cover.string();
+        job.payload = payload;
+        job.output = (fs::path(outputDirectory) / cover.filename()).string();
+        this->jobs.push_back(job);
+    }
+}
+
+size_t Batch::getJobCount() const {
+    return this->jobs.size();
+}
+
+size_t Batch::run(std::ostream& report) {
+    ThreadPool pool(this->options.threads);
+    std::vector<std::unique_ptr<Worker>> workers(pool.getThreadCount());
+    std::mutex reportMutex;
+    std::atomic<size_t> failed(0);
+
+    auto start = std::chrono::steady_clock::now();
+    for (const BatchJob& job : this->jobs) {
+        pool.submit([&](unsigned worker) {
+            auto jobStart = std::chrono::steady_clock::now();
+            std::ostringstream status;
+            try {
+                if (!workers[worker])
+                    workers[worker].reset(new Worker(this->options.codecName, this->options.idatSize));
+                embedJob(job, *workers[worker], this->options);
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - jobStart).count();
+                status << "ok " << job.cover << " -> " << job.output << " (" << int64_t(ms) << " ms)";
+            } catch (const std::exception& e) {
+                failed++;
+                status << "failed " << job.cover << ": " << e.what();
+            }
+            std::lock_guard<std::mutex> lock(reportMutex);
+            report << status.str() << std::endl;
+        });
+    }
+    pool.wait();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report << this->jobs.size() << " images in " << seconds << " s on " << pool.getThreadCount() << " threads ("
+           << (seconds > 0 ? this->jobs.size() / seconds : 0) << " images/s), " << failed << " failed" << std::endl;
+    return failed;
+}
+
+size_t Batch::runShards(std::istream& payload, std::ostream& report) {
+    ThreadPool pool(this->options.threads);
+    std::vector<std::unique_ptr<Worker>> workers(pool.getThreadCount());
+    std::mutex reportMutex;
+    std::condition_variable shardDone;
+    std::atomic<size_t> failed(0);
+    // Shards read and not embedded yet, guarded by reportMutex; bounding them bounds payload held in memory
+    size_t pending = 0;
+    const size_t maxPending = 2 * size_t(pool.getThreadCount());
+
+    uint32_t id = std::random_device()();
+    uint32_t index = 0;
+    uint64_t total = 0;
+    bool ended = false;
+    bool broken = false;
+    auto start = std::chrono::steady_clock::now();
+    for (const BatchJob& job : this->jobs) {
+        if (ended)
+            break;
+        // Cover is parsed here for its capacity and kept for the worker, inflating is left to it
+        auto shard = std::make_shared<Shard>();
+        FrameHeader header{};
+        try {
+            StageTimer timer(this->options.stats, Stage::Read);
+            shard->file.reset(new MappedFile(job.cover.c_str()));
+            const MappedFile& file = *shard->file;
+            timer.setBytesOut(file.getSize());
+            timer.restart(Stage::Parse, file.getSize());
+            shard->metadata = readPNG(file.getData(), file.getSize(), shard->image, this->options.checkingCRC, 1);
+            timer.setBytesOut(shard->image.getIDATSize());
+            const m_data& metadata = shard->metadata;
+            EmbedMode mode = getBatchMode(this->options, metadata);
+            header = createFrameHeader(0, mode);
+            header.flags |= FRAME_FLAG_SHARD;
+            uint64_t capacity = checkEmbedMode(metadata, mode) ? getMessageCapacity(metadata, mode, header.flags) : 0;
+            if (capacity == 0)
+                throw std::runtime_error("Image is too small for embed mode");
+            header.length = uint32_t(std::min<uint64_t>(capacity, UINT32_MAX));
+        } catch (const std::exception& e) {
+            failed++;
+            std::lock_guard<std::mutex> lock(reportMutex);
+            report << "failed " << job.cover << ": " << e.what() << std::endl;
+            continue;
+        }
+
+        // Message is read straight behind room left for its header, so it is never copied
+        uint32_t headerSize = getFrameHeaderSize(header.flags);
+        shard->payload.resize(headerSize + uint64_t(header.length));
+        payload.read(&shard->payload[headerSize], header.length);
+        if (payload.bad()) {
+            broken = true;
+            break;
+        }
+        header.length = uint32_t(payload.gcount());
+        shard->payload.resize(headerSize + uint64_t(header.length));
+        ended = payload.peek() == EOF;
+        header.shard = {id, index++, ended};
+        writeFrameHeader(header, reinterpret_cast<uint8_t*>(&shard->payload[0]));
+        shard->header = header;
+        total += header.length;
+
+        std::unique_lock<std::mutex> lock(reportMutex);
+        shardDone.wait(lock, [&]() { return pending < maxPending; });
+        pending++;
+        lock.unlock();
+        pool.submit([&, shard](unsigned worker) {
+            auto jobStart = std::chrono::steady_clock::now();
+            std::ostringstream status;
+            try {
+                if (!workers[worker])
+                    workers[worker].reset(new Worker(this->options.codecName, this->options.idatSize));
+                embedJob(job, *workers[worker], this->options, shard.get());
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - jobStart).count();
+                status << "ok " << job.cover << " -> " << job.output << " (shard " << shard->header.shard.index << ", "
+                       << shard->header.length << " bytes, " << int64_t(ms) << " ms)";
+            } catch (const std::exception& e) {
+                failed++;
+                status << "failed " << job.cover << ": " << e.what();
+            }
+            std::lock_guard<std::mutex> lock(reportMutex);
+            report << status.str() << std::endl;
+            pending--;
+            shardDone.notify_one();
+        });
+    }
+    pool.wait();
+
+    if (broken || !ended) {
+        failed++;
+        report << (broken ? "Could not read payload" : "Payload does not fit into covers") << ", " << total
+               << " bytes embedded" << std::endl;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report << total << " bytes in " << index << " shards in " << seconds << " s on " << pool.getThreadCount() << " threads ("
+           << (seconds > 0 ? total / seconds / 1e6 : 0) << " MB/s), " << failed << " failed" << std::endl;
+    return failed;
+}
+
+
+uint64_t joinShards(const char* directory, std::ostream& output, const std::string& password) {
+    // Every image is decoded once, header and message together; shards are written as soon as those in front of them are,
+    // so only shards found out of payload order are held
+    std::map<uint32_t, std::string> waiting;
+    uint32_t next = 0;
+    uint32_t id = 0;
+    uint32_t highest = 0;
+    bool found = false;
+    bool lastFound = false;
+    uint64_t total = 0;
+    for (auto& path : listImages(directory)) {
+        MappedFile file(path.string().c_str());
+        Image image;
+        m_data metadata = readPNG(file.getData(), file.getSize(), image);
+        FrameHeader header{};
+        std::string message;
+        if (!tryExtractFrame(image, metadata, header, message, password) || !(header.flags & FRAME_FLAG_SHARD))
+            continue;
+        const FrameShard& shard = header.shard;
+        if (found && shard.id != id)
+            throw std::runtime_error("Directory holds shards of several payloads");
+        if (shard.index < next || waiting.count(shard.index) != 0)
+            throw std::runtime_error("Shard " + std::to_string(shard.index) + " is duplicated");
+        if ((lastFound && shard.index > highest) || (shard.last && found && highest > shard.index))
+            throw std::runtime_error("Shards follow last shard");
+        id = shard.id;
+        highest = found ? std::max(highest, shard.index) : shard.index;
+        found = true;
+        lastFound = lastFound || shard.last;
+
+        waiting[shard.index] = std::move(message);
+        for (auto it = waiting.find(next); it != waiting.end(); it = waiting.find(++next)) {
+            output.write(it->second.data(), it->second.length());
+            total += it->second.length();
+            waiting.erase(it);
+        }
+    }
+    if (!found)
+        throw std::runtime_error(std::string("Directory ") + directory + " holds no shards");
+    if (!waiting.empty())
+        throw std::runtime_error("Shard " + std::to_string(next) + " is missing");
+    if (!lastFound)
+        throw std::runtime_error("Last shard is missing");
+    if (!output)
+        throw std::runtime_error("Could not write payload");
+    return total;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "utils.hpp"
+#include "Stats.hpp"
+
+// Cover image, file holding message to embed into it and path of resulting image
+struct BatchJob {
+    std::string cover;
+    std::string payload;
+    std::string output;
+};
+
+// Settings applied to every job of a batch
+struct BatchOptions {
+    uint8_t bits = DEFAULT_EMBED_MODE.bits;
+    std::string channels;              // Channel letters, empty means first channel only
+    std::string password;              // Empty means message is embedded row by row
+    bool packing = false;              // Messages of payload files are deflated when that makes them shorter
+    FilterStrategy strategy = FilterStrategy::MinSum;
+    std::string codecName = "best";
+    uint32_t idatSize = 8192;          // Bytes per IDAT chunk of outputs, 0 means one chunk
+    bool checkingCRC = true;           // Covers with wrong chunk CRCs fail before they are inflated
+    unsigned threads = 0;              // 0 means one per core
+    Stats* stats = nullptr;            // Stages of all jobs are recorded into it when given
+};
+
+// Embeds messages into many covers concurrently, one whole image per task of a work stealing pool;
+// every worker keeps its buffers and zlib streams from one image to the next
+class Batch {
+    BatchOptions options;
+    std::vector<BatchJob> jobs;
+    public:
+        Batch(const BatchOptions& options);
+        void addJob(const BatchJob& job);
+        // Adds one job per line of manifest: cover, payload and output separated by tabs;
+        // empty lines and lines starting with # are skipped
+        void readManifest(const char* path);
+        // Adds job for every PNG file of directory, all with the same payload; outputs keep file names
+        void addDirectory(const char* directory, const char* payload, const char* outputDirectory);
+        size_t getJobCount() const;
+        // Runs all jobs, writing status of every job and totals into report; returns number of failed jobs
+        size_t run(std::ostream& report);
+        // Splits payload read from stream into shards, each as long as the next cover can carry,
+        // and embeds them instead of payload files of jobs; only a few shards are held in memory at once.
+        // Covers left when payload ends are not written; returns number of failed jobs, payload not fitting counts as one
+        size_t runShards(std::istream& payload, std::ostream& report);
+};
+
+// Writes payload split by Batch::runShards into output, rebuilt from shards in PNGs of directory
+// found in any order; throws std::runtime_error if shards are missing, after writing those in front of the gap.
+// Returns bytes of payload
+uint64_t joinShards(const char* directory, std::ostream& output, const std::string& password = "");
+#endif
@@ -0,0 +1,96 @@
+#include "Codec.hpp"
+#include "utils.hpp"
+#include <zlib.h>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+ZlibCodec::ZlibCodec(const std::string& name, int level, int strategy, const CodecOptions& options)
+    : name(name), level(level), strategy(strategy), options(options), strm{}, hasStream(false) {}
+
+ZlibCodec::~ZlibCodec() {
+    if (this->hasStream)
+        deflateEnd(&this->strm);
+}
+
+const char* ZlibCodec::getName() const {
+    return this->name.c_str();
+}
+
+std::pair<uint8_t*, uint64_t> ZlibCodec::compress(const uint8_t* data, uint64_t size, Arena* arena, ChunkCRC* chunkCRC) {
+    if (this->options.threads == 1 || size <= this->options.segmentSize) {
+        if (!this->hasStream) {
+            this->strm.zalloc = Z_NULL;
+            this->strm.zfree = Z_NULL;
+            this->strm.opaque = Z_NULL;
+            if (deflateInit2(&this->strm, this->level, Z_DEFLATED, 15, 8, this->strategy) != Z_OK)
+                throw std::runtime_error("Could not initialize deflate");
+            this->hasStream = true;
+        }
+        return ::compress(&this->strm, data, size, arena, chunkCRC);
+    }
+    return compressParallel(data, size, this->level, this->strategy, this->options.segmentSize, this->options.threads, arena,
+                            chunkCRC);
+}
+
+bool ZlibCodec::getDeflateSettings(int& level, int& strategy) const {
+    level = this->level;
+    strategy = this->strategy;
+    return true;
+}
+
+
+const char* StoredCodec::getName() const {
+    return "store";
+}
+
+std::pair<uint8_t*, uint64_t> StoredCodec::compress(const uint8_t* data, uint64_t size, Arena* arena, ChunkCRC* chunkCRC) {
+    return compressStored(data, size, arena, chunkCRC);
+}
+
+bool StoredCodec::getDeflateSettings(int& level, int& strategy) const {
+    level = Z_NO_COMPRESSION;
+    strategy = Z_DEFAULT_STRATEGY;
+    return true;
+}
+
+
+namespace {
+
+std::mutex registryMutex;
+
+std::map<std::string, CodecFactory>& registry() {
+    // Built in profiles, from smallest output to fastest
+    static std::map<std::string, CodecFactory> codecs = {
+        {"best", [](const CodecOptions& o) { return std::unique_ptr<Codec>(new ZlibCodec("best", Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, o)); }},
+        {"filtered", [](const CodecOptions& o) { return std::unique_ptr<Codec>(new ZlibCodec("filtered", Z_BEST_COMPRESSION, Z_FILTERED, o)); }},
+        {"default", [](const CodecOptions& o) { return std::unique_ptr<Codec>(new ZlibCodec("default", Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, o)); }},
+        {"rle", [](const CodecOptions& o) { return std::unique_ptr<Codec>(new ZlibCodec("rle", Z_DEFAULT_COMPRESSION, Z_RLE, o)); }},
+        {"fast", [](const CodecOptions& o) { return std::unique_ptr<Codec>(new ZlibCodec("fast", Z_BEST_SPEED, Z_DEFAULT_STRATEGY, o)); }},
+        {"store", [](const CodecOptions&) { return std::unique_ptr<Codec>(new StoredCodec()); }}
+    };
+    return codecs;
+}
+
+}
+
+void registerCodec(const std::string& name, CodecFactory factory) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry()[name] = factory;
+}
+
+std::unique_ptr<Codec> createCodec(const std::string& name, const CodecOptions& options) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto it = registry().find(name);
+    if (it == registry().end())
+        throw std::runtime_error("Unknown codec " + name);
+    return it->second(options);
+}
+
+std::vector<std::string> getCodecNames() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::vector<std::string> names;
+    for (auto& codec : registry())
+        names.push_back(codec.first);
+    return names;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#ifndef CODEC_HPP
+#define CODEC_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <stdint.h>
+#include <zlib.h>
+
+class Arena;
+class ChunkCRC;
+
+// Settings shared by all codecs
+struct CodecOptions {
+    unsigned threads = 0;              // 0 means one per core
+    uint32_t segmentSize = 128 * 1024; // Input bytes per parallel segment
+};
+
+// Compressor of filtered image data into a zlib stream for IDAT chunks
+class Codec {
+    public:
+        virtual ~Codec() {}
+        virtual const char* getName() const = 0;
+        // Returns pointer to stream and its size; stream is allocated from arena if given, otherwise by new[].
+        // Codecs feed the stream into chunkCRC as they produce it; those that do not leave it to the writer
+        virtual std::pair<uint8_t*, uint64_t> compress(const uint8_t* data, uint64_t size, Arena* arena = nullptr,
+                                                       ChunkCRC* chunkCRC = nullptr) = 0;
+        // Gives zlib level and strategy producing the same kind of stream row by row;
+        // returns false if output of codec cannot be produced that way
+        virtual bool getDeflateSettings(int& /*level*/, int& /*strategy*/) const { return false; }
+};
+
+// zlib deflate at given level and strategy; data larger than one segment is compressed in parallel.
+// Serial stream is kept between calls, so one codec per thread saves its setup for every image
+class ZlibCodec : public Codec {
+    std::string name;
+    int level;
+    int strategy;
+    CodecOptions options;
+    z_stream strm;
+    bool hasStream;
+    public:
+        ZlibCodec(const std::string& name, int level, int strategy, const CodecOptions& options);
+        ~ZlibCodec();
+        ZlibCodec(const ZlibCodec&) = delete;
+        ZlibCodec& operator=(const ZlibCodec&) = delete;
+        const char* getName() const override;
+        std::pair<uint8_t*, uint64_t> compress(const uint8_t* data, uint64_t size, Arena* arena = nullptr,
+                                               ChunkCRC* chunkCRC = nullptr) override;
+        bool getDeflateSettings(int& level, int& strategy) const override;
+};
+
+// Stored blocks only, for jobs where throughput matters more than size
+class StoredCodec : public Codec {
+    public:
+        const char* getName() const override;
+        std::pair<uint8_t*, uint64_t> compress(const uint8_t* data, uint64_t size, Arena* arena = nullptr,
+                                               ChunkCRC* chunkCRC = nullptr) override;
+        bool getDeflateSettings(int& level, int& strategy) const override;
+};
+
+typedef std::function<std::unique_ptr<Codec>(const CodecOptions&)> CodecFactory;
+
+/*Adds codec profile under name, replacing profile of the same name*/
+void registerCodec(const std::string& name, CodecFactory factory);
+
+/*Creates codec of profile name; throws std::runtime_error for unknown names*/
+std::unique_ptr<Codec> createCodec(const std::string& name, const CodecOptions& options = CodecOptions());
+
+/*Returns names of all registered profiles*/
+std::vector<std::string> getCodecNames();
+#endif
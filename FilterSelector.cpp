@@ -0,0 +1,63 @@
+#include "FilterSelector.hpp"
+#include <cstring>
+#include <cstdlib>
+
+FilterSelector::FilterSelector(uint32_t length, int bpp, FilterStrategy strategy)
+    : strategy(strategy), length(length), bpp(bpp), candidate(length + 1), strm{} {
+    if (strategy == FilterStrategy::BruteForce) {
+        this->strm.zalloc = Z_NULL;
+        this->strm.zfree = Z_NULL;
+        this->strm.opaque = Z_NULL;
+        // Trials only compare sizes, so a fast level is enough
+        deflateInit(&this->strm, Z_BEST_SPEED);
+        this->compressed.resize(deflateBound(&this->strm, length + 1));
+    }
+}
+
+FilterSelector::~FilterSelector() {
+    if (this->strategy == FilterStrategy::BruteForce)
+        deflateEnd(&this->strm);
+}
+
+uint64_t FilterSelector::cost(const uint8_t* filtered, uint32_t length) {
+    if (this->strategy == FilterStrategy::MinSum) {
+        // Filtered bytes are treated as signed, so small differences in both directions are cheap
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < length; ++i)
+            sum += std::abs(int(int8_t(filtered[i])));
+        return sum;
+    }
+
+    deflateReset(&this->strm);
+    this->strm.next_in = const_cast<Bytef*>(filtered);
+    this->strm.avail_in = length;
+    this->strm.next_out = this->compressed.data();
+    this->strm.avail_out = this->compressed.size();
+    deflate(&this->strm, Z_FINISH);
+    return this->compressed.size() - this->strm.avail_out;
+}
+
+uint8_t FilterSelector::choose(const uint8_t* line, const uint8_t* previous) {
+    return this->choose(line, previous, this->length);
+}
+
+uint8_t FilterSelector::choose(const uint8_t* line, const uint8_t* previous, uint32_t length) {
+    if (this->strategy == FilterStrategy::Keep)
+        return line[0];
+
+    uint8_t best = 0;
+    uint64_t bestCost = UINT64_MAX;
+    for (uint8_t filterType = 0; filterType < 5; ++filterType) {
+        memcpy(this->candidate.data() + 1, line + 1, length);
+        this->candidate[0] = filterType;
+        filterScanline(this->candidate.data(), previous, length, this->bpp, false);
+
+        uint64_t candidateCost = this->cost(this->candidate.data() + 1, length);
+        if (candidateCost < bestCost) {
+            bestCost = candidateCost;
+            best = filterType;
+        }
+    }
+    return best;
+}
+
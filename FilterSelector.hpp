@@ -0,0 +1,31 @@
+#pragma once
+#ifndef FILTERSELECTOR_HPP
+#define FILTERSELECTOR_HPP
+
+#include <vector>
+#include <stdint.h>
+#include <zlib.h>
+#include "utils.hpp"
+
+// Picks filter type of scanlines being re-encoded; keeps scratch buffers between rows,
+// so one selector should be used per thread
+class FilterSelector {
+    FilterStrategy strategy;
+    uint32_t length; // Scanline size without filter byte
+    int bpp;
+    std::vector<uint8_t> candidate; // Row filtered with the type being tried
+    std::vector<uint8_t> compressed; // Output of trial compression
+    z_stream strm;
+    uint64_t cost(const uint8_t* filtered, uint32_t length);
+    public:
+        FilterSelector(uint32_t length, int bpp, FilterStrategy strategy);
+        ~FilterSelector();
+        FilterSelector(const FilterSelector&) = delete;
+        FilterSelector& operator=(const FilterSelector&) = delete;
+        // Returns filter type for unfiltered line (with filter byte) given unfiltered row above or nullptr
+        uint8_t choose(const uint8_t* line, const uint8_t* previous);
+        // Same for row of length bytes without filter byte, at most the length selector was made for,
+        // as rows of Adam7 passes are shorter than rows of image
+        uint8_t choose(const uint8_t* line, const uint8_t* previous, uint32_t length);
+};
+#endif
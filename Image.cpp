@@ -1,5 +1,6 @@
 #include "Image.hpp"
-#include <memory.h>
+#include "utils.hpp"
+#include <cstring>
 
 Image::Image() {
     this->IDAT_chunks.reserve(10);
@@ -7,37 +8,66 @@ Image::Image() {
     this->IDAT_size = 0;
 }
 
-Image::~Image() {
-    for (auto& chunk : this->IDAT_chunks) {
-        delete[] chunk.first;
-    }
-
-    for (auto& chunk : this->other_chunks) {
-        delete[] chunk.data;
-    }
+void Image::clear() {
+    this->IDAT_chunks.clear();
+    this->other_chunks.clear();
+    this->replaced_data.clear();
+    this->IDAT_size = 0;
 }
 
-void Image::addIDATChunk(unsigned char* data, uint32_t size) {
-    unsigned char* dataCopy = new unsigned char[size];
-    memcpy(dataCopy, data, size); 
-    this->IDAT_chunks.emplace_back(std::pair<unsigned char*, uint32_t>(dataCopy, size));
+void Image::addIDATChunk(const unsigned char* data, uint32_t size) {
+    this->IDAT_chunks.emplace_back(data, size);
     this->IDAT_size += size;
 }
 
 void Image::addChunk(const chunk& c) { 
-    chunk tempChunk{};
+    if (!this->other_chunks.empty() && memcmp(this->other_chunks.back().type, "IEND", 4) == 0)
+        this->other_chunks.insert(this->other_chunks.end() - 1, c);
+    else
+        this->other_chunks.emplace_back(c);
+}
 
-    tempChunk.length = c.length;
-    memcpy(tempChunk.type, c.type, 4);
-    memcpy(tempChunk.crc, c.crc, 4);
-    tempChunk.data = new uint8_t[c.length];
-    memcpy(tempChunk.data, c.data, c.length);
+void Image::addChunk(const char* type, const unsigned char* data, uint32_t length) {
+    chunk c;
+    c.length = length;
+    memcpy(c.type, type, 4);
+    c.data = data;
+    uint32_t crc = swapEdian(calculate_crc(type, data, length));
+    memcpy(c.crc, &crc, 4);
+    this->addChunk(c);
+}
 
-    this->other_chunks.emplace_back(tempChunk);
+size_t Image::removeChunks(const char* type) {
+    size_t count = this->other_chunks.size();
+    for (size_t i = count; i-- > 0;)
+        if (memcmp(this->other_chunks[i].type, type, 4) == 0)
+            this->other_chunks.erase(this->other_chunks.begin() + i);
+    return count - this->other_chunks.size();
 }
 
 
-const std::vector<std::pair<unsigned char*, uint32_t>>& Image::getIDATChunks() {
+const chunk* Image::findChunk(const char* type) const {
+    for (auto& c : this->other_chunks) {
+        if (memcmp(c.type, type, 4) == 0)
+            return &c;
+    }
+    return nullptr;
+}
+
+bool Image::replaceChunk(const char* type, const unsigned char* data, uint32_t length) {
+    chunk* c = const_cast<chunk*>(this->findChunk(type));
+    if (c == nullptr)
+        return false;
+    this->replaced_data.emplace_back(data, data + length);
+    c->data = this->replaced_data.back().data();
+    c->length = length;
+    uint32_t crc = swapEdian(calculate_crc(type, c->data, length));
+    memcpy(c->crc, &crc, 4);
+    return true;
+}
+
+
+const std::vector<std::pair<const unsigned char*, uint32_t>>& Image::getIDATChunks() {
     return this->IDAT_chunks;
 }
 
@@ -46,6 +76,6 @@ const std::vector<chunk>& Image::getOtherChunks() {
 }
 
 
-uint32_t Image::getIDATSize() {
+uint64_t Image::getIDATSize() {
     return this->IDAT_size;
-}
\ No newline at end of file
+}
@@ -3,28 +3,44 @@
 #define IMAGE_HPP
 
 #include <vector>
+#include <list>
 #include <utility>
+#include <stddef.h>
 #include <stdint.h>
 
 struct chunk
 {
     uint32_t length;
     unsigned char type[4];
-    unsigned char* data;
+    const unsigned char* data; // View into the source file, not owned
     unsigned char crc[4];
 };
 
+// Chunks of PNG file; data is only referenced, so the source buffer must outlive the image.
+// Only data of replaced chunks is owned by image
 class Image {
-    std::vector<std::pair<unsigned char*, uint32_t>> IDAT_chunks; // Pointer to the begging of IDAT file and it's size
+    std::vector<std::pair<const unsigned char*, uint32_t>> IDAT_chunks; // Pointer to the begging of IDAT data and it's size
     std::vector<chunk> other_chunks;
-    uint32_t IDAT_size;
+    std::list<std::vector<unsigned char>> replaced_data; // List keeps data in place while more is added
+    uint64_t IDAT_size;
     public:
         Image();
-        ~Image();
-        void addIDATChunk(unsigned char* data, uint32_t size);
+        // Forgets all chunks but keeps memory of lists, so the image can be reused for the next file
+        void clear();
+        void addIDATChunk(const unsigned char* data, uint32_t size);
+        // Chunks added behind IEND go in front of it, so it stays last
         void addChunk(const chunk& chunk);
-        const std::vector<std::pair<unsigned char*, uint32_t>>& getIDATChunks();
+        // Adds chunk of type referencing data, which must outlive image, and computes its crc
+        void addChunk(const char* type, const unsigned char* data, uint32_t length);
+        // Removes all chunks of type; returns how many there were
+        size_t removeChunks(const char* type);
+        // Returns first chunk of type, or nullptr if image has none
+        const chunk* findChunk(const char* type) const;
+        // Replaces data of first chunk of type by copy of data and updates its crc;
+        // returns false if image has no such chunk
+        bool replaceChunk(const char* type, const unsigned char* data, uint32_t length);
+        const std::vector<std::pair<const unsigned char*, uint32_t>>& getIDATChunks();
         const std::vector<chunk>& getOtherChunks();
-        uint32_t getIDATSize();
+        uint64_t getIDATSize();
 };
-#endif
\ No newline at end of file
+#endif
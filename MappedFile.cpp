@@ -0,0 +1,89 @@
+#include "MappedFile.hpp"
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+
+MappedFile::MappedFile(const char* path, bool writable)
+    : data(nullptr), size(0), writable(writable), fileHandle(nullptr), mappingHandle(nullptr) {
+    HANDLE file = CreateFileA(path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error(std::string("Could not open file ") + path);
+    this->fileHandle = file;
+
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    this->size = size_t(fileSize.QuadPart);
+    if (this->size == 0)
+        return;
+
+    this->mappingHandle = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+    if (this->mappingHandle != nullptr)
+        this->data = static_cast<uint8_t*>(MapViewOfFile(this->mappingHandle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+    if (this->data == nullptr) {
+        if (this->mappingHandle != nullptr)
+            CloseHandle(this->mappingHandle);
+        CloseHandle(file);
+        throw std::runtime_error(std::string("Could not map file ") + path);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (this->data != nullptr)
+        UnmapViewOfFile(this->data);
+    if (this->mappingHandle != nullptr)
+        CloseHandle(this->mappingHandle);
+    if (this->fileHandle != nullptr)
+        CloseHandle(this->fileHandle);
+}
+
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const char* path, bool writable) : data(nullptr), size(0), writable(writable), fd(-1) {
+    this->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (this->fd < 0)
+        throw std::runtime_error(std::string("Could not open file ") + path);
+
+    struct stat info;
+    fstat(this->fd, &info);
+    this->size = size_t(info.st_size);
+    if (this->size == 0)
+        return;
+
+    void* mapping = writable ? mmap(nullptr, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0)
+                             : mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(this->fd);
+        throw std::runtime_error(std::string("Could not map file ") + path);
+    }
+    // Chunks are parsed front to back, while writable files are changed wherever message bits go
+    if (!writable)
+        madvise(mapping, this->size, MADV_SEQUENTIAL);
+    this->data = static_cast<uint8_t*>(mapping);
+}
+
+MappedFile::~MappedFile() {
+    if (this->data != nullptr)
+        munmap(this->data, this->size);
+    if (this->fd >= 0)
+        close(this->fd);
+}
+#endif
+
+const uint8_t* MappedFile::getData() const {
+    return this->data;
+}
+
+uint8_t* MappedFile::getWritableData() {
+    return this->writable ? this->data : nullptr;
+}
+
+size_t MappedFile::getSize() const {
+    return this->size;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory mapping of a whole file, read only unless it is writable; changes of writable mapping go to the file
+class MappedFile {
+    uint8_t* data;
+    size_t size;
+    bool writable;
+#ifdef _WIN32
+    void* fileHandle;
+    void* mappingHandle;
+#else
+    int fd;
+#endif
+    public:
+        MappedFile(const char* path, bool writable = false);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        const uint8_t* getData() const;
+        // Null unless mapping is writable
+        uint8_t* getWritableData();
+        size_t getSize() const;
+};
+#endif
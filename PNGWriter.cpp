@@ -0,0 +1,250 @@
+#include "PNGWriter.hpp"
+#include "Image.hpp"
+#include "utils.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+// Same layout as POSIX, so pieces are collected the same way on every platform
+struct iovec {
+    void* iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#endif
+
+namespace {
+
+// CRC of chunk type, which every IDAT checksum starts from
+const uint32_t IDAT_CRC = 0x35AF061E;
+
+}
+
+
+ChunkCRC::ChunkCRC(uint32_t chunkSize)
+    : chunkSize(chunkSize == 0 || chunkSize > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : chunkSize), filled(0), crc(IDAT_CRC), size(0) {}
+
+void ChunkCRC::reset() {
+    this->filled = 0;
+    this->crc = IDAT_CRC;
+    this->size = 0;
+    this->crcs.clear();
+}
+
+void ChunkCRC::update(const uint8_t* data, uint64_t size) {
+    this->size += size;
+    while (size > 0) {
+        uint32_t step = uint32_t(std::min<uint64_t>(size, this->chunkSize - this->filled));
+        this->crc = uint32_t(crc32(this->crc, data, step));
+        this->filled += step;
+        data += step;
+        size -= step;
+        if (this->filled == this->chunkSize) {
+            this->crcs.push_back(this->crc);
+            this->filled = 0;
+            this->crc = IDAT_CRC;
+        }
+    }
+}
+
+void ChunkCRC::finish() {
+    if (this->filled > 0)
+        this->crcs.push_back(this->crc);
+    this->filled = 0;
+    this->crc = IDAT_CRC;
+}
+
+uint32_t ChunkCRC::getChunkSize() const {
+    return this->chunkSize;
+}
+
+uint64_t ChunkCRC::getSize() const {
+    return this->size;
+}
+
+const std::vector<uint32_t>& ChunkCRC::getCRCs() const {
+    return this->crcs;
+}
+
+
+namespace {
+
+// Length or CRC field, most significant byte first
+void storeField(uint8_t* field, uint32_t value) {
+    field[0] = value >> 24;
+    field[1] = (value >> 16) & 0xFF;
+    field[2] = (value >> 8) & 0xFF;
+    field[3] = value & 0xFF;
+}
+
+iovec piece(const void* data, size_t length) {
+    iovec result;
+    result.iov_base = const_cast<void*>(data);
+    result.iov_len = length;
+    return result;
+}
+
+}
+
+
+#ifdef _WIN32
+
+PNGWriter::PNGWriter(const std::string& path) : path(path), buffer(nullptr), file(fopen(path.c_str(), "wb")) {
+    if (this->file == nullptr)
+        throw std::runtime_error("Could not open output file " + path);
+}
+
+PNGWriter::~PNGWriter() {
+    if (this->file != nullptr)
+        fclose(this->file);
+}
+
+PNGWriter::PNGWriter(std::vector<uint8_t>& buffer) : buffer(&buffer), file(nullptr) {}
+
+// No gathered writes here, buffering of stdio keeps small pieces from becoming system calls
+void PNGWriter::writeFile(iovec* pieces, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        if (fwrite(pieces[i].iov_base, 1, pieces[i].iov_len, this->file) != pieces[i].iov_len)
+            throw std::runtime_error("Could not write output file " + this->path);
+}
+
+void PNGWriter::finish() {
+    this->writeChunk("IEND", nullptr, 0);
+    FILE* file = this->file;
+    this->file = nullptr;
+    if (file != nullptr && fclose(file) != 0)
+        throw std::runtime_error("Could not write output file " + this->path);
+}
+
+#else
+
+PNGWriter::PNGWriter(const std::string& path)
+    : path(path), buffer(nullptr), fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)) {
+    if (this->fd < 0)
+        throw std::runtime_error("Could not open output file " + path);
+}
+
+PNGWriter::PNGWriter(std::vector<uint8_t>& buffer) : buffer(&buffer), fd(-1) {}
+
+PNGWriter::~PNGWriter() {
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+namespace {
+
+#ifdef IOV_MAX
+const size_t MAX_PIECES = IOV_MAX;
+#else
+const size_t MAX_PIECES = 1024;
+#endif
+
+}
+
+// Pieces are written with as few writev calls as they allow; partial writes are resumed
+void PNGWriter::writeFile(iovec* pieces, size_t count) {
+    size_t first = 0;
+    while (first < count) {
+        ssize_t written = writev(this->fd, pieces + first, int(std::min(count - first, MAX_PIECES)));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Could not write output file " + this->path);
+        }
+        size_t left = size_t(written);
+        while (first < count && left >= pieces[first].iov_len)
+            left -= pieces[first++].iov_len;
+        if (left > 0) {
+            pieces[first].iov_base = static_cast<uint8_t*>(pieces[first].iov_base) + left;
+            pieces[first].iov_len -= left;
+        }
+    }
+}
+
+void PNGWriter::finish() {
+    this->writeChunk("IEND", nullptr, 0);
+    int fd = this->fd;
+    this->fd = -1;
+    if (fd >= 0 && close(fd) != 0)
+        throw std::runtime_error("Could not write output file " + this->path);
+}
+
+#endif
+
+
+void PNGWriter::writePieces(iovec* pieces, size_t count) {
+    if (this->buffer == nullptr) {
+        this->writeFile(pieces, count);
+        return;
+    }
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+        size += pieces[i].iov_len;
+    // Grows geometrically, so appending chunk by chunk stays linear
+    if (this->buffer->capacity() < this->buffer->size() + size)
+        this->buffer->reserve(std::max(this->buffer->size() + size, this->buffer->capacity() * 2));
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* data = static_cast<const uint8_t*>(pieces[i].iov_base);
+        if (pieces[i].iov_len > 0)
+            this->buffer->insert(this->buffer->end(), data, data + pieces[i].iov_len);
+    }
+}
+
+void PNGWriter::writeSignature(const uint8_t* signature) {
+    iovec pieces[1] = {piece(signature, 8)};
+    this->writePieces(pieces, 1);
+}
+
+void PNGWriter::writeChunks(const chunk* chunks, size_t count) {
+    std::vector<uint8_t> lengths(count * 4);
+    std::vector<iovec> pieces;
+    pieces.reserve(count * 4);
+    for (size_t i = 0; i < count; ++i) {
+        storeField(&lengths[i * 4], chunks[i].length);
+        pieces.push_back(piece(&lengths[i * 4], 4));
+        pieces.push_back(piece(chunks[i].type, 4));
+        pieces.push_back(piece(chunks[i].data, chunks[i].length));
+        pieces.push_back(piece(chunks[i].crc, 4));
+    }
+    this->writePieces(pieces.data(), pieces.size());
+}
+
+void PNGWriter::writeChunk(const char* type, const uint8_t* data, uint32_t length) {
+    uint8_t fields[8];
+    storeField(fields, length);
+    storeField(fields + 4, calculate_crc(type, data, length));
+    iovec pieces[4] = {piece(fields, 4), piece(type, 4), piece(data, length), piece(fields + 4, 4)};
+    this->writePieces(pieces, 4);
+}
+
+void PNGWriter::writeIDAT(const uint8_t* data, uint64_t size, ChunkCRC& checksums) {
+    if (checksums.getSize() == 0)
+        checksums.update(data, size);
+    checksums.finish();
+    const std::vector<uint32_t>& crcs = checksums.getCRCs();
+    if (checksums.getSize() != size || crcs.size() != (size + checksums.getChunkSize() - 1) / checksums.getChunkSize())
+        throw std::runtime_error("IDAT checksums do not match image data");
+
+    // Length and CRC fields of all chunks are laid out first, so pieces can point into them
+    std::vector<uint8_t> fields(crcs.size() * 8);
+    std::vector<iovec> pieces;
+    pieces.reserve(crcs.size() * 4);
+    for (size_t i = 0; i < crcs.size(); ++i) {
+        uint64_t offset = uint64_t(i) * checksums.getChunkSize();
+        uint32_t length = uint32_t(std::min<uint64_t>(checksums.getChunkSize(), size - offset));
+        storeField(&fields[i * 8], length);
+        storeField(&fields[i * 8 + 4], crcs[i]);
+        pieces.push_back(piece(&fields[i * 8], 4));
+        pieces.push_back(piece("IDAT", 4));
+        pieces.push_back(piece(data + offset, length));
+        pieces.push_back(piece(&fields[i * 8 + 4], 4));
+    }
+    this->writePieces(pieces.data(), pieces.size());
+}
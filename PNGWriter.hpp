@@ -0,0 +1,64 @@
+#pragma once
+#ifndef PNGWRITER_HPP
+#define PNGWRITER_HPP
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+struct chunk;
+struct iovec;
+
+// CRCs of IDAT chunks of chunkSize bytes cut from zlib stream, computed while the stream is produced,
+// so every byte is checksummed while it is still in cache instead of on a second pass before writing
+class ChunkCRC {
+    uint32_t chunkSize;
+    uint32_t filled; // Bytes of current chunk
+    uint32_t crc;    // Of type and data of current chunk so far
+    uint64_t size;
+    std::vector<uint32_t> crcs;
+    public:
+        // PNG chunks may hold at most 2^31 - 1 bytes
+        static const uint32_t MAX_CHUNK_SIZE = 0x7FFFFFFF;
+        // 0 means chunks as large as PNG allows, so all but the largest streams are one chunk
+        ChunkCRC(uint32_t chunkSize = 8192);
+        // Forgets checksums of previous stream, keeping their memory
+        void reset();
+        void update(const uint8_t* data, uint64_t size);
+        // Closes last chunk, which may be shorter than chunkSize
+        void finish();
+        uint32_t getChunkSize() const;
+        uint64_t getSize() const;
+        const std::vector<uint32_t>& getCRCs() const;
+};
+
+// Writes PNG file with gathered writes, taking chunk data straight from buffers it already is in,
+// or appends PNG to buffer in memory; throws std::runtime_error when file can not be opened or written
+class PNGWriter {
+    std::string path;
+    std::vector<uint8_t>* buffer; // Null when writing into file
+#ifdef _WIN32
+    FILE* file;
+#else
+    int fd;
+#endif
+    void writePieces(iovec* pieces, size_t count);
+    void writeFile(iovec* pieces, size_t count);
+    public:
+        PNGWriter(const std::string& path);
+        PNGWriter(std::vector<uint8_t>& buffer);
+        // Closes file without IEND if finish was not called
+        ~PNGWriter();
+        PNGWriter(const PNGWriter&) = delete;
+        PNGWriter& operator=(const PNGWriter&) = delete;
+        void writeSignature(const uint8_t* signature);
+        // Writes chunks with their stored CRC
+        void writeChunks(const chunk* chunks, size_t count);
+        void writeChunk(const char* type, const uint8_t* data, uint32_t length);
+        // Writes zlib stream as IDAT chunks of checksums; checksums left empty by codec are computed here
+        void writeIDAT(const uint8_t* data, uint64_t size, ChunkCRC& checksums);
+        // Writes IEND and closes file, if there is one
+        void finish();
+};
+#endif
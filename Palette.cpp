@@ -0,0 +1,130 @@
+#include "Palette.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+uint32_t getDistance(const uint8_t* a, const uint8_t* b) {
+    uint32_t distance = 0;
+    for (int i = 0; i < 4; ++i)
+        distance += (int(a[i]) - int(b[i])) * (int(a[i]) - int(b[i]));
+    return distance;
+}
+
+}
+
+
+Palette::Palette(const Image& image, const m_data& metadata, uint8_t bits) : depth(metadata.bitDepth) {
+    const chunk* plte = image.findChunk("PLTE");
+    uint32_t maxEntries = 1u << metadata.bitDepth;
+    if (plte == nullptr || plte->length == 0 || plte->length % 3 != 0 || plte->length / 3 > 256)
+        throw std::runtime_error("Indexed-color image has no valid PLTE chunk");
+    if (bits > metadata.bitDepth)
+        throw std::runtime_error("Embed mode does not fit image");
+    // Entries no index of bit depth can reach are dropped, as decoders ignore them anyway
+    uint32_t count = std::min(plte->length / 3, maxEntries);
+    const chunk* trns = image.findChunk("tRNS");
+
+    // Entries as RGBA, entries missing from tRNS are opaque
+    std::vector<uint8_t> entries(count * 4);
+    for (uint32_t i = 0; i < count; ++i) {
+        std::copy(plte->data + i * 3, plte->data + i * 3 + 3, &entries[i * 4]);
+        entries[i * 4 + 3] = trns != nullptr && i < trns->length ? trns->data[i] : 255;
+    }
+
+    // Groups are filled from the darkest free entry with its nearest free entries;
+    // group missing entries gets copies of its first one, so every index of it stays valid
+    std::vector<uint32_t> order(count);
+    for (uint32_t i = 0; i < count; ++i)
+        order[i] = i;
+    auto luma = [&](uint32_t i) { return 299 * entries[i * 4] + 587 * entries[i * 4 + 1] + 114 * entries[i * 4 + 2]; };
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return luma(a) < luma(b); });
+
+    uint32_t groupSize = 1u << bits;
+    std::vector<bool> used(count, false);
+    std::vector<uint32_t> newOrder; // Old entry of every new index
+    for (uint32_t i = 0; i < 256; ++i)
+        this->indexMap[i] = uint8_t(i); // Indices past palette are invalid in PNG, they are left alone
+    for (uint32_t seed : order) {
+        if (used[seed])
+            continue;
+        used[seed] = true;
+        this->indexMap[seed] = uint8_t(newOrder.size());
+        newOrder.push_back(seed);
+        for (uint32_t member = 1; member < groupSize; ++member) {
+            uint32_t nearest = count;
+            uint32_t best = UINT32_MAX;
+            for (uint32_t j = 0; j < count; ++j) {
+                uint32_t distance = used[j] ? UINT32_MAX : getDistance(&entries[seed * 4], &entries[j * 4]);
+                if (distance < best) {
+                    best = distance;
+                    nearest = j;
+                }
+            }
+            if (nearest == count) {
+                newOrder.push_back(seed);
+                continue;
+            }
+            used[nearest] = true;
+            this->indexMap[nearest] = uint8_t(newOrder.size());
+            newOrder.push_back(nearest);
+        }
+    }
+
+    this->colors.resize(newOrder.size() * 3);
+    for (uint32_t i = 0; i < newOrder.size(); ++i)
+        std::copy(&entries[newOrder[i] * 4], &entries[newOrder[i] * 4 + 3], &this->colors[i * 3]);
+    if (trns != nullptr) {
+        // Trailing opaque entries need no alpha, but tRNS keeps at least one
+        uint32_t last = 1;
+        for (uint32_t i = 0; i < newOrder.size(); ++i) {
+            if (entries[newOrder[i] * 4 + 3] != 255)
+                last = i + 1;
+        }
+        for (uint32_t i = 0; i < last; ++i)
+            this->alpha.push_back(entries[newOrder[i] * 4 + 3]);
+    }
+
+    // Every byte value of packed row mapped at once, so mapping a row is one lookup per byte
+    uint32_t mask = (1u << this->depth) - 1;
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        uint32_t mapped = 0;
+        for (uint32_t shift = 0; shift < 8; shift += this->depth)
+            mapped |= uint32_t(this->indexMap[(byte >> shift) & mask]) << shift;
+        this->byteMap[byte] = uint8_t(mapped);
+    }
+}
+
+
+void Palette::remapRow(uint8_t* row, uint32_t pixels) const {
+    uint64_t bits = uint64_t(pixels) * this->depth;
+    uint64_t bytes = bits / 8;
+    for (uint64_t i = 0; i < bytes; ++i)
+        row[i] = this->byteMap[row[i]];
+    if (bits % 8 != 0) {
+        uint8_t used = uint8_t(0xFF << (8 - bits % 8));
+        row[bytes] = (this->byteMap[row[bytes]] & used) | (row[bytes] & ~used);
+    }
+}
+
+
+void Palette::remap(uint8_t* data, const m_data& metadata) const {
+    ImagePass passes[ADAM7_PASS_COUNT];
+    uint32_t count = getImagePasses(metadata, passes);
+    for (uint32_t i = 0; i < count; ++i) {
+        for (uint32_t line = 0; line < passes[i].height; ++line)
+            this->remapRow(data + passes[i].offset + uint64_t(line) * passes[i].rowSize + 1, passes[i].width);
+    }
+}
+
+
+void Palette::store(Image& image) const {
+    image.replaceChunk("PLTE", this->colors.data(), this->colors.size());
+    if (!this->alpha.empty())
+        image.replaceChunk("tRNS", this->alpha.data(), this->alpha.size());
+}
+
+
+uint32_t Palette::getSize() const {
+    return this->colors.size() / 3;
+}
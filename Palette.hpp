@@ -0,0 +1,31 @@
+#pragma once
+#ifndef PALETTE_HPP
+#define PALETTE_HPP
+
+#include <vector>
+#include <stdint.h>
+#include "Image.hpp"
+#include "utils.hpp"
+
+// Palette of indexed-color image with entries regrouped for embedding: indices that differ only in
+// the low bits carrying message hold the nearest colors, so changing those bits barely changes the picture.
+// Old indices are mapped to new ones by lookup tables, one lookup per byte of row
+class Palette {
+    std::vector<uint8_t> colors; // RGB triple of every entry, in new order
+    std::vector<uint8_t> alpha;  // Alpha of every entry in new order, empty if image has no tRNS
+    uint8_t indexMap[256];       // New index of every old index
+    uint8_t byteMap[256];        // Row byte with every index packed in it mapped
+    uint8_t depth;
+    public:
+        // Reads PLTE and tRNS of image and groups entries by 2^bits;
+        // throws std::runtime_error if image has no valid PLTE chunk
+        Palette(const Image& image, const m_data& metadata, uint8_t bits);
+        // Maps indices of one row of pixels without filter byte; padding bits of the last byte are kept
+        void remapRow(uint8_t* row, uint32_t pixels) const;
+        // Maps indices of raw image data, every row of every pass
+        void remap(uint8_t* data, const m_data& metadata) const;
+        // Replaces PLTE and tRNS chunks of image by regrouped entries
+        void store(Image& image) const;
+        uint32_t getSize() const;
+};
+#endif
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef PIXELFORMAT_HPP
+#define PIXELFORMAT_HPP
+
+#include <stdint.h>
+#include <stdexcept>
+#include "utils.hpp"
+
+// Layout of samples of one PNG format, known at compile time, so loops over samples do not branch on format
+template <uint8_t Depth, uint8_t Channels>
+struct PixelFormat {
+    static constexpr uint8_t DEPTH = Depth;
+    static constexpr uint8_t CHANNELS = Channels;
+    static constexpr uint32_t BITS_PER_PIXEL = Depth * Channels;
+    static constexpr bool PACKED = Depth < 8; // Several samples share one byte
+    static constexpr uint32_t BYTES_PER_SAMPLE = (Depth + 7) / 8;
+    static constexpr uint32_t BYTES_PER_PIXEL = (BITS_PER_PIXEL + 7) / 8; // At least 1, as used by filters
+
+    // Byte holding the lowest bits of sample, counting samples from the start of row;
+    // 16 bit samples are stored most significant byte first
+    static constexpr uint64_t lowByte(uint64_t sample) {
+        return PACKED ? sample * Depth / 8 : sample * BYTES_PER_SAMPLE + BYTES_PER_SAMPLE - 1;
+    }
+    // Position of the lowest bit of sample in that byte; packed samples fill bytes from the most significant bit
+    static constexpr uint32_t lowShift(uint64_t sample) {
+        return PACKED ? 8 - Depth - uint32_t(sample * Depth % 8) : 0;
+    }
+};
+
+/*Calls visitor with PixelFormat of image; every combination of color type and bit depth PNG allows
+is instantiated, others throw std::runtime_error*/
+template <typename Visitor>
+auto visitPixelFormat(const m_data& metadata, Visitor&& visitor) -> decltype(visitor(PixelFormat<8, 1>())) {
+    switch (metadata.color) {
+        case 0: // Grayscale
+        case 3: // Indexed-color, one index per pixel
+            switch (metadata.bitDepth) {
+                case 1: return visitor(PixelFormat<1, 1>());
+                case 2: return visitor(PixelFormat<2, 1>());
+                case 4: return visitor(PixelFormat<4, 1>());
+                case 8: return visitor(PixelFormat<8, 1>());
+                case 16:
+                    if (metadata.color == 0)
+                        return visitor(PixelFormat<16, 1>());
+                    break;
+            }
+            break;
+        case 2: // Truecolor (RGB)
+            if (metadata.bitDepth == 8) return visitor(PixelFormat<8, 3>());
+            if (metadata.bitDepth == 16) return visitor(PixelFormat<16, 3>());
+            break;
+        case 4: // Grayscale + Alpha
+            if (metadata.bitDepth == 8) return visitor(PixelFormat<8, 2>());
+            if (metadata.bitDepth == 16) return visitor(PixelFormat<16, 2>());
+            break;
+        case 6: // Truecolor + Alpha (RGBA)
+            if (metadata.bitDepth == 8) return visitor(PixelFormat<8, 4>());
+            if (metadata.bitDepth == 16) return visitor(PixelFormat<16, 4>());
+            break;
+    }
+    throw std::runtime_error("Unsupported combination of color type and bit depth");
+}
+#endif
@@ -0,0 +1,66 @@
+#include "RowRing.hpp"
+#include <thread>
+
+namespace {
+
+// Spins briefly, as the other side usually needs only a moment, then gives up time slices
+void backOff(uint32_t& spins) {
+    if (++spins < 64)
+        return;
+    std::this_thread::yield();
+}
+
+}
+
+RowRing::RowRing(uint64_t rowSize, uint32_t capacity)
+    : slots(rowSize * capacity), rowSize(rowSize), capacity(capacity), written(0), knownRead(0),
+      read(0), knownWritten(0), closed(false), cancelled(false) {}
+
+uint8_t* RowRing::beginWrite() {
+    uint64_t next = this->written.load(std::memory_order_relaxed);
+    uint32_t spins = 0;
+    while (next - this->knownRead == this->capacity) {
+        if (this->cancelled.load(std::memory_order_acquire))
+            return nullptr;
+        this->knownRead = this->read.load(std::memory_order_acquire);
+        if (next - this->knownRead == this->capacity)
+            backOff(spins);
+    }
+    if (this->cancelled.load(std::memory_order_relaxed))
+        return nullptr;
+    return this->slots.data() + next % this->capacity * this->rowSize;
+}
+
+void RowRing::endWrite() {
+    this->written.store(this->written.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void RowRing::close() {
+    this->closed.store(true, std::memory_order_release);
+}
+
+const uint8_t* RowRing::beginRead() {
+    uint64_t next = this->read.load(std::memory_order_relaxed);
+    uint32_t spins = 0;
+    while (next == this->knownWritten) {
+        if (this->cancelled.load(std::memory_order_relaxed))
+            return nullptr;
+        // Closed is checked before written, so rows published before closing are not missed
+        bool done = this->closed.load(std::memory_order_acquire);
+        this->knownWritten = this->written.load(std::memory_order_acquire);
+        if (next != this->knownWritten)
+            break;
+        if (done)
+            return nullptr;
+        backOff(spins);
+    }
+    return this->slots.data() + next % this->capacity * this->rowSize;
+}
+
+void RowRing::endRead() {
+    this->read.store(this->read.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void RowRing::cancel() {
+    this->cancelled.store(true, std::memory_order_release);
+}
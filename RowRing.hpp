@@ -0,0 +1,38 @@
+#pragma once
+#ifndef ROWRING_HPP
+#define ROWRING_HPP
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+// Lock-free ring of fixed size rows between one producer thread and one consumer thread.
+// Rows are written and read in place; counters of both sides live on their own cache lines
+class RowRing {
+    std::vector<uint8_t> slots;
+    uint64_t rowSize;
+    uint32_t capacity;
+    alignas(64) std::atomic<uint64_t> written; // Rows published by producer
+    uint64_t knownRead;                        // Producer's last look at read, so it rarely touches that line
+    alignas(64) std::atomic<uint64_t> read;    // Rows released by consumer
+    uint64_t knownWritten;
+    alignas(64) std::atomic<bool> closed;      // Producer writes no more rows
+    std::atomic<bool> cancelled;               // Consumer reads no more rows
+    public:
+        RowRing(uint64_t rowSize, uint32_t capacity);
+        RowRing(const RowRing&) = delete;
+        RowRing& operator=(const RowRing&) = delete;
+        // Waits for a free slot and returns it; nullptr once consumer cancelled
+        uint8_t* beginWrite();
+        // Publishes row of slot returned by beginWrite
+        void endWrite();
+        // Marks end of rows, also after producer failed
+        void close();
+        // Waits for the next row and returns it; nullptr once ring is closed and empty, or cancelled
+        const uint8_t* beginRead();
+        // Frees slot returned by beginRead for producer
+        void endRead();
+        // Stops producer, which gets nullptr from beginWrite
+        void cancel();
+};
+#endif
@@ -0,0 +1,215 @@
+#include "Scanline.hpp"
+#include <stdexcept>
+#include <memory.h>
+
+RowInflater::RowInflater(Image& image, Stats* stats)
+    : strm{}, IDAT_chunks(image.getIDATChunks()), nextChunk(0), stats(stats) {
+    this->strm.zalloc = Z_NULL;
+    this->strm.zfree = Z_NULL;
+    this->strm.opaque = Z_NULL;
+    if (inflateInit(&this->strm) != Z_OK)
+        throw std::runtime_error("Could not initialize inflate");
+}
+
+RowInflater::~RowInflater() {
+    inflateEnd(&this->strm);
+}
+
+void RowInflater::inflateRow(uint8_t* row, uint64_t size) {
+    StageTimer timer(this->stats, Stage::Inflate, 0, size);
+    uint64_t totalIn = this->strm.total_in;
+    this->strm.next_out = row;
+    this->strm.avail_out = size;
+    while (this->strm.avail_out > 0) {
+        if (this->strm.avail_in == 0) {
+            if (this->nextChunk >= this->IDAT_chunks.size())
+                throw ImageDataError("Image data is truncated");
+            auto& chunk = this->IDAT_chunks[this->nextChunk++];
+            this->strm.next_in = const_cast<Bytef*>(chunk.first);
+            this->strm.avail_in = chunk.second;
+        }
+        int ret = inflate(&this->strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END && this->strm.avail_out > 0)
+            throw ImageDataError("Image data is truncated");
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            throw ImageDataError("Image data is corrupted");
+    }
+    timer.setBytesIn(this->strm.total_in - totalIn);
+}
+
+
+ScanlineReader::ScanlineReader(Image& image, const m_data& metadata, Stats* stats)
+    : inflater(image, stats), first(true), stats(stats) {
+    if (metadata.interlance != 0)
+        throw std::runtime_error("Interlaced image cannot be read one scanline at a time");
+    uint64_t rowSize = getScanlineSize(metadata) + 1;
+    this->previous.resize(rowSize);
+    this->current.resize(rowSize);
+    this->row.resize(rowSize);
+    this->rowsLeft = metadata.height;
+    this->bpp = getBytesPerPixel(metadata);
+}
+
+uint8_t* ScanlineReader::next() {
+    if (this->rowsLeft == 0)
+        return nullptr;
+
+    // Row that was current becomes the previous one
+    this->previous.swap(this->current);
+    this->inflater.inflateRow(this->current.data(), this->current.size());
+
+    StageTimer unfilterTimer(this->stats, Stage::Unfilter, this->current.size(), this->current.size());
+    filterScanline(this->current.data(), this->first ? nullptr : this->previous.data(),
+        this->current.size() - 1, this->bpp, true);
+    this->first = false;
+    this->rowsLeft--;
+    // Next row is reconstructed from this one as it was decoded, not as the caller leaves it
+    memcpy(this->row.data(), this->current.data(), this->row.size());
+    return this->row.data();
+}
+
+
+PipelinedReader::PipelinedReader(Image& image, const m_data& metadata, Stats* stats, uint32_t depth)
+    : inflater(image, stats), inflated(getScanlineSize(metadata) + 1, depth),
+      reconstructed(getScanlineSize(metadata) + 1, depth), reading(false), stats(stats) {
+    if (metadata.interlance != 0)
+        throw std::runtime_error("Interlaced image cannot be read one scanline at a time");
+    uint64_t rowSize = getScanlineSize(metadata) + 1;
+    this->inflateThread = std::thread(&PipelinedReader::inflateRows, this, metadata.height, rowSize);
+    this->unfilterThread = std::thread(&PipelinedReader::unfilterRows, this, rowSize, getBytesPerPixel(metadata));
+}
+
+PipelinedReader::~PipelinedReader() {
+    this->reconstructed.cancel();
+    this->inflated.cancel();
+    this->inflateThread.join();
+    this->unfilterThread.join();
+}
+
+void PipelinedReader::inflateRows(uint32_t rows, uint64_t rowSize) {
+    try {
+        for (uint32_t line = 0; line < rows; ++line) {
+            uint8_t* slot = this->inflated.beginWrite();
+            if (slot == nullptr)
+                break;
+            this->inflater.inflateRow(slot, rowSize);
+            this->inflated.endWrite();
+        }
+    } catch (...) {
+        this->inflateError = std::current_exception();
+    }
+    this->inflated.close();
+}
+
+void PipelinedReader::unfilterRows(uint64_t rowSize, int bpp) {
+    // Row above is kept aside, as the caller may still hold its slot or it may be taken by a new row
+    std::vector<uint8_t> previous(rowSize);
+    bool first = true;
+    try {
+        while (const uint8_t* filtered = this->inflated.beginRead()) {
+            uint8_t* slot = this->reconstructed.beginWrite();
+            if (slot == nullptr)
+                break;
+            {
+                StageTimer timer(this->stats, Stage::Unfilter, rowSize, rowSize);
+                memcpy(slot, filtered, rowSize);
+                this->inflated.endRead();
+                filterScanline(slot, first ? nullptr : previous.data(), rowSize - 1, bpp, true);
+                memcpy(previous.data(), slot, rowSize);
+            }
+            first = false;
+            this->reconstructed.endWrite();
+        }
+    } catch (...) {
+        this->unfilterError = std::current_exception();
+    }
+    this->reconstructed.close();
+}
+
+const uint8_t* PipelinedReader::next() {
+    if (this->reading)
+        this->reconstructed.endRead();
+    const uint8_t* row = this->reconstructed.beginRead();
+    this->reading = row != nullptr;
+    if (row == nullptr) {
+        // Rings are closed after errors are stored, so they are seen here
+        if (this->inflateError)
+            std::rethrow_exception(this->inflateError);
+        if (this->unfilterError)
+            std::rethrow_exception(this->unfilterError);
+    }
+    return row;
+}
+
+
+ScanlineWriter::ScanlineWriter(std::ostream& output, const m_data& metadata, FilterStrategy strategy,
+                               uint32_t chunkSize, Stats* stats, int level, int zlibStrategy)
+    : strm{}, output(output), selector(getScanlineSize(metadata), getBytesPerPixel(metadata), strategy),
+      hasPrevious(false), stats(stats) {
+    if (metadata.interlance != 0)
+        throw std::runtime_error("Interlaced image cannot be written one scanline at a time");
+    uint64_t rowSize = getScanlineSize(metadata) + 1;
+    this->previous.resize(rowSize);
+    this->filtered.resize(rowSize);
+    this->chunkBuffer.resize(chunkSize);
+    this->bpp = getBytesPerPixel(metadata);
+
+    this->strm.zalloc = Z_NULL;
+    this->strm.zfree = Z_NULL;
+    this->strm.opaque = Z_NULL;
+    if (deflateInit2(&this->strm, level, Z_DEFLATED, 15, 8, zlibStrategy) != Z_OK)
+        throw std::runtime_error("Could not initialize deflate");
+    this->strm.next_out = this->chunkBuffer.data();
+    this->strm.avail_out = this->chunkBuffer.size();
+}
+
+ScanlineWriter::~ScanlineWriter() {
+    deflateEnd(&this->strm);
+}
+
+void ScanlineWriter::deflateRow(int flush) {
+    StageTimer timer(this->stats, Stage::Deflate, this->strm.avail_in);
+    uint64_t totalOut = this->strm.total_out;
+    int ret = Z_OK;
+    do {
+        ret = deflate(&this->strm, flush);
+        // Every full buffer becomes one IDAT chunk
+        if (this->strm.avail_out == 0) {
+            writeChunk(this->output, "IDAT", this->chunkBuffer.data(), this->chunkBuffer.size());
+            this->strm.next_out = this->chunkBuffer.data();
+            this->strm.avail_out = this->chunkBuffer.size();
+        }
+    } while (this->strm.avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    timer.setBytesOut(this->strm.total_out - totalOut);
+}
+
+void ScanlineWriter::write(const uint8_t* row) {
+    uint64_t rowSize = this->filtered.size();
+    {
+        StageTimer timer(this->stats, Stage::ChooseFilters, rowSize);
+        memcpy(this->filtered.data(), row, rowSize);
+        this->filtered[0] = this->selector.choose(row, this->hasPrevious ? this->previous.data() : nullptr);
+    }
+    {
+        StageTimer timer(this->stats, Stage::Filter, rowSize, rowSize);
+        filterScanline(this->filtered.data(), this->hasPrevious ? this->previous.data() : nullptr,
+            rowSize - 1, this->bpp, false);
+    }
+    // Filtering of the next row needs this row unfiltered
+    memcpy(this->previous.data(), row, this->previous.size());
+    this->hasPrevious = true;
+
+    this->strm.next_in = this->filtered.data();
+    this->strm.avail_in = this->filtered.size();
+    this->deflateRow(Z_NO_FLUSH);
+}
+
+void ScanlineWriter::finish() {
+    this->strm.next_in = nullptr;
+    this->strm.avail_in = 0;
+    this->deflateRow(Z_FINISH);
+
+    uint32_t pending = this->chunkBuffer.size() - this->strm.avail_out;
+    if (pending > 0)
+        writeChunk(this->output, "IDAT", this->chunkBuffer.data(), pending);
+}
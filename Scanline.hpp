@@ -0,0 +1,98 @@
+#pragma once
+#ifndef SCANLINE_HPP
+#define SCANLINE_HPP
+
+#include <vector>
+#include <ostream>
+#include <thread>
+#include <exception>
+#include <stdint.h>
+#include <zlib.h>
+#include "Image.hpp"
+#include "utils.hpp"
+#include "FilterSelector.hpp"
+#include "Stats.hpp"
+#include "RowRing.hpp"
+
+// Inflates data of IDAT chunks a given number of bytes at a time
+class RowInflater {
+    z_stream strm;
+    const std::vector<std::pair<const unsigned char*, uint32_t>>& IDAT_chunks;
+    size_t nextChunk;
+    Stats* stats;
+    public:
+        RowInflater(Image& image, Stats* stats = nullptr);
+        ~RowInflater();
+        RowInflater(const RowInflater&) = delete;
+        RowInflater& operator=(const RowInflater&) = delete;
+        // Fills row with the next size bytes; throws std::runtime_error if data is truncated or corrupted
+        void inflateRow(uint8_t* row, uint64_t size);
+};
+
+// Inflates and reconstructs image data one scanline at a time,
+// keeping only the current and the previous row in memory; interlaced images are not supported
+class ScanlineReader {
+    RowInflater inflater;
+    bool first;
+    std::vector<uint8_t> previous; // Reconstructed row above, with filter byte
+    std::vector<uint8_t> current;
+    std::vector<uint8_t> row; // Copy of current handed out, so callers can change it
+    uint32_t rowsLeft;
+    int bpp;
+    Stats* stats;
+    public:
+        // Inflating and reconstructing of every row is recorded into stats when given
+        ScanlineReader(Image& image, const m_data& metadata, Stats* stats = nullptr);
+        // Returns reconstructed row starting with its filter byte, or nullptr after the last row;
+        // changes of the row do not affect reconstruction of the next one
+        uint8_t* next();
+};
+
+// Reads rows like ScanlineReader, but inflating and reconstructing run on threads of their own,
+// connected by rings of rows: while the caller uses row N, row N + 1 is reconstructed and later rows are inflated
+class PipelinedReader {
+    RowInflater inflater;
+    RowRing inflated;      // Filtered rows, from inflating to reconstructing thread
+    RowRing reconstructed; // Reconstructed rows, to caller
+    std::exception_ptr inflateError;
+    std::exception_ptr unfilterError;
+    std::thread inflateThread;
+    std::thread unfilterThread;
+    bool reading; // Caller holds a row of reconstructed ring
+    Stats* stats;
+    void inflateRows(uint32_t rows, uint64_t rowSize);
+    void unfilterRows(uint64_t rowSize, int bpp);
+    public:
+        // Rings hold depth rows each; inflating and reconstructing of every row is recorded into stats when given
+        PipelinedReader(Image& image, const m_data& metadata, Stats* stats = nullptr, uint32_t depth = 32);
+        // Stops both threads, also when rows are left
+        ~PipelinedReader();
+        // Returns reconstructed row starting with its filter byte, valid until the next call, or nullptr after the last row;
+        // rethrows error of inflating or reconstructing
+        const uint8_t* next();
+};
+
+// Filters and deflates raw scanlines one at a time, writing IDAT chunks of at most chunkSize bytes
+// as the compressed data is produced, at given zlib level and strategy; interlaced images are not supported
+class ScanlineWriter {
+    z_stream strm;
+    std::ostream& output;
+    std::vector<uint8_t> previous; // Raw row above, with filter byte
+    std::vector<uint8_t> filtered;
+    std::vector<uint8_t> chunkBuffer;
+    FilterSelector selector;
+    bool hasPrevious;
+    int bpp;
+    Stats* stats;
+    void deflateRow(int flush);
+    public:
+        ScanlineWriter(std::ostream& output, const m_data& metadata,
+                       FilterStrategy strategy = FilterStrategy::Keep, uint32_t chunkSize = 8192, Stats* stats = nullptr,
+                       int level = Z_BEST_COMPRESSION, int zlibStrategy = Z_DEFAULT_STRATEGY);
+        ~ScanlineWriter();
+        // Takes raw row starting with its original filter byte, which is kept or replaced by strategy
+        void write(const uint8_t* row);
+        // Flushes remaining compressed data; must be called after the last row
+        void finish();
+};
+#endif
@@ -0,0 +1,65 @@
+#include "ScatterOrder.hpp"
+#include <algorithm>
+
+namespace {
+
+// Not a cryptographic key derivation: it only has to make order depend on every byte of password
+uint64_t hashPassword(const std::string& password) {
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+    for (unsigned char c : password) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// splitmix64 generator, state advances on every call
+uint64_t nextRandom(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+}
+
+
+ScatterOrder::ScatterOrder(const m_data& metadata, const std::string& password) : width(metadata.width) {
+    if (metadata.width == 0 || metadata.height == 0)
+        return;
+    uint64_t state = hashPassword(password);
+    uint64_t scanline = std::max<uint64_t>(getScanlineSize(metadata), 1);
+    uint32_t bandRows = uint32_t(std::min<uint64_t>(std::max<uint64_t>(BAND_BYTES / scanline, 1), metadata.height));
+    uint32_t count = (metadata.height + bandRows - 1) / bandRows;
+
+    std::vector<uint32_t> order(count);
+    for (uint32_t i = 0; i < count; ++i)
+        order[i] = i;
+    for (uint32_t i = count - 1; i > 0; --i)
+        std::swap(order[i], order[nextRandom(state) % (i + 1)]);
+
+    this->bands.resize(count);
+    uint64_t firstPixel = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        Band& band = this->bands[i];
+        band.firstRow = order[i] * bandRows;
+        band.rows = std::min(bandRows, metadata.height - band.firstRow);
+        band.firstPixel = firstPixel;
+        uint64_t pixels = uint64_t(band.rows) * metadata.width;
+        firstPixel += pixels;
+        band.start = nextRandom(state) % pixels;
+        // Stride from the middle half of band, so neighbouring visits land far apart
+        band.stride = pixels < 4 ? 1 : pixels / 4 + nextRandom(state) % (pixels / 2);
+        while (gcd(band.stride, pixels) != 1)
+            band.stride++;
+    }
+}
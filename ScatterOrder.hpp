@@ -0,0 +1,73 @@
+#pragma once
+#ifndef SCATTERORDER_HPP
+#define SCATTERORDER_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "utils.hpp"
+
+// Order in which keyed embedding visits pixels, derived from password.
+// Image is cut into bands of whole rows of about BAND_BYTES, so one band stays in cache;
+// bands are visited in shuffled order and inside band of n pixels the o-th visited pixel
+// is (start + o * stride) mod n, with stride coprime to n, so every pixel is visited once
+class ScatterOrder {
+    public:
+        struct Band {
+            uint32_t firstRow;
+            uint32_t rows;
+            uint64_t firstPixel; // Visited pixels of bands before this one
+            uint64_t start;
+            uint64_t stride;
+        };
+        static const uint64_t BAND_BYTES = 32 * 1024;
+    private:
+        std::vector<Band> bands; // In visiting order
+        uint32_t width;
+    public:
+        ScatterOrder(const m_data& metadata, const std::string& password);
+        // Calls visit(row, column) for visited pixels from visited pixel first on,
+        // until visit returns false or all pixels are visited; returns false in that last case
+        template <typename Visit>
+        bool forEachPixel(uint64_t first, Visit visit) const;
+};
+
+
+template <typename Visit>
+bool ScatterOrder::forEachPixel(uint64_t first, Visit visit) const {
+    // Band holding first, bands are sorted by firstPixel
+    size_t band = 0;
+    for (size_t low = 0, high = this->bands.size(); low < high;) {
+        size_t middle = (low + high) / 2;
+        if (this->bands[middle].firstPixel <= first) {
+            band = middle;
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    uint64_t offset = this->bands.empty() ? 0 : first - this->bands[band].firstPixel;
+    for (; band < this->bands.size(); ++band, offset = 0) {
+        const Band& b = this->bands[band];
+        uint64_t count = uint64_t(b.rows) * this->width;
+        // Position is tracked as row and column, so stepping needs no division
+        uint64_t position = (b.start + offset % count * b.stride) % count;
+        uint32_t row = uint32_t(position / this->width);
+        uint32_t column = uint32_t(position % this->width);
+        uint32_t rowStep = uint32_t(b.stride / this->width);
+        uint32_t columnStep = uint32_t(b.stride % this->width);
+        for (; offset < count; ++offset) {
+            if (!visit(b.firstRow + row, column))
+                return true;
+            // Wraps depend on key and are taken about every other step, so they are computed without branches
+            column += columnStep;
+            uint32_t carry = column >= this->width;
+            column -= carry * this->width;
+            row += rowStep + carry;
+            row -= (row >= b.rows) * b.rows;
+        }
+    }
+    return false;
+}
+#endif
@@ -0,0 +1,230 @@
+#include "Stats.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace {
+
+std::atomic<uint64_t> allocatedBytes(0);
+std::atomic<uint64_t> peakBytes(0);
+std::atomic<uint64_t> allocationCount(0);
+thread_local uint64_t threadAllocationCount = 0;
+
+// Size of every block is kept in front of it, so freeing knows how many bytes go away
+const size_t BLOCK_HEADER = alignof(std::max_align_t);
+
+double getThreadCPUTime() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+    uint64_t ticks = (uint64_t(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) +
+                     (uint64_t(user.dwHighDateTime) << 32 | user.dwLowDateTime);
+    return ticks * 1e-7; // 100 ns units
+#else
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+#endif
+}
+
+// Small thread numbers for trace events, in order threads first record something
+uint32_t getThreadNumber() {
+    static std::atomic<uint32_t> nextNumber(1);
+    thread_local uint32_t number = nextNumber++;
+    return number;
+}
+
+}
+
+void* allocateCounted(size_t size) noexcept {
+    // Size header must not wrap around to a block too small for it
+    if (size > SIZE_MAX - BLOCK_HEADER)
+        return nullptr;
+    char* block = static_cast<char*>(std::malloc(size + BLOCK_HEADER));
+    if (block == nullptr)
+        return nullptr;
+    *reinterpret_cast<size_t*>(block) = size;
+    uint64_t now = allocatedBytes += size;
+    allocationCount++;
+    threadAllocationCount++;
+    uint64_t peak = peakBytes.load(std::memory_order_relaxed);
+    while (now > peak && !peakBytes.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {}
+    return block + BLOCK_HEADER;
+}
+
+void releaseCounted(void* pointer) noexcept {
+    if (pointer == nullptr)
+        return;
+    char* block = static_cast<char*>(pointer) - BLOCK_HEADER;
+    allocatedBytes -= *reinterpret_cast<size_t*>(block);
+    std::free(block);
+}
+
+
+uint64_t getAllocatedBytes() {
+    return allocatedBytes;
+}
+
+uint64_t getPeakAllocatedBytes() {
+    return peakBytes;
+}
+
+uint64_t getAllocationCount() {
+    return allocationCount;
+}
+
+uint64_t getThreadAllocationCount() {
+    return threadAllocationCount;
+}
+
+void resetPeakAllocatedBytes() {
+    peakBytes = allocatedBytes.load();
+}
+
+
+const char* getStageName(Stage stage) {
+    static const char* names[STAGE_COUNT] = {
+        "read", "parse", "inflate", "unfilter", "embed", "extract", "choose_filters", "filter", "deflate", "write"
+    };
+    return names[size_t(stage)];
+}
+
+
+Stats::Stats(bool tracing) : tracing(tracing), created(std::chrono::steady_clock::now()) {}
+
+void Stats::record(Stage stage, std::chrono::steady_clock::time_point start, double wallSeconds,
+                   double cpuSeconds, uint64_t bytesIn, uint64_t bytesOut, uint64_t allocations) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    StageStats& totals = this->stages[size_t(stage)];
+    totals.wallSeconds += wallSeconds;
+    totals.cpuSeconds += cpuSeconds;
+    totals.bytesIn += bytesIn;
+    totals.bytesOut += bytesOut;
+    totals.allocations += allocations;
+    totals.runs++;
+    if (this->tracing) {
+        double offset = std::chrono::duration<double>(start - this->created).count();
+        this->events.push_back(Event{stage, offset, wallSeconds, getThreadNumber()});
+    }
+}
+
+StageStats Stats::getStage(Stage stage) const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->stages[size_t(stage)];
+}
+
+double Stats::getCompressionRatio() const {
+    StageStats deflate = this->getStage(Stage::Deflate);
+    return deflate.bytesIn == 0 ? 0 : double(deflate.bytesOut) / deflate.bytesIn;
+}
+
+void Stats::print(std::ostream& output) const {
+    std::ios::fmtflags flags = output.flags();
+    output << std::left << std::setw(16) << "stage" << std::right << std::setw(8) << "runs" << std::setw(12) << "wall ms"
+           << std::setw(12) << "cpu ms" << std::setw(14) << "bytes in" << std::setw(14) << "bytes out" << std::setw(10) << "allocs" << std::endl;
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+        StageStats stage = this->getStage(Stage(i));
+        if (stage.runs == 0)
+            continue;
+        output << std::left << std::setw(16) << getStageName(Stage(i)) << std::right << std::setw(8) << stage.runs
+               << std::fixed << std::setprecision(2) << std::setw(12) << stage.wallSeconds * 1e3
+               << std::setw(12) << stage.cpuSeconds * 1e3 << std::setw(14) << stage.bytesIn
+               << std::setw(14) << stage.bytesOut << std::setw(10) << stage.allocations << std::endl;
+    }
+    output << "Compression ratio: " << std::setprecision(4) << this->getCompressionRatio() << std::endl;
+    if (getAllocationCount() != 0)
+        output << "Peak allocated: " << getPeakAllocatedBytes() << " bytes in " << getAllocationCount() << " allocations" << std::endl;
+    else
+        output << "Peak allocated: not counted" << std::endl;
+    output.flags(flags);
+}
+
+void Stats::writeJSON(std::ostream& output) const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::ios::fmtflags flags = output.flags();
+    output << std::fixed << std::setprecision(3);
+    output << "{\n  \"stages\": {";
+    bool first = true;
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+        const StageStats& stage = this->stages[i];
+        if (stage.runs == 0)
+            continue;
+        output << (first ? "" : ",") << "\n    \"" << getStageName(Stage(i)) << "\": {\"runs\": " << stage.runs
+               << ", \"wall_ms\": " << stage.wallSeconds * 1e3 << ", \"cpu_ms\": " << stage.cpuSeconds * 1e3
+               << ", \"bytes_in\": " << stage.bytesIn << ", \"bytes_out\": " << stage.bytesOut
+               << ", \"allocations\": " << stage.allocations << "}";
+        first = false;
+    }
+    const StageStats& deflate = this->stages[size_t(Stage::Deflate)];
+    output << "\n  },\n  \"compression_ratio\": " << std::setprecision(6)
+           << (deflate.bytesIn == 0 ? 0 : double(deflate.bytesOut) / deflate.bytesIn);
+    if (getAllocationCount() != 0)
+        output << ",\n  \"peak_allocated_bytes\": " << getPeakAllocatedBytes()
+               << ",\n  \"allocations\": " << getAllocationCount();
+
+    // Complete events, times in microseconds
+    output << ",\n  \"traceEvents\": [" << std::setprecision(1);
+    for (size_t i = 0; i < this->events.size(); ++i) {
+        const Event& event = this->events[i];
+        output << (i ? "," : "") << "\n    {\"name\": \"" << getStageName(event.stage) << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+               << event.thread << ", \"ts\": " << event.start * 1e6 << ", \"dur\": " << event.duration * 1e6 << "}";
+    }
+    output << "\n  ]\n}\n";
+    output.flags(flags);
+}
+
+
+StageTimer::StageTimer(Stats* stats, Stage stage, uint64_t bytesIn, uint64_t bytesOut)
+    : stats(stats), stage(stage), bytesIn(bytesIn), bytesOut(bytesOut), cpuStart(0), allocationsStart(0), running(false) {
+    this->begin();
+}
+
+StageTimer::~StageTimer() {
+    this->end();
+}
+
+void StageTimer::begin() {
+    if (this->stats == nullptr)
+        return;
+    this->running = true;
+    this->start = std::chrono::steady_clock::now();
+    this->cpuStart = getThreadCPUTime();
+    this->allocationsStart = threadAllocationCount;
+}
+
+void StageTimer::end() {
+    if (!this->running)
+        return;
+    this->running = false;
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+    this->stats->record(this->stage, this->start, wall, getThreadCPUTime() - this->cpuStart, this->bytesIn, this->bytesOut,
+                        threadAllocationCount - this->allocationsStart);
+}
+
+void StageTimer::setBytesIn(uint64_t bytes) {
+    this->bytesIn = bytes;
+}
+
+void StageTimer::setBytesOut(uint64_t bytes) {
+    this->bytesOut = bytes;
+}
+
+void StageTimer::restart(Stage stage, uint64_t bytesIn, uint64_t bytesOut) {
+    this->end();
+    this->stage = stage;
+    this->bytesIn = bytesIn;
+    this->bytesOut = bytesOut;
+    this->begin();
+}
+
+void StageTimer::stop() {
+    this->end();
+}
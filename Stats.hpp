@@ -0,0 +1,115 @@
+#pragma once
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Stages of embedding pipeline, in order of processing
+enum class Stage {
+    Read,          // Mapping input file
+    Parse,         // Splitting file into chunks
+    Inflate,
+    Unfilter,
+    Embed,
+    Extract,
+    ChooseFilters,
+    Filter,
+    Deflate,
+    Write          // Writing chunks of output file
+};
+const size_t STAGE_COUNT = 10;
+
+/*Returns name of stage as used in reports*/
+const char* getStageName(Stage stage);
+
+// Totals of all runs of one stage
+struct StageStats {
+    double wallSeconds = 0;
+    double cpuSeconds = 0; // CPU time of the thread running the stage, without its helper threads
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t allocations = 0; // Heap allocations made by the thread running the stage
+    uint64_t runs = 0;
+};
+
+// Collects totals of stages and, when tracing, every single run of a stage;
+// one instance can be shared by threads
+class Stats {
+    struct Event {
+        Stage stage;
+        double start;    // Seconds since stats were created
+        double duration;
+        uint32_t thread;
+    };
+    StageStats stages[STAGE_COUNT];
+    std::vector<Event> events;
+    bool tracing;
+    std::chrono::steady_clock::time_point created;
+    mutable std::mutex mutex;
+    public:
+        Stats(bool tracing = false);
+        void record(Stage stage, std::chrono::steady_clock::time_point start, double wallSeconds,
+                    double cpuSeconds, uint64_t bytesIn, uint64_t bytesOut, uint64_t allocations = 0);
+        StageStats getStage(Stage stage) const;
+        // Deflate output bytes per input byte, 0 if nothing was deflated
+        double getCompressionRatio() const;
+        // Writes table of stages, compression ratio and peak allocation
+        void print(std::ostream& output) const;
+        // Writes totals and events as JSON in trace event format, so it also opens in chrome://tracing
+        void writeJSON(std::ostream& output) const;
+};
+
+// Times one run of stage, from construction to destruction; does nothing without stats
+class StageTimer {
+    Stats* stats;
+    Stage stage;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    std::chrono::steady_clock::time_point start;
+    double cpuStart;
+    uint64_t allocationsStart;
+    bool running;
+    void begin();
+    void end();
+    public:
+        StageTimer(Stats* stats, Stage stage, uint64_t bytesIn = 0, uint64_t bytesOut = 0);
+        ~StageTimer();
+        StageTimer(const StageTimer&) = delete;
+        StageTimer& operator=(const StageTimer&) = delete;
+        void setBytesIn(uint64_t bytes);
+        void setBytesOut(uint64_t bytes);
+        // Records run of current stage and starts timing the next one
+        void restart(Stage stage, uint64_t bytesIn = 0, uint64_t bytesOut = 0);
+        // Records run of current stage early, until restart nothing more is timed
+        void stop();
+};
+
+/*Allocates size bytes that the functions below count, returning nullptr on failure. The library never replaces
+global operator new; a program counts its heap allocations by doing so with these functions, as main.cpp does
+when built with STEG_COUNT_ALLOCATIONS, and otherwise every count stays 0. Counts are of the whole process,
+so peak of jobs running at once covers all of them*/
+void* allocateCounted(size_t size) noexcept;
+
+/*Frees block returned by allocateCounted*/
+void releaseCounted(void* pointer) noexcept;
+
+/*Returns bytes currently allocated by operator new*/
+uint64_t getAllocatedBytes();
+
+/*Returns largest number of bytes allocated by operator new at once*/
+uint64_t getPeakAllocatedBytes();
+
+/*Returns number of operator new calls*/
+uint64_t getAllocationCount();
+
+/*Returns number of operator new calls made by calling thread*/
+uint64_t getThreadAllocationCount();
+
+/*Starts measuring peak again from bytes allocated now*/
+void resetPeakAllocatedBytes();
+#endif
@@ -0,0 +1,509 @@
+#include "Stego.hpp"
+#include "Arena.hpp"
+#include "Image.hpp"
+#include "MappedFile.hpp"
+#include "PNGWriter.hpp"
+#include "Palette.hpp"
+#include "Scanline.hpp"
+#include "Stats.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+
+namespace {
+
+// Runs step, turning exception it throws into error of result; returns false if it threw.
+// Image data that cannot be inflated is fault of image whichever step finds it
+template <typename Step>
+bool runStep(StegoResult& result, StegoError error, Step step) {
+    try {
+        step();
+        return true;
+    } catch (const std::bad_alloc&) {
+        result.error = StegoError::Failed;
+        result.description = "Out of memory";
+    } catch (const ImageDataError& e) {
+        result.error = StegoError::InvalidImage;
+        result.description = e.what();
+    } catch (const std::exception& e) {
+        result.error = error;
+        result.description = e.what();
+    }
+    return false;
+}
+
+void fail(StegoResult& result, StegoError error, const char* description) {
+    result.error = error;
+    result.description = description;
+}
+
+// Inflates IDAT chunks of image into size bytes of output
+void inflateImage(Image& image, uint8_t* output, uint64_t size) {
+    z_stream strm{};
+    if (inflateInit(&strm) != Z_OK)
+        throw std::runtime_error("Could not initialize inflate");
+    bool complete = decompress(&strm, image.getIDATChunks(), output, size);
+    inflateEnd(&strm);
+    if (!complete)
+        throw ImageDataError("Image data is truncated or corrupted");
+}
+
+
+// Picks channels and builds frame of message for image, telling apart why it can not be embedded;
+// letters name channels of images storing them in other order than PNG. Returns false on failure
+bool prepareFrame(StegoResult& result, const m_data& metadata, const char* letters, const std::string& message,
+                  const EmbedOptions& options, FrameHeader& header, std::string& payload) {
+    EmbedMode mode = options.mode;
+    if (!options.channels.empty() &&
+        !runStep(result, StegoError::InvalidOptions, [&]() { mode.channels = parseChannels(options.channels.c_str(), metadata, letters); }))
+        return false;
+    if (!checkEmbedMode(metadata, mode)) {
+        fail(result, StegoError::UnsupportedMode, "Embed mode does not fit image");
+        return false;
+    }
+    // Frame is built here rather than by encodeMessage, so message not fitting is told apart from other failures
+    if (message.length() > UINT32_MAX) {
+        fail(result, StegoError::MessageTooLong, "Message does not fit into image");
+        return false;
+    }
+    if (!runStep(result, StegoError::Failed, [&]() { payload = framePayload(message, mode, options.packing, header); }))
+        return false;
+    if (header.length > getMessageCapacity(metadata, mode, header.flags)) {
+        fail(result, StegoError::MessageTooLong, "Message does not fit into image");
+        return false;
+    }
+    return true;
+}
+
+
+// Embeds message into pixels of uncompressed image file, changing nothing unless it fits
+void embedRaw(uint8_t* file, size_t length, const std::string& message, const EmbedOptions& options, StegoResult& result) {
+    if (options.inChunk) {
+        fail(result, StegoError::InvalidOptions, "Raw images have no chunks to carry message");
+        return;
+    }
+    StageTimer timer(options.stats, Stage::Parse, length);
+    RawLayout layout{};
+    if (!runStep(result, StegoError::InvalidImage, [&]() { layout = readRawImage(file, length); }))
+        return;
+    timer.stop();
+    FrameHeader header{};
+    std::string payload;
+    if (!prepareFrame(result, layout.metadata, layout.channels, message, options, header, payload))
+        return;
+    timer.restart(Stage::Embed, header.length);
+    runStep(result, StegoError::Failed, [&]() {
+        encodeRows(file + layout.offset, layout.stride, payload, header, layout.metadata, options.password);
+    });
+}
+
+
+// Opens writer of PNG file at path, or into png of result if path is null;
+// idatBytes are bytes of IDAT chunks with their fields, other chunks are those of image
+std::unique_ptr<PNGWriter> openOutput(const char* path, Image& image, uint64_t idatBytes, StegoResult& result) {
+    if (path != nullptr)
+        return std::unique_ptr<PNGWriter>(new PNGWriter(path));
+    // Whole file is appended to one allocation
+    uint64_t outputSize = 8 + idatBytes;
+    for (auto& chunk : image.getOtherChunks())
+        outputSize += 12 + uint64_t(chunk.length);
+    result.png.reserve(outputSize);
+    return std::unique_ptr<PNGWriter>(new PNGWriter(result.png));
+}
+
+
+// Stores frame of message in payload chunks of image, writing its IDAT chunks as they are in file
+void embedChunk(const uint8_t* png, Image& image, const std::string& message, const char* path,
+                const EmbedOptions& options, StageTimer& timer, StegoResult& result) {
+    if (message.length() > UINT32_MAX) {
+        fail(result, StegoError::MessageTooLong, "Message does not fit into chunk");
+        return;
+    }
+    timer.restart(Stage::Embed, message.length());
+    FrameHeader header{};
+    std::string payload;
+    if (!runStep(result, StegoError::Failed, [&]() {
+            payload = framePayload(message, DEFAULT_EMBED_MODE, options.packing, header);
+            maskPayload(reinterpret_cast<uint8_t*>(&payload[0]), payload.length(), 0, options.password);
+            // Frame of earlier embedding is replaced
+            image.removeChunks(PAYLOAD_CHUNK_TYPE);
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(payload.data());
+            for (uint64_t offset = 0; offset < payload.length(); offset += ChunkCRC::MAX_CHUNK_SIZE)
+                image.addChunk(PAYLOAD_CHUNK_TYPE, bytes + offset,
+                               uint32_t(std::min<uint64_t>(ChunkCRC::MAX_CHUNK_SIZE, payload.length() - offset)));
+        }))
+        return;
+    timer.setBytesOut(payload.length());
+
+    timer.restart(Stage::Write, image.getIDATSize() + payload.length());
+    runStep(result, StegoError::Failed, [&]() {
+        // Parsed IDAT chunks are views into file, each CRC right behind its data
+        auto& idatChunks = image.getIDATChunks();
+        std::vector<chunk> idat(idatChunks.size());
+        for (size_t i = 0; i < idatChunks.size(); ++i) {
+            idat[i].length = idatChunks[i].second;
+            memcpy(idat[i].type, "IDAT", 4);
+            idat[i].data = idatChunks[i].first;
+            memcpy(idat[i].crc, idatChunks[i].first + idatChunks[i].second, 4);
+        }
+        std::unique_ptr<PNGWriter> output = openOutput(path, image, image.getIDATSize() + 12 * idat.size(), result);
+        auto& otherChunks = image.getOtherChunks();
+        output->writeSignature(png);
+        output->writeChunks(otherChunks.data(), otherChunks.size() - 1);
+        output->writeChunks(idat.data(), idat.size());
+        output->finish();
+        timer.stop();
+    });
+}
+
+
+// Embeds frame into image while inflating, reconstructing, filtering and deflating one scanline at a time,
+// writing new PNG file to path; memory use depends only on width of image. Partial file is removed on failure
+void streamInto(const uint8_t* png, Image& image, const m_data& metadata, const std::string& payload,
+                const FrameHeader& header, const char* path, const EmbedOptions& options, int level, int zlibStrategy,
+                StegoResult& result) {
+    // Palette is regrouped before its chunks are written, rows are mapped as they come
+    std::unique_ptr<Palette> palette;
+    std::unique_ptr<ScanlineReader> reader;
+    if (!runStep(result, StegoError::InvalidImage, [&]() {
+            if (metadata.color == 3) {
+                palette.reset(new Palette(image, metadata, options.mode.bits));
+                palette->store(image);
+            }
+            reader.reset(new ScanlineReader(image, metadata, options.stats));
+        }))
+        return;
+
+    runStep(result, StegoError::Failed, [&]() {
+        std::ofstream output(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!output.is_open())
+            throw std::runtime_error(std::string("Could not open output file ") + path);
+        // Signature and all other chunks except IEND; frame left in payload chunk would be read before pixels
+        image.removeChunks(PAYLOAD_CHUNK_TYPE);
+        output.write(reinterpret_cast<const char*>(png), 8);
+        auto& otherChunks = image.getOtherChunks();
+        for (auto it = otherChunks.begin(); it != otherChunks.end() - 1; ++it)
+            writeChunk(output, reinterpret_cast<const char*>(it->type), it->data, it->length);
+
+        // Chunk is buffered whole before it is written, so streamed image is never one chunk
+        ScanlineWriter writer(output, metadata, options.strategy, options.idatSize == 0 ? 8192 : options.idatSize,
+                              options.stats, level, zlibStrategy);
+        EmbedLayout layout = getEmbedLayout(header);
+        uint64_t bitIndex = 0;
+        for (;;) {
+            // Rows that cannot be inflated are fault of image, not of writing
+            uint8_t* row = nullptr;
+            if (!runStep(result, StegoError::InvalidImage, [&]() { row = reader->next(); }) || row == nullptr)
+                break;
+            {
+                StageTimer timer(options.stats, Stage::Embed);
+                uint64_t bitsBefore = bitIndex;
+                if (palette)
+                    palette->remapRow(row + 1, metadata.width);
+                bitIndex = encodeScanline(row + 1, metadata, payload, bitIndex, layout);
+                timer.setBytesIn((bitIndex - bitsBefore) / 8);
+            }
+            writer.write(row);
+        }
+        if (result.error != StegoError::None)
+            return;
+        writer.finish();
+        writeChunk(output, "IEND", nullptr, 0);
+        output.close();
+        if (!output)
+            throw std::runtime_error(std::string("Could not write output file ") + path);
+    });
+    if (result.error != StegoError::None)
+        std::remove(path);
+}
+
+
+// Reads size bytes from offset of payload split over chunks
+void copyPayload(const std::vector<const chunk*>& chunks, uint64_t offset, uint64_t size, uint8_t* output) {
+    for (const chunk* c : chunks) {
+        if (size == 0)
+            break;
+        if (offset >= c->length) {
+            offset -= c->length;
+            continue;
+        }
+        uint64_t step = std::min<uint64_t>(c->length - offset, size);
+        memcpy(output, c->data + offset, step);
+        output += step;
+        size -= step;
+        offset = 0;
+    }
+}
+
+
+// Reads header of frame stored in payload chunks of image, and its message too unless message is null;
+// returns false if image has no such chunks or they hold no frame for password
+bool readChunkFrame(Image& image, const std::string& password, FrameHeader& header, std::string* message) {
+    std::vector<const chunk*> chunks;
+    uint64_t size = 0;
+    for (auto& c : image.getOtherChunks()) {
+        if (memcmp(c.type, PAYLOAD_CHUNK_TYPE, 4) == 0) {
+            chunks.push_back(&c);
+            size += c.length;
+        }
+    }
+    if (size < FRAME_HEADER_SIZE)
+        return false;
+    uint8_t bytes[64] = {0}; // Longer than header with every known flag
+    uint64_t prefix = std::min<uint64_t>(size, getFrameHeaderSize(FRAME_KNOWN_FLAGS));
+    copyPayload(chunks, 0, prefix, bytes);
+    maskPayload(bytes, prefix, 0, password);
+    if (!readFrameHeader(bytes, header))
+        return false;
+    uint32_t headerSize = getFrameHeaderSize(header.flags);
+    if (size < headerSize || !readFrameExtensions(bytes, header))
+        return false;
+    if (message == nullptr)
+        return true;
+    if (size != uint64_t(headerSize) + header.length)
+        throw std::runtime_error("Message chunk does not match its frame header");
+    message->resize(header.length);
+    uint8_t* stored = reinterpret_cast<uint8_t*>(&(*message)[0]);
+    copyPayload(chunks, headerSize, header.length, stored);
+    maskPayload(stored, header.length, headerSize, password);
+    *message = unpackMessage(std::move(*message), header);
+    return true;
+}
+
+
+// Embeds message, writing new PNG file to path, or into png of result if path is null
+StegoResult embedInto(const uint8_t* png, size_t length, const std::string& message, const char* path,
+                      const EmbedOptions& options) {
+    StegoResult result;
+    std::unique_ptr<Codec> codec;
+    if (!runStep(result, StegoError::InvalidOptions, [&]() {
+            if (options.idatSize > ChunkCRC::MAX_CHUNK_SIZE)
+                throw std::runtime_error("IDAT size is larger than PNG chunks can be");
+            codec = createCodec(options.codecName, options.codecOptions);
+        }))
+        return result;
+
+    StageTimer timer(options.stats, Stage::Parse, length);
+    Image image;
+    m_data metadata{};
+    if (!runStep(result, StegoError::InvalidImage, [&]() {
+            metadata = readPNG(png, length, image, options.checkingCRC, options.codecOptions.threads);
+        }))
+        return result;
+    timer.setBytesOut(image.getIDATSize());
+    if (options.inChunk) {
+        embedChunk(png, image, message, path, options, timer, result);
+        return result;
+    }
+
+    FrameHeader header{};
+    std::string payload;
+    if (!prepareFrame(result, metadata, nullptr, message, options, header, payload))
+        return result;
+    // Passes of interlaced image are spread over whole image data and keyed order jumps between all rows,
+    // so neither is streamed; nor is output of codecs that zlib cannot produce row by row
+    int level = 0;
+    int zlibStrategy = 0;
+    if (options.streaming && path != nullptr && metadata.interlance == 0 && options.password.empty() &&
+        codec->getDeflateSettings(level, zlibStrategy)) {
+        timer.stop();
+        streamInto(png, image, metadata, payload, header, path, options, level, zlibStrategy, result);
+        return result;
+    }
+
+    Arena arena; // Reconstructed and compressed image data
+    uint64_t size = getImageSize(metadata);
+    uint8_t* raw = nullptr;
+    timer.restart(Stage::Inflate, image.getIDATSize(), size);
+    if (!runStep(result, StegoError::InvalidImage, [&]() {
+            raw = arena.allocate(size);
+            inflateImage(image, raw, size);
+            timer.restart(Stage::Unfilter, size, size);
+            filter(raw, size, metadata, true, options.codecOptions.threads);
+            timer.restart(Stage::Embed, header.length, size);
+            if (metadata.color == 3) {
+                // Neighbouring indices get near-identical colors, so changed low bits of indices do not show
+                Palette palette(image, metadata, options.mode.bits);
+                palette.remap(raw, metadata);
+                palette.store(image);
+            }
+        }))
+        return result;
+
+    runStep(result, StegoError::Failed, [&]() {
+        encodeFrame(raw, size, payload, header, metadata, options.password);
+        timer.restart(Stage::ChooseFilters, size);
+        chooseFilters(raw, size, metadata, options.strategy, options.codecOptions.threads);
+        timer.restart(Stage::Filter, size, size);
+        filter(raw, size, metadata, false, options.codecOptions.threads);
+
+        timer.restart(Stage::Deflate, size);
+        ChunkCRC checksums(options.idatSize);
+        auto p = codec->compress(raw, size, &arena, &checksums);
+        timer.setBytesOut(p.second);
+
+        timer.restart(Stage::Write, p.second);
+        // Frame left in payload chunk would be read before pixels
+        image.removeChunks(PAYLOAD_CHUNK_TYPE);
+        std::unique_ptr<PNGWriter> output = openOutput(path, image, p.second + 12 * (p.second / checksums.getChunkSize() + 1), result);
+        // Signature, all other chunks except IEND, IDAT chunks and IEND
+        auto& otherChunks = image.getOtherChunks();
+        output->writeSignature(png);
+        output->writeChunks(otherChunks.data(), otherChunks.size() - 1);
+        output->writeIDAT(p.first, p.second, checksums);
+        output->finish();
+        timer.stop();
+    });
+    return result;
+}
+
+
+// Extracts message from pixels of uncompressed image file, or only looks for its header unless reading
+StegoResult extractRaw(const uint8_t* file, size_t length, const ExtractOptions& options, bool reading) {
+    StegoResult result;
+    StageTimer timer(options.stats, Stage::Parse, length);
+    RawLayout layout{};
+    if (!runStep(result, StegoError::InvalidImage, [&]() { layout = readRawImage(file, length); }))
+        return result;
+    timer.restart(Stage::Extract, length - layout.offset);
+    const uint8_t* rows = file + layout.offset;
+    FrameHeader header{};
+    if (!detectRows(rows, layout.stride, layout.metadata, header, options.password)) {
+        fail(result, StegoError::NoMessage, "Image carries no message");
+        return result;
+    }
+    if (reading)
+        runStep(result, StegoError::CorruptedMessage, [&]() {
+            result.message = decodeRows(rows, layout.stride, layout.metadata, header, options.password);
+        });
+    timer.setBytesOut(result.message.length());
+    return result;
+}
+
+}
+
+
+StegoResult embed(const uint8_t* png, size_t length, const std::string& message, const EmbedOptions& options) {
+    if (!isRawImage(png, length))
+        return embedInto(png, length, message, nullptr, options);
+    StegoResult result;
+    if (runStep(result, StegoError::Failed, [&]() { result.png.assign(png, png + length); }))
+        embedRaw(result.png.data(), length, message, options, result);
+    if (result.error != StegoError::None)
+        result.png.clear();
+    return result;
+}
+
+
+StegoResult embedToFile(const uint8_t* png, size_t length, const std::string& message, const char* path,
+                        const EmbedOptions& options) {
+    if (!isRawImage(png, length))
+        return embedInto(png, length, message, path, options);
+    // Cover is copied unchanged, then embedded into in place like any other file; copy is removed on failure
+    StegoResult result;
+    if (!runStep(result, StegoError::Failed, [&]() {
+            std::ofstream output(path, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!output.write(reinterpret_cast<const char*>(png), std::streamsize(length)) || !output.flush())
+                throw std::runtime_error(std::string("Could not write output file ") + path);
+        }))
+        return result;
+    result = embedInPlace(path, message, options);
+    if (result.error != StegoError::None)
+        std::remove(path);
+    return result;
+}
+
+
+StegoResult embedInPlace(const char* path, const std::string& message, const EmbedOptions& options) {
+    StegoResult result;
+    StageTimer timer(options.stats, Stage::Read);
+    std::unique_ptr<MappedFile> file;
+    if (!runStep(result, StegoError::InvalidImage, [&]() { file.reset(new MappedFile(path, true)); }))
+        return result;
+    timer.stop();
+    if (!isRawImage(file->getData(), file->getSize())) {
+        fail(result, StegoError::InvalidImage, "Only BMP, PGM and PPM images are embedded into in place");
+        return result;
+    }
+    embedRaw(file->getWritableData(), file->getSize(), message, options, result);
+    return result;
+}
+
+
+StegoResult extract(const uint8_t* png, size_t length, const ExtractOptions& options) {
+    if (isRawImage(png, length))
+        return extractRaw(png, length, options, true);
+    StegoResult result;
+    StageTimer timer(options.stats, Stage::Parse, length);
+    Image image;
+    m_data metadata{};
+    if (!runStep(result, StegoError::InvalidImage, [&]() {
+            metadata = readPNG(png, length, image, options.checkingCRC, options.threads);
+        }))
+        return result;
+    timer.setBytesOut(image.getIDATSize());
+
+    // Header is read first, so image without message is told apart from message that cannot be read;
+    // frame in payload chunk needs no image data, pixels are read when there is none for password
+    timer.restart(Stage::Extract, image.getIDATSize());
+    FrameHeader header{};
+    bool found = false;
+    if (!runStep(result, StegoError::CorruptedMessage, [&]() { found = readChunkFrame(image, options.password, header, &result.message); }))
+        return result;
+    if (found) {
+        timer.setBytesOut(result.message.length());
+        return result;
+    }
+    if (!runStep(result, StegoError::CorruptedMessage, [&]() {
+            found = tryExtractFrame(image, metadata, header, result.message, options.password, options.stats);
+        }))
+        return result;
+    if (!found) {
+        fail(result, StegoError::NoMessage, "Image carries no message");
+        return result;
+    }
+    timer.setBytesOut(result.message.length());
+    return result;
+}
+
+
+StegoResult detect(const uint8_t* png, size_t length, const ExtractOptions& options) {
+    if (isRawImage(png, length))
+        return extractRaw(png, length, options, false);
+    StegoResult result;
+    StageTimer timer(options.stats, Stage::Parse, length);
+    Image image;
+    m_data metadata{};
+    if (!runStep(result, StegoError::InvalidImage, [&]() {
+            metadata = readPNG(png, length, image, options.checkingCRC, options.threads);
+        }))
+        return result;
+    timer.stop();
+    FrameHeader header{};
+    bool found = readChunkFrame(image, options.password, header, nullptr);
+    if (!found && !runStep(result, StegoError::InvalidImage, [&]() { found = detectPayload(image, metadata, options.password); }))
+        return result;
+    if (!found)
+        fail(result, StegoError::NoMessage, "Image carries no message");
+    return result;
+}
+
+
+const char* getErrorName(StegoError error) {
+    switch (error) {
+        case StegoError::None: return "none";
+        case StegoError::InvalidOptions: return "invalid options";
+        case StegoError::InvalidImage: return "invalid image";
+        case StegoError::UnsupportedMode: return "unsupported mode";
+        case StegoError::MessageTooLong: return "message too long";
+        case StegoError::NoMessage: return "no message";
+        case StegoError::CorruptedMessage: return "corrupted message";
+        case StegoError::Failed: return "failed";
+    }
+    return "unknown";
+}
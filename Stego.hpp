@@ -0,0 +1,85 @@
+#pragma once
+#ifndef STEGO_HPP
+#define STEGO_HPP
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "utils.hpp"
+#include "Codec.hpp"
+
+// Embedding and extracting on PNG files in memory. BMP, PGM and PPM files (see readRawImage) are taken as well,
+// their pixels are changed in place with no codec work. Library is every source file but main.cpp;
+// functions keep no state between calls and print nothing, so any number of threads can call them at once
+
+class Stats;
+
+// Settings of embedding
+struct EmbedOptions {
+    EmbedMode mode = DEFAULT_EMBED_MODE;
+    std::string channels;              // Channel letters like rgba replacing channels of mode, empty keeps them
+    std::string password;              // Empty means message is embedded row by row
+    bool packing = false;              // Message is deflated when that makes it shorter
+    bool inChunk = false;              // Frame is stored in PAYLOAD_CHUNK_TYPE chunk, masked by password, instead of
+                                       // pixels; IDAT chunks are copied as they are, so mode, filters and codec do not apply
+    FilterStrategy strategy = FilterStrategy::MinSum;
+    std::string codecName = "best";
+    CodecOptions codecOptions;         // Threads also apply to checking CRCs and filtering
+    uint32_t idatSize = 8192;          // Bytes per IDAT chunk of output, 0 means one chunk
+    bool checkingCRC = true;           // Cover with wrong chunk CRCs fails before it is inflated
+    bool streaming = false;            // embedToFile handles PNG one scanline at a time, keeping only two rows in memory;
+                                       // interlaced and keyed images and codecs without zlib settings are handled whole
+    Stats* stats = nullptr;            // Stages are recorded into it when given
+};
+
+// Settings of extracting and detecting
+struct ExtractOptions {
+    std::string password;
+    bool checkingCRC = true;
+    unsigned threads = 0;              // Threads checking CRCs, 0 means one per core
+    Stats* stats = nullptr;
+};
+
+enum class StegoError {
+    None,
+    InvalidOptions,   // Unknown codec, channel or too large IDAT size
+    InvalidImage,     // Not PNG or raw image, malformed, wrong CRC or image data truncated
+    UnsupportedMode,  // Embed mode does not fit image
+    MessageTooLong,   // Message does not fit into image
+    NoMessage,        // Image carries no message
+    CorruptedMessage, // Frame was found, but message could not be read back whole
+    Failed            // Anything else, like running out of memory
+};
+
+struct StegoResult {
+    StegoError error = StegoError::None;
+    std::string description;           // What went wrong, empty on success
+    std::vector<uint8_t> png;          // Image written by embed into memory, of the same kind as cover
+    std::string message;               // Message read by extract
+};
+
+/*Embeds message into PNG file of length bytes, returning new PNG file in png of result;
+raw image is copied into png of result and embedded into there*/
+StegoResult embed(const uint8_t* png, size_t length, const std::string& message, const EmbedOptions& options = EmbedOptions());
+
+/*Embeds message like embed, writing new PNG file to path straight from compressed data instead of into memory;
+raw image is copied to path and embedded into there, so path must not be the file png is mapped from*/
+StegoResult embedToFile(const uint8_t* png, size_t length, const std::string& message, const char* path,
+                        const EmbedOptions& options = EmbedOptions());
+
+/*Embeds message into BMP, PGM or PPM file at path by mapping it and changing low bits of its pixels in place;
+file is left unchanged unless message fits. Codec options and IDAT size do not apply*/
+StegoResult embedInPlace(const char* path, const std::string& message, const EmbedOptions& options = EmbedOptions());
+
+/*Reads message embedded into PNG or raw image file of length bytes into message of result;
+frame in payload chunk is read before pixels*/
+StegoResult extract(const uint8_t* png, size_t length, const ExtractOptions& options = ExtractOptions());
+
+/*Checks whether PNG or raw image file carries a message, inflating only rows that hold its header;
+error of result is StegoError::NoMessage if it does not*/
+StegoResult detect(const uint8_t* png, size_t length, const ExtractOptions& options = ExtractOptions());
+
+/*Returns name of error*/
+const char* getErrorName(StegoError error);
+#endif
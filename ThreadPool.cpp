@@ -0,0 +1,100 @@
+#include "ThreadPool.hpp"
+
+namespace {
+
+// Index of worker running on this thread, or -1 on threads outside of pools
+thread_local int currentWorker = -1;
+thread_local const ThreadPool* currentPool = nullptr;
+
+}
+
+ThreadPool::ThreadPool(unsigned threads) : queued(0), pending(0), nextQueue(0), stopping(false) {
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    for (unsigned i = 0; i < threads; ++i)
+        this->queues.emplace_back(new Queue());
+    for (unsigned i = 0; i < threads; ++i)
+        this->workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->waitMutex);
+        this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (auto& worker : this->workers)
+        worker.join();
+}
+
+unsigned ThreadPool::getThreadCount() const {
+    return this->queues.size();
+}
+
+void ThreadPool::submit(Task task) {
+    unsigned index = currentPool == this ? unsigned(currentWorker) : this->nextQueue++ % this->queues.size();
+    this->pending++;
+    {
+        std::lock_guard<std::mutex> lock(this->queues[index]->mutex);
+        this->queues[index]->tasks.push_back(std::move(task));
+        this->queued++;
+    }
+    // Taking the lock makes sure a worker checking for tasks either sees this one or gets the signal
+    std::lock_guard<std::mutex> lock(this->waitMutex);
+    this->wake.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(this->waitMutex);
+    this->done.wait(lock, [this]() { return this->pending == 0; });
+}
+
+bool ThreadPool::take(unsigned worker, Task& task) {
+    // Own queue from the back: latest task, whose data is most likely still in cache
+    {
+        Queue& own = *this->queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            this->queued--;
+            return true;
+        }
+    }
+    // Other queues from the front, starting with the next worker so thieves spread out
+    for (size_t i = 1; i < this->queues.size(); ++i) {
+        Queue& victim = *this->queues[(worker + i) % this->queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            this->queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::work(unsigned worker) {
+    currentWorker = worker;
+    currentPool = this;
+    Task task;
+    while (true) {
+        if (this->take(worker, task)) {
+            task(worker);
+            task = nullptr;
+            if (--this->pending == 0) {
+                std::lock_guard<std::mutex> lock(this->waitMutex);
+                this->done.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(this->waitMutex);
+        this->wake.wait(lock, [this]() { return this->stopping || this->queued > 0; });
+        if (this->stopping && this->queued == 0)
+            return;
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work stealing pool: every worker takes newest tasks of its own queue first
+// and takes oldest tasks of other queues when its own is empty
+class ThreadPool {
+    public:
+        // Task gets index of worker running it, so it can use state kept per worker
+        typedef std::function<void(unsigned worker)> Task;
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> workers;
+        std::mutex waitMutex;
+        std::condition_variable wake; // Signaled when tasks are added or pool stops
+        std::condition_variable done; // Signaled when last pending task finishes
+        std::atomic<uint64_t> queued;  // Tasks waiting in queues
+        std::atomic<uint64_t> pending; // Tasks submitted and not finished
+        std::atomic<unsigned> nextQueue;
+        bool stopping;
+        bool take(unsigned worker, Task& task);
+        void work(unsigned worker);
+    public:
+        // 0 threads means one per core
+        ThreadPool(unsigned threads = 0);
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        unsigned getThreadCount() const;
+        // Adds task; tasks must not throw. Tasks added by a worker go to its own queue
+        void submit(Task task);
+        // Blocks until all submitted tasks are finished
+        void wait();
+};
+#endif
@@ -0,0 +1,509 @@
+// Throughput benchmarks of pipeline stages.
+// Build from repository root with one command made of these lines:
+//   g++ -O2 -std=c++17 -pthread benchmark/benchmark.cpp filter.cpp filter_simd.cpp FilterSelector.cpp
+//       compression.cpp Codec.cpp png_utils.cpp Image.cpp steganography.cpp embed_kernels.cpp
+//       frame.cpp interlace.cpp Scanline.cpp Stats.cpp Arena.cpp RowRing.cpp ScatterOrder.cpp PNGWriter.cpp -lz -o benchmark_run
+// benchmark_run --check compares vector filter kernels with scalar ones instead, exiting with 1 on mismatch;
+// with STEG_NO_SIMD set it checks the SSE2 kernels
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+#include "../utils.hpp"
+#include "../Codec.hpp"
+#include "../Image.hpp"
+#include "../PNGWriter.hpp"
+#include "../Scanline.hpp"
+
+using namespace std;
+
+namespace {
+
+typedef void (*FilterFunction)(uint8_t*, const uint8_t*, const uint32_t, const int, bool);
+
+// Runs function over rows of image for at least minimal time; returns MB/s
+double measureFilter(FilterFunction function, vector<uint8_t>& image, uint32_t rowSize, int bpp, bool decode) {
+    const double minimalTime = 0.2;
+    size_t rows = image.size() / rowSize;
+    size_t processed = 0;
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        for (size_t line = 1; line < rows; ++line)
+            function(image.data() + line * rowSize, image.data() + (line - 1) * rowSize, rowSize - 1, bpp, decode);
+        processed += (rows - 1) * (rowSize - 1);
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while (elapsed < minimalTime);
+    return processed / elapsed / 1e6;
+}
+
+void benchFilters() {
+    const char* names[5] = {"None", "Sub", "Up", "Average", "Paeth"};
+    const uint32_t width = 4096;
+    const uint32_t height = 64;
+    mt19937 random(42);
+
+    cout << "Filter kernels: " << getFilterISA() << endl;
+    cout << left << setw(9) << "filter" << setw(5) << "bpp" << setw(8) << "mode"
+         << right << setw(14) << "scalar MB/s" << setw(14) << "vector MB/s" << endl;
+    for (int bpp : {1, 3, 4, 6, 8}) {
+        uint32_t rowSize = width * bpp + 1;
+        vector<uint8_t> image(size_t(rowSize) * height);
+        for (auto& byte : image)
+            byte = random() & 0xFF;
+
+        for (int filterType = 1; filterType < 5; ++filterType) {
+            for (size_t line = 0; line < height; ++line)
+                image[line * rowSize] = filterType;
+            for (bool decode : {true, false}) {
+                double scalar = measureFilter(filterScanlineScalar, image, rowSize, bpp, decode);
+                double vector = measureFilter(filterScanline, image, rowSize, bpp, decode);
+                cout << left << setw(9) << names[filterType] << setw(5) << bpp << setw(8) << (decode ? "decode" : "encode")
+                     << right << fixed << setprecision(1) << setw(14) << scalar << setw(14) << vector << endl;
+            }
+        }
+    }
+}
+
+// Compares vector filter kernels with scalar ones on random rows of many lengths, most of them
+// no multiple of vector width; rows are allocated at their exact size, so sanitizers see overreads.
+// Returns number of mismatching rows
+uint64_t checkFilters() {
+    mt19937 random(99);
+    vector<uint32_t> widths;
+    for (uint32_t width = 1; width <= 80; ++width)
+        widths.push_back(width);
+    for (uint32_t width : {127u, 128u, 129u, 255u, 1000u, 1001u, 4099u})
+        widths.push_back(width);
+    uint64_t rows = 0, vectorRows = 0, mismatches = 0;
+    for (int bpp : {1, 2, 3, 4, 6, 8}) {
+        for (uint32_t width : widths) {
+            uint32_t length = width * bpp;
+            for (int filterType = 0; filterType < 5; ++filterType) {
+                for (bool decode : {true, false}) {
+                    for (int run = 0; run < 4; ++run) {
+                        vector<uint8_t> previous(length + 1), row(length + 1);
+                        for (auto& byte : previous)
+                            byte = random() & 0xFF;
+                        for (auto& byte : row)
+                            byte = random() & 0xFF;
+                        row[0] = uint8_t(filterType);
+                        vector<uint8_t> expected(row);
+                        filterScanlineScalar(expected.data(), previous.data(), length, bpp, decode);
+                        ++rows;
+                        if (!filterScanlineSIMD(row.data(), previous.data(), length, bpp, decode))
+                            continue;
+                        ++vectorRows;
+                        if (row != expected) {
+                            if (++mismatches <= 10)
+                                cout << "Mismatch: bpp " << bpp << ", length " << length << ", filter " << filterType
+                                     << (decode ? ", decode" : ", encode") << endl;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    cout << "Filter check (" << getFilterISA() << "): " << rows << " rows, " << vectorRows << " through vector kernels, "
+         << mismatches << " mismatching" << endl;
+    return mismatches;
+}
+
+// Smooth gradient with a little noise, filtered like output image data
+vector<uint8_t> makeFilteredImage(const m_data& metadata) {
+    mt19937 random(7);
+    uint64_t rowSize = getScanlineSize(metadata) + 1;
+    vector<uint8_t> image(rowSize * metadata.height);
+    for (uint32_t line = 0; line < metadata.height; ++line) {
+        uint8_t* row = image.data() + line * rowSize;
+        row[0] = 0;
+        for (uint64_t i = 1; i < rowSize; ++i)
+            row[i] = uint8_t((i / 3 + line) / 4 + (random() & 3));
+    }
+    chooseFilters(image.data(), image.size(), metadata, FilterStrategy::MinSum);
+    filter(image.data(), image.size(), metadata, false);
+    return image;
+}
+
+void benchCodecs() {
+    m_data metadata = {};
+    metadata.width = 2048;
+    metadata.height = 1024;
+    metadata.bitDepth = 8;
+    metadata.color = 2;
+    metadata.channels = 3;
+    vector<uint8_t> image = makeFilteredImage(metadata);
+
+    cout << endl << "Codec profiles on " << metadata.width << "x" << metadata.height << " RGB, "
+         << image.size() << " bytes" << endl;
+    cout << left << setw(10) << "profile" << setw(9) << "threads"
+         << right << setw(10) << "ms" << setw(12) << "MB/s" << setw(12) << "bytes" << setw(9) << "ratio" << endl;
+    for (unsigned threads : {1u, 0u}) {
+        for (auto& name : getCodecNames()) {
+            CodecOptions options;
+            options.threads = threads;
+            auto codec = createCodec(name, options);
+
+            // Best of three runs
+            double best = 1e30;
+            uint64_t compressedSize = 0;
+            for (int run = 0; run < 3; ++run) {
+                auto start = chrono::steady_clock::now();
+                auto p = codec->compress(image.data(), image.size());
+                double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                best = elapsed < best ? elapsed : best;
+                compressedSize = p.second;
+                delete[] p.first;
+            }
+            cout << left << setw(10) << name << setw(9) << (threads == 0 ? string("all") : to_string(threads))
+                 << right << fixed << setprecision(1) << setw(10) << best * 1e3 << setw(12) << image.size() / best / 1e6
+                 << setw(12) << compressedSize << setprecision(3) << setw(9) << double(compressedSize) / image.size() << endl;
+        }
+    }
+}
+
+// One bit per loop iteration, as embedding worked before byte kernels; kept as reference
+void encodeBitwise(uint8_t* rawData, const m_data& metadata, const string& payload) {
+    uint64_t bpScanline = getScanlineSize(metadata) + 1;
+    uint32_t bpp = getBytesPerPixel(metadata);
+    uint32_t bitOffset = ((metadata.bitDepth + 7) / 8) - 1;
+    uint64_t pixel = 0;
+    for (size_t c = 0; c < payload.length(); ++c) {
+        uint8_t curChar = payload[c];
+        for (int i = 0; i < 8; ++i, ++pixel) {
+            uint64_t byteIndex = (pixel / metadata.width) * bpScanline + (pixel % metadata.width) * bpp + bitOffset + 1;
+            rawData[byteIndex] = (rawData[byteIndex] & 0xFE) | ((curChar >> 7) & 1);
+            curChar <<= 1;
+        }
+    }
+}
+
+void decodeBitwise(const uint8_t* rawData, const m_data& metadata, string& payload) {
+    uint64_t bpScanline = getScanlineSize(metadata) + 1;
+    uint32_t bpp = getBytesPerPixel(metadata);
+    uint32_t bitOffset = ((metadata.bitDepth + 7) / 8) - 1;
+    uint64_t pixel = 0;
+    for (size_t c = 0; c < payload.length(); ++c) {
+        uint8_t curChar = 0;
+        for (int i = 0; i < 8; ++i, ++pixel) {
+            uint64_t byteIndex = (pixel / metadata.width) * bpScanline + (pixel % metadata.width) * bpp + bitOffset + 1;
+            curChar = (curChar << 1) | (rawData[byteIndex] & 1);
+        }
+        payload[c] = curChar;
+    }
+}
+
+// Runs function until minimal time passed; returns seconds per run
+template <typename Function>
+double timeRuns(Function function) {
+    const double minimalTime = 0.2;
+    int runs = 0;
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        function();
+        ++runs;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while (elapsed < minimalTime);
+    return elapsed / runs;
+}
+
+void benchEmbed() {
+    cout << endl << "Embed kernels: " << getEmbedISA() << " (GB/s of pixel data, payload fills image)" << endl;
+    cout << left << setw(8) << "color" << setw(7) << "depth" << right << setw(14) << "embed before" << setw(14) << "embed after"
+         << setw(16) << "extract before" << setw(15) << "extract after" << endl;
+    const pair<uint8_t, uint8_t> formats[] = {{0, 8}, {4, 8}, {2, 8}, {6, 8}, {0, 16}, {2, 16}, {6, 16}};
+    mt19937 random(11);
+    for (auto& format : formats) {
+        m_data metadata = {};
+        metadata.width = 2048;
+        metadata.height = 512;
+        metadata.color = format.first;
+        metadata.bitDepth = format.second;
+        metadata.channels = getChannels(metadata.color);
+        vector<uint8_t> image(getImageSize(metadata));
+        for (auto& byte : image)
+            byte = random() & 0xFF;
+
+        string message(uint64_t(metadata.width) * metadata.height / 8 - FRAME_HEADER_SIZE, '\0');
+        for (auto& c : message)
+            c = random() & 0xFF;
+        string payload = framePayload(message);
+        string decoded(payload.length(), '\0');
+
+        double embedBefore = timeRuns([&]() { encodeBitwise(image.data(), metadata, payload); });
+        double embedAfter = timeRuns([&]() { encodeMessage(image.data(), image.size(), message, metadata); });
+        double extractBefore = timeRuns([&]() { decodeBitwise(image.data(), metadata, decoded); });
+        double extractAfter = timeRuns([&]() {
+            uint64_t bpScanline = getScanlineSize(metadata) + 1;
+            for (uint64_t bit = 0; bit < payload.length() * 8;)
+                bit = decodeScanline(image.data() + (bit / metadata.width) * bpScanline + 1, metadata,
+                                     reinterpret_cast<uint8_t*>(&decoded[0]), bit, payload.length() * 8);
+        });
+        if (decoded != payload)
+            cout << "Extracted payload differs!" << endl;
+
+        double gigabytes = image.size() / 1e9;
+        cout << left << setw(8) << int(metadata.color) << setw(7) << int(metadata.bitDepth) << right << fixed << setprecision(2)
+             << setw(14) << gigabytes / embedBefore << setw(14) << gigabytes / embedAfter
+             << setw(16) << gigabytes / extractBefore << setw(15) << gigabytes / extractAfter << endl;
+    }
+}
+
+// Reads every row of image with reader and decodes one payload bit per pixel from it
+template <typename Reader>
+void decodeRows(Image& image, const m_data& metadata, vector<uint8_t>& decoded) {
+    Reader reader(image, metadata);
+    uint64_t bit = 0;
+    while (const uint8_t* row = reader.next())
+        bit = decodeScanline(row + 1, metadata, decoded.data(), bit, bit + metadata.width);
+}
+
+void benchDecodePipeline() {
+    m_data metadata = {};
+    metadata.width = 4096;
+    metadata.height = 2048;
+    metadata.bitDepth = 8;
+    metadata.color = 2;
+    metadata.channels = 3;
+    vector<uint8_t> filtered = makeFilteredImage(metadata);
+    auto p = compress(filtered.data(), filtered.size());
+    Image image;
+    const uint32_t chunkSize = 8192;
+    for (uint64_t offset = 0; offset < p.second; offset += chunkSize)
+        image.addIDATChunk(p.first + offset, uint32_t(min<uint64_t>(chunkSize, p.second - offset)));
+    vector<uint8_t> decoded(uint64_t(metadata.width) * metadata.height / 8);
+
+    double serial = timeRuns([&]() { decodeRows<ScanlineReader>(image, metadata, decoded); });
+    double pipelined = timeRuns([&]() { decodeRows<PipelinedReader>(image, metadata, decoded); });
+    cout << endl << "Decoding every row of " << metadata.width << "x" << metadata.height << " RGB (ms, "
+         << thread::hardware_concurrency() << " cores)" << endl;
+    cout << left << setw(12) << "serial" << right << fixed << setprecision(1) << setw(10) << serial * 1e3 << endl;
+    cout << left << setw(12) << "pipelined" << right << setw(10) << pipelined * 1e3 << endl;
+    delete[] p.first;
+}
+
+void benchKeyed() {
+    cout << endl << "Keyed against sequential order (GB/s of pixel data, payload fills image)" << endl;
+    cout << left << setw(8) << "color" << setw(7) << "width" << setw(7) << "mode" << right << setw(12) << "embed seq"
+         << setw(12) << "embed key" << setw(14) << "extract seq" << setw(14) << "extract key" << endl;
+    const uint8_t colors[] = {0, 2, 6};
+    const uint32_t widths[] = {512, 8192};
+    const EmbedMode modes[] = {DEFAULT_EMBED_MODE, {2, 0x07}};
+    mt19937 random(13);
+    for (uint8_t color : colors) {
+        for (uint32_t width : widths) {
+            for (const EmbedMode& mode : modes) {
+                m_data metadata = {};
+                metadata.width = width;
+                metadata.height = 4 * 1024 * 1024 / width;
+                metadata.color = color;
+                metadata.bitDepth = 8;
+                metadata.channels = getChannels(color);
+                EmbedMode used = {mode.bits, uint8_t(mode.channels & ((1 << metadata.channels) - 1))};
+                vector<uint8_t> image(getImageSize(metadata));
+                for (auto& byte : image)
+                    byte = random() & 0xFF;
+                string message(getMessageCapacity(metadata, used), '\0');
+                for (auto& c : message)
+                    c = random() & 0xFF;
+
+                double times[4];
+                const char* passwords[] = {"", "benchmark"};
+                for (int keyed = 0; keyed < 2; ++keyed) {
+                    string password = passwords[keyed];
+                    times[keyed] = timeRuns([&]() { encodeMessage(image.data(), image.size(), message, metadata, used, password); });
+                    string decoded;
+                    times[2 + keyed] = timeRuns([&]() { decoded = decodeMessage(image.data(), image.size(), metadata, password); });
+                    if (decoded != message)
+                        cout << "Extracted message differs!" << endl;
+                }
+                double gigabytes = image.size() / 1e9;
+                cout << left << setw(8) << int(color) << setw(7) << width << setw(7) << (mode.bits == 1 ? "1 bit" : "2 bits")
+                     << right << fixed << setprecision(2) << setw(12) << gigabytes / times[0] << setw(12) << gigabytes / times[1]
+                     << setw(14) << gigabytes / times[2] << setw(14) << gigabytes / times[3] << endl;
+            }
+        }
+    }
+}
+
+// Text of random common words, about size bytes
+string makeText(size_t size, mt19937& random) {
+    static const char* words[] = {"the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be",
+                                  "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but",
+                                  "have", "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her",
+                                  "has", "there", "been", "if", "more", "when", "will", "would", "who", "so", "no"};
+    string text;
+    while (text.length() < size) {
+        text += words[random() % (sizeof(words) / sizeof(words[0]))];
+        text += random() % 12 == 0 ? ". " : " ";
+    }
+    text.resize(size);
+    return text;
+}
+
+// JSON array of records with typical fields, about size bytes
+string makeJSON(size_t size, mt19937& random) {
+    static const char* tags[] = {"admin", "staff", "guest", "beta", "eu", "us"};
+    string json = "[";
+    for (uint32_t id = 0; json.length() < size; ++id) {
+        uint32_t user = random() % 100000;
+        json += (id == 0 ? "" : ",") + string("{\"id\":") + to_string(id) + ",\"name\":\"user" + to_string(user) +
+                "\",\"email\":\"user" + to_string(user) + "@example.com\",\"active\":" +
+                (random() % 2 ? "true" : "false") + ",\"score\":" + to_string(random() % 1000) + "." +
+                to_string(random() % 10) + ",\"tags\":[\"" + tags[random() % 6] + "\",\"" + tags[random() % 6] + "\"]}";
+    }
+    json.resize(size);
+    return json;
+}
+
+void benchPacking() {
+    m_data metadata = {};
+    metadata.width = 2048;
+    metadata.height = 1024;
+    metadata.bitDepth = 8;
+    metadata.color = 2;
+    metadata.channels = 3;
+    vector<uint8_t> source = makeFilteredImage(metadata);
+    filter(source.data(), source.size(), metadata, true);
+    vector<uint8_t> image(source.size());
+
+    cout << endl << "Packed against plain messages on " << metadata.width << "x" << metadata.height
+         << " RGB (pixels carrying frame, rows they touch, ms of embed, filter and deflate, output bytes)" << endl;
+    cout << left << setw(7) << "kind" << setw(9) << "bytes" << right << setw(10) << "pixels" << setw(10) << "packed"
+         << setw(7) << "rows" << setw(8) << "packed" << setw(9) << "ms" << setw(9) << "packed"
+         << setw(10) << "output" << setw(10) << "packed" << endl;
+    mt19937 random(17);
+    for (int json = 0; json < 2; ++json) {
+        for (size_t size : {1024, 16 * 1024, 128 * 1024}) {
+            string message = json ? makeJSON(size, random) : makeText(size, random);
+            uint64_t pixels[2], rows[2], output[2];
+            double times[2];
+            for (int packing = 0; packing < 2; ++packing) {
+                FrameHeader header{};
+                string payload = framePayload(message, DEFAULT_EMBED_MODE, packing != 0, header);
+                pixels[packing] = getPixelOfBit(payload.length() * 8 - 1, getEmbedLayout(header)) + 1;
+                rows[packing] = (pixels[packing] + metadata.width - 1) / metadata.width;
+                times[packing] = timeRuns([&]() {
+                    memcpy(image.data(), source.data(), source.size());
+                    encodeMessage(image.data(), image.size(), message, metadata, DEFAULT_EMBED_MODE, "", packing != 0);
+                    chooseFilters(image.data(), image.size(), metadata, FilterStrategy::MinSum);
+                    filter(image.data(), image.size(), metadata, false);
+                    auto p = compress(image.data(), image.size(), 6);
+                    output[packing] = p.second;
+                    delete[] p.first;
+                });
+                filter(image.data(), image.size(), metadata, true);
+                if (decodeMessage(image.data(), image.size(), metadata) != message)
+                    cout << "Extracted message differs!" << endl;
+            }
+            cout << left << setw(7) << (json ? "json" : "text") << setw(9) << size << right << setw(10) << pixels[0]
+                 << setw(10) << pixels[1] << setw(7) << rows[0] << setw(8) << rows[1] << fixed << setprecision(1)
+                 << setw(9) << times[0] * 1e3 << setw(9) << times[1] * 1e3 << setw(10) << output[0] << setw(10) << output[1] << endl;
+        }
+    }
+}
+
+void benchWrite() {
+    m_data metadata = {};
+    metadata.width = 2048;
+    metadata.height = 1024;
+    metadata.bitDepth = 8;
+    metadata.color = 2;
+    metadata.channels = 3;
+    vector<uint8_t> image = makeFilteredImage(metadata);
+    const char* path = "benchmark_write.png";
+
+    cout << endl << "Deflate and IDAT writing on " << metadata.width << "x" << metadata.height
+         << " RGB (ms of stream writes with CRC pass against gathered writes with CRC fused into deflate)" << endl;
+    cout << left << setw(8) << "codec" << setw(10) << "chunk" << right << setw(10) << "stream" << setw(10) << "fused" << endl;
+    for (const char* name : {"fast", "store"}) {
+        CodecOptions options;
+        options.threads = 1;
+        auto codec = createCodec(name, options);
+        for (uint32_t chunkSize : {8192u, 65536u, 0u}) {
+            double stream = timeRuns([&]() {
+                auto p = codec->compress(image.data(), image.size());
+                ofstream output(path, ios::out | ios::binary);
+                uint32_t step = chunkSize == 0 ? ChunkCRC::MAX_CHUNK_SIZE : chunkSize;
+                for (uint64_t offset = 0; offset < p.second; offset += step)
+                    writeChunk(output, "IDAT", p.first + offset, uint32_t(min<uint64_t>(step, p.second - offset)));
+                delete[] p.first;
+            });
+            ChunkCRC checksums(chunkSize);
+            double fused = timeRuns([&]() {
+                checksums.reset();
+                auto p = codec->compress(image.data(), image.size(), nullptr, &checksums);
+                PNGWriter output(path);
+                output.writeIDAT(p.first, p.second, checksums);
+                output.finish();
+                delete[] p.first;
+            });
+            cout << left << setw(8) << name << setw(10) << (chunkSize == 0 ? string("one") : to_string(chunkSize)) << right
+                 << fixed << setprecision(2) << setw(10) << stream * 1e3 << setw(10) << fused * 1e3 << endl;
+        }
+    }
+    remove(path);
+}
+
+void benchRaw() {
+    m_data metadata = {};
+    metadata.width = 2048;
+    metadata.height = 1024;
+    metadata.bitDepth = 8;
+    metadata.color = 2;
+    metadata.channels = 3;
+    vector<uint8_t> source = makeFilteredImage(metadata);
+    filter(source.data(), source.size(), metadata, true);
+    vector<uint8_t> image(source.size());
+    // Bottom up BMP rows padded to 4 bytes, last row of buffer is top row of image
+    int64_t stride = int64_t((getScanlineSize(metadata) + 3) / 4 * 4);
+    vector<uint8_t> bitmap(uint64_t(stride) * metadata.height);
+    uint8_t* top = bitmap.data() + uint64_t(stride) * (metadata.height - 1);
+
+    cout << endl << "Embedding on " << metadata.width << "x" << metadata.height
+         << " RGB (ms of PNG embed, filter and fast deflate against in place BMP rows)" << endl;
+    cout << left << setw(9) << "bytes" << right << setw(10) << "png" << setw(10) << "raw" << endl;
+    auto codec = createCodec("fast", CodecOptions());
+    mt19937 random(23);
+    for (size_t size : {1024, 16 * 1024, 128 * 1024}) {
+        string message = makeText(size, random);
+        FrameHeader header{};
+        string payload = framePayload(message, DEFAULT_EMBED_MODE, false, header);
+        double png = timeRuns([&]() {
+            memcpy(image.data(), source.data(), source.size());
+            encodeFrame(image.data(), image.size(), payload, header, metadata);
+            chooseFilters(image.data(), image.size(), metadata, FilterStrategy::MinSum);
+            filter(image.data(), image.size(), metadata, false);
+            delete[] codec->compress(image.data(), image.size()).first;
+        });
+        double raw = timeRuns([&]() { encodeRows(top, -stride, payload, header, metadata); });
+        FrameHeader decoded{};
+        if (decodeRows(top, -stride, metadata, decoded) != message)
+            cout << "Extracted message differs!" << endl;
+        cout << left << setw(9) << size << right << fixed << setprecision(3) << setw(10) << png * 1e3
+             << setw(10) << raw * 1e3 << endl;
+    }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    // --check only compares vector filter kernels with scalar ones, failing on any difference
+    if (argc > 1 && strcmp(argv[1], "--check") == 0)
+        return checkFilters() == 0 ? 0 : 1;
+    benchFilters();
+    benchCodecs();
+    benchEmbed();
+    benchDecodePipeline();
+    benchKeyed();
+    benchPacking();
+    benchWrite();
+    benchRaw();
+    return 0;
+}
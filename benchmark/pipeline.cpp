@@ -0,0 +1,332 @@
+// Timings of every stage of the embedding pipeline, on synthetic images of all color types,
+// bit depths and sizes from 5x4 to 8K, and on the bundled images; results are written as JSON.
+// Build from repository root with one command made of these lines:
+//   g++ -O2 -std=c++17 -pthread benchmark/pipeline.cpp filter.cpp filter_simd.cpp FilterSelector.cpp
+//       compression.cpp Codec.cpp png_utils.cpp Image.cpp steganography.cpp embed_kernels.cpp
+//       frame.cpp interlace.cpp Scanline.cpp Stats.cpp Arena.cpp RowRing.cpp Palette.cpp ScatterOrder.cpp PNGWriter.cpp -lz -o pipeline_run
+// Run from repository root, so bundled images are found:
+//   ./pipeline_run [--output pipeline.json] [--max-pixels N] [--min-time seconds]
+// 4K and 8K cases take minutes, mostly compressing at level 9; --max-pixels 2073600 stops at 1080p.
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <iterator>
+#include "../utils.hpp"
+#include "../Image.hpp"
+#include "../Palette.hpp"
+
+using namespace std;
+
+namespace {
+
+struct StageResult {
+    string name;
+    uint64_t bytes;   // Input bytes of one run
+    double seconds;   // Average wall time of one run
+    int runs;
+    string skipped;   // Reason, empty if stage ran
+};
+
+struct CaseResult {
+    string name;
+    string source;    // "synthetic" or path of bundled image
+    m_data metadata;
+    uint64_t fileBytes;
+    uint64_t rawBytes;
+    vector<StageResult> stages;
+};
+
+double minimalTime = 0.2;
+
+// Runs prepare (not timed) and body until minimal time passed; large images run once
+template <typename Prepare, typename Body>
+StageResult timeStage(const string& name, uint64_t bytes, Prepare prepare, Body body) {
+    StageResult result = {name, bytes, 0, 0, ""};
+    double total = 0;
+    do {
+        prepare();
+        auto start = chrono::steady_clock::now();
+        body();
+        total += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        result.runs++;
+    } while (total < minimalTime && result.runs < 1000);
+    result.seconds = total / result.runs;
+    return result;
+}
+
+StageResult skipStage(const string& name, const string& reason) {
+    return StageResult{name, 0, 0, 0, reason};
+}
+
+// Gradient with a little noise, so filters and deflate see something like a photo;
+// every pass of interlaced image gets its own gradient
+vector<uint8_t> makeRawImage(const m_data& metadata) {
+    mt19937 random(metadata.width * 31 + metadata.color * 7 + metadata.bitDepth);
+    ImagePass passes[ADAM7_PASS_COUNT];
+    uint32_t count = getImagePasses(metadata, passes);
+    vector<uint8_t> raw(getImageSize(metadata));
+    for (uint32_t pass = 0; pass < count; ++pass) {
+        for (uint32_t line = 0; line < passes[pass].height; ++line) {
+            uint8_t* row = raw.data() + passes[pass].offset + line * passes[pass].rowSize;
+            row[0] = 0;
+            for (uint64_t i = 1; i < passes[pass].rowSize; ++i)
+                row[i] = uint8_t((i / 3 + line) / 4 + (random() & 3));
+        }
+    }
+    return raw;
+}
+
+// Whole PNG file holding raw image data, filtered and compressed like output of embedding
+string makePNG(const m_data& metadata, vector<uint8_t> raw) {
+    chooseFilters(raw.data(), raw.size(), metadata, FilterStrategy::MinSum);
+    filter(raw.data(), raw.size(), metadata, false);
+    auto p = compress(raw.data(), raw.size());
+
+    ostringstream file;
+    const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    file.write(reinterpret_cast<const char*>(signature), 8);
+    uint8_t header[13] = {0};
+    uint32_t width = swapEdian(metadata.width);
+    uint32_t height = swapEdian(metadata.height);
+    memcpy(header, &width, 4);
+    memcpy(header + 4, &height, 4);
+    header[8] = metadata.bitDepth;
+    header[9] = metadata.color;
+    header[12] = metadata.interlance;
+    writeChunk(file, "IHDR", header, 13);
+    if (metadata.color == 3) {
+        vector<uint8_t> palette(3 << metadata.bitDepth);
+        for (size_t i = 0; i < palette.size(); ++i)
+            palette[i] = uint8_t(i);
+        writeChunk(file, "PLTE", palette.data(), palette.size());
+    }
+    for (uint64_t offset = 0; offset < p.second; offset += 8192)
+        writeChunk(file, "IDAT", p.first + offset, uint32_t(min<uint64_t>(8192, p.second - offset)));
+    writeChunk(file, "IEND", nullptr, 0);
+    delete[] p.first;
+    return file.str();
+}
+
+// Times all stages on PNG file in memory
+CaseResult runCase(const string& name, const string& source, const string& file) {
+    CaseResult result;
+    result.name = name;
+    result.source = source;
+    result.fileBytes = file.size();
+    const uint8_t* fileData = reinterpret_cast<const uint8_t*>(file.data());
+
+    Image image;
+    m_data metadata = readPNG(fileData, file.size(), image);
+    result.metadata = metadata;
+    uint64_t size = getImageSize(metadata);
+    result.rawBytes = size;
+
+    result.stages.push_back(timeStage("parse", file.size(), []() {}, [&]() {
+        Image parsed;
+        readPNG(fileData, file.size(), parsed);
+    }));
+
+    unsigned char* filtered = nullptr;
+    result.stages.push_back(timeStage("decompress", size, [&]() { delete[] filtered; }, [&]() {
+        filtered = decompress(image.getIDATChunks(), size);
+    }));
+    vector<uint8_t> work(size);
+    vector<uint8_t> inflated(filtered, filtered + size);
+    delete[] filtered;
+
+    result.stages.push_back(timeStage("unfilter", size, [&]() { memcpy(work.data(), inflated.data(), size); }, [&]() {
+        filter(work.data(), size, metadata, true);
+    }));
+    vector<uint8_t> raw(work);
+
+    // Largest message of default mode
+    vector<uint8_t> embedded(raw);
+    uint64_t capacity = checkEmbedMode(metadata, DEFAULT_EMBED_MODE) ? getMessageCapacity(metadata) : 0;
+    if (capacity == 0) {
+        const char* reason = checkEmbedMode(metadata, DEFAULT_EMBED_MODE) ? "image too small" : "unsupported bit depth";
+        result.stages.push_back(skipStage("embed", reason));
+        result.stages.push_back(skipStage("extract", reason));
+    } else {
+        mt19937 random(5);
+        string message(capacity, '\0');
+        for (auto& c : message)
+            c = char(random() & 0xFF);
+        // Indexed-color images get their palette regrouped first, as embedding does in main
+        result.stages.push_back(timeStage("embed", size, [&]() { memcpy(work.data(), raw.data(), size); }, [&]() {
+            if (metadata.color == 3)
+                Palette(image, metadata, DEFAULT_EMBED_MODE.bits).remap(work.data(), metadata);
+            encodeMessage(work.data(), size, message, metadata);
+        }));
+        embedded = work;
+        string decoded;
+        result.stages.push_back(timeStage("extract", size, []() {}, [&]() {
+            decoded = decodeMessage(embedded.data(), size, metadata);
+        }));
+        if (decoded != message)
+            throw runtime_error("Extracted message differs in " + name);
+    }
+
+    result.stages.push_back(timeStage("choose_filters", size, [&]() { memcpy(work.data(), embedded.data(), size); }, [&]() {
+        chooseFilters(work.data(), size, metadata, FilterStrategy::MinSum);
+    }));
+    vector<uint8_t> chosen(work);
+    result.stages.push_back(timeStage("filter", size, [&]() { memcpy(work.data(), chosen.data(), size); }, [&]() {
+        filter(work.data(), size, metadata, false);
+    }));
+
+    pair<uint8_t*, uint64_t> compressed(nullptr, 0);
+    result.stages.push_back(timeStage("compress", size, [&]() { delete[] compressed.first; }, [&]() {
+        compressed = compress(work.data(), size);
+    }));
+    delete[] compressed.first;
+    return result;
+}
+
+string formatName(uint8_t color) {
+    switch (color) {
+        case 0: return "gray";
+        case 2: return "rgb";
+        case 3: return "palette";
+        case 4: return "gray_alpha";
+        case 6: return "rgba";
+    }
+    return "unknown";
+}
+
+void writeJSON(ostream& output, const vector<CaseResult>& cases) {
+    output << "{\n  \"filter_isa\": \"" << getFilterISA() << "\",\n  \"embed_isa\": \"" << getEmbedISA() << "\",\n";
+    output << "  \"min_time\": " << minimalTime << ",\n  \"cases\": [";
+    for (size_t i = 0; i < cases.size(); ++i) {
+        const CaseResult& c = cases[i];
+        output << (i ? "," : "") << "\n    {\"name\": \"" << c.name << "\", \"source\": \"" << c.source << "\""
+               << ", \"width\": " << c.metadata.width << ", \"height\": " << c.metadata.height
+               << ", \"color\": " << int(c.metadata.color) << ", \"bit_depth\": " << int(c.metadata.bitDepth)
+               << ", \"interlace\": " << int(c.metadata.interlance)
+               << ", \"file_bytes\": " << c.fileBytes << ", \"raw_bytes\": " << c.rawBytes << ", \"stages\": {";
+        for (size_t j = 0; j < c.stages.size(); ++j) {
+            const StageResult& s = c.stages[j];
+            output << (j ? ", " : "") << "\"" << s.name << "\": ";
+            if (!s.skipped.empty()) {
+                output << "{\"skipped\": \"" << s.skipped << "\"}";
+                continue;
+            }
+            output << "{\"seconds\": " << scientific << setprecision(6) << s.seconds << defaultfloat
+                   << ", \"runs\": " << s.runs << ", \"bytes\": " << s.bytes
+                   << ", \"mb_per_s\": " << fixed << setprecision(2) << s.bytes / s.seconds / 1e6 << defaultfloat << "}";
+        }
+        output << "}}";
+    }
+    output << "\n  ]\n}\n";
+}
+
+void printCase(const CaseResult& c) {
+    cout << left << setw(28) << c.name << right;
+    for (auto& s : c.stages) {
+        if (s.skipped.empty())
+            cout << setw(11) << fixed << setprecision(1) << s.bytes / s.seconds / 1e6;
+        else
+            cout << setw(11) << "-";
+    }
+    cout << endl;
+}
+
+}
+
+
+int main(int argc, char* argv[]) {
+    const char* outputPath = "pipeline.json";
+    uint64_t maxPixels = uint64_t(7680) * 4320;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (strcmp(argv[i], "--max-pixels") == 0 && i + 1 < argc)
+            maxPixels = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+            minimalTime = strtod(argv[++i], nullptr);
+        else {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    // Every bit depth allowed for every color type
+    const pair<uint8_t, uint8_t> formats[] = {
+        {0, 1}, {0, 2}, {0, 4}, {0, 8}, {0, 16}, {2, 8}, {2, 16},
+        {3, 1}, {3, 2}, {3, 4}, {3, 8}, {4, 8}, {4, 16}, {6, 8}, {6, 16}
+    };
+    const pair<uint8_t, uint8_t> interlacedFormats[] = {{0, 4}, {2, 8}, {6, 16}};
+    const pair<uint32_t, uint32_t> sizes[] = {
+        {5, 4}, {64, 64}, {640, 480}, {1920, 1080}, {3840, 2160}, {7680, 4320}
+    };
+    const char* bundled[] = {"5x4.png", "NewTux.png", "RGB.png"};
+
+    cout << "MB/s of stage input; filters " << getFilterISA() << ", embedding " << getEmbedISA() << endl;
+    cout << left << setw(28) << "case" << right;
+    for (const char* stage : {"parse", "decompress", "unfilter", "embed", "extract", "choose", "filter", "compress"})
+        cout << setw(11) << stage;
+    cout << endl;
+
+    vector<CaseResult> cases;
+    try {
+        for (auto& size : sizes) {
+            if (uint64_t(size.first) * size.second > maxPixels)
+                continue;
+            for (auto& format : formats) {
+                m_data metadata = {};
+                metadata.width = size.first;
+                metadata.height = size.second;
+                metadata.color = format.first;
+                metadata.bitDepth = format.second;
+                metadata.channels = getChannels(format.first);
+                string name = formatName(format.first) + to_string(format.second) + "_" +
+                              to_string(size.first) + "x" + to_string(size.second);
+                cases.push_back(runCase(name, "synthetic", makePNG(metadata, makeRawImage(metadata))));
+                printCase(cases.back());
+            }
+            // Adam7 passes are filtered in parallel, so interlaced images are timed too
+            for (auto& format : interlacedFormats) {
+                m_data metadata = {};
+                metadata.width = size.first;
+                metadata.height = size.second;
+                metadata.color = format.first;
+                metadata.bitDepth = format.second;
+                metadata.channels = getChannels(format.first);
+                metadata.interlance = 1;
+                string name = formatName(format.first) + to_string(format.second) + "_adam7_" +
+                              to_string(size.first) + "x" + to_string(size.second);
+                cases.push_back(runCase(name, "synthetic", makePNG(metadata, makeRawImage(metadata))));
+                printCase(cases.back());
+            }
+        }
+        for (const char* path : bundled) {
+            ifstream input(path, ios::in | ios::binary);
+            if (!input.is_open()) {
+                cerr << "Skipping " << path << ", run from repository root to include it" << endl;
+                continue;
+            }
+            string file((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+            cases.push_back(runCase(path, path, file));
+            printCase(cases.back());
+        }
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    ofstream output(outputPath);
+    if (!output.is_open()) {
+        cerr << "Could not open " << outputPath << endl;
+        return 1;
+    }
+    writeJSON(output, cases);
+    cout << "Results written to " << outputPath << endl;
+    return 0;
+}
@@ -1,44 +1,287 @@
 #include "utils.hpp"
+#include "Arena.hpp"
+#include "PNGWriter.hpp"
 #include <zlib.h>
-#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
 
-std::pair<unsigned char*, uint32_t> compress(unsigned char* data, uint32_t size) {
+// Worst case size of zlib stream with default window and memory level
+uint64_t getCompressBound(z_stream* strm, uint64_t size) {
+    if (size <= 0xFFFFFFFFu)
+        return deflateBound(strm, uLong(size));
+    // Same as deflateBound, which only takes 32 bit sizes on some platforms
+    return size + (size >> 12) + (size >> 14) + (size >> 25) + 13 + 6;
+}
+
+
+// Output buffer of compression or decompression
+unsigned char* allocateOutput(uint64_t size, Arena* arena) {
+    return arena != nullptr ? arena->allocate(size) : new unsigned char[size];
+}
+
+
+// Output produced by one deflate call while chunk CRCs are computed, small enough to stay in cache until they are
+const uInt CHECKSUM_STEP = 64 * 1024;
+
+
+std::pair<unsigned char*, uint64_t> compress(z_stream* strm, const unsigned char* data, uint64_t size, Arena* arena,
+                                             ChunkCRC* chunkCRC) {
+    deflateReset(strm);
+    uint64_t bound = getCompressBound(strm, size);
+    unsigned char* compressed = allocateOutput(bound, arena);
+    strm->next_out = compressed;
+    strm->next_in = const_cast<Bytef*>(data);
+
+    // avail_in and avail_out are only 32 bits wide, so large images are fed in several steps
+    uint64_t inLeft = size;
+    uint64_t outLeft = bound;
+    int ret = Z_OK;
+    while (ret == Z_OK) {
+        uInt inStep = inLeft > UINT32_MAX ? UINT32_MAX : uInt(inLeft);
+        uInt outStep = outLeft > UINT32_MAX ? UINT32_MAX : uInt(outLeft);
+        if (chunkCRC != nullptr && outStep > CHECKSUM_STEP)
+            outStep = CHECKSUM_STEP;
+        strm->avail_in = inStep;
+        strm->avail_out = outStep;
+        ret = deflate(strm, inStep == inLeft ? Z_FINISH : Z_NO_FLUSH);
+        inLeft -= inStep - strm->avail_in;
+        outLeft -= outStep - strm->avail_out;
+        if (chunkCRC != nullptr)
+            chunkCRC->update(strm->next_out - (outStep - strm->avail_out), outStep - strm->avail_out);
+    }
+    if (ret != Z_STREAM_END) {
+        if (arena == nullptr)
+            delete[] compressed;
+        throw std::runtime_error("Deflate failed");
+    }
+
+    return std::pair<unsigned char*, uint64_t>(compressed, bound - outLeft);
+}
+
+
+std::pair<unsigned char*, uint64_t> compress(const unsigned char* data, uint64_t size, int level, int strategy) {
     z_stream strm{};
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
 
-    strm.next_in = data;
-    strm.avail_in = size;
-    strm.avail_out = size;
-    unsigned char* compressed = new unsigned char[size];
-    strm.next_out = compressed;
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15, 8, strategy) != Z_OK)
+        throw std::runtime_error("Could not initialize deflate");
+    try {
+        auto result = compress(&strm, data, size);
+        deflateEnd(&strm);
+        return result;
+    } catch (...) {
+        deflateEnd(&strm);
+        throw;
+    }
+}
+
+
+std::pair<unsigned char*, uint64_t> compressStored(const unsigned char* data, uint64_t size, Arena* arena,
+                                                   ChunkCRC* chunkCRC) {
+    const uint32_t maxBlock = 65535;
+    uint64_t blocks = size == 0 ? 1 : (size + maxBlock - 1) / maxBlock;
+    uint64_t compressedSize = 2 + blocks * 5 + size + 4;
+    unsigned char* compressed = allocateOutput(compressedSize, arena);
+
+    // zlib header: 32 KiB window, fastest level hint
+    compressed[0] = 0x78;
+    compressed[1] = 0x01;
+    uint64_t offset = 2;
+    if (chunkCRC != nullptr)
+        chunkCRC->update(compressed, 2);
+    for (uint64_t i = 0; i < blocks; ++i) {
+        uint64_t start = i * maxBlock;
+        uint64_t blockOffset = offset;
+        uint16_t length = uint16_t(size - start < maxBlock ? size - start : maxBlock);
+        // Stored block header: final bit, LEN and NLEN, least significant byte first
+        compressed[offset++] = i + 1 == blocks ? 1 : 0;
+        compressed[offset++] = length & 0xFF;
+        compressed[offset++] = length >> 8;
+        compressed[offset++] = ~length & 0xFF;
+        compressed[offset++] = (~length >> 8) & 0xFF;
+        memcpy(compressed + offset, data + start, length);
+        offset += length;
+        if (chunkCRC != nullptr)
+            chunkCRC->update(compressed + blockOffset, offset - blockOffset);
+    }
 
-    deflateInit(&strm, Z_BEST_COMPRESSION);
-    deflate(&strm, Z_FINISH); // TODO handle if compressed size will be larger than size
-    deflateEnd(&strm);
-    std::cout << "Initial size: " << size << std::endl;
-    std::cout << "Size left in stream: " << strm.avail_out << std::endl;
-    std::cout << "Compressed size: " << size - strm.avail_out << std::endl;
-    
-    return std::pair<unsigned char*, uint32_t>(compressed, size - strm.avail_out);
+    uLong checksum = adler32(0L, Z_NULL, 0);
+    for (uint64_t start = 0; start < size; start += UINT32_MAX) {
+        uInt length = size - start < UINT32_MAX ? uInt(size - start) : UINT32_MAX;
+        checksum = adler32(checksum, data + start, length);
+    }
+    uint32_t trailer = swapEdian(uint32_t(checksum));
+    memcpy(compressed + offset, &trailer, 4);
+    if (chunkCRC != nullptr)
+        chunkCRC->update(compressed + offset, 4);
+
+    return std::pair<unsigned char*, uint64_t>(compressed, compressedSize);
+}
+
+
+bool decompress(z_stream* strm, const std::vector<std::pair<const uint8_t*, uint32_t>>& chunks,
+                uint8_t* output, uint64_t size) {
+    inflateReset(strm);
+    strm->next_in = Z_NULL;
+    strm->avail_in = 0;
+    strm->next_out = output;
+    // Chunks are fed to inflate one after another, so they never have to be joined.
+    // avail_out is only 32 bits wide, so large images are inflated in several steps
+    size_t nextChunk = 0;
+    uint64_t left = size;
+    int ret = Z_OK;
+    while (left > 0 && ret == Z_OK) {
+        if (strm->avail_in == 0) {
+            if (nextChunk >= chunks.size())
+                break;
+            strm->next_in = const_cast<Bytef*>(chunks[nextChunk].first);
+            strm->avail_in = chunks[nextChunk].second;
+            nextChunk++;
+        }
+        uInt step = left > UINT32_MAX ? UINT32_MAX : uInt(left);
+        strm->avail_out = step;
+        ret = inflate(strm, Z_NO_FLUSH);
+        left -= step - strm->avail_out;
+        if (ret == Z_BUF_ERROR && strm->avail_in == 0)
+            ret = Z_OK; // Needs next chunk
+    }
+    return left == 0;
 }
 
 
-unsigned char* decompress(unsigned char* data, uint32_t size, uint32_t expectedSize) {
+unsigned char* decompress(const std::vector<std::pair<const uint8_t*, uint32_t>>& chunks, uint64_t expectedSize,
+                          Arena* arena) {
     z_stream strm{};
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
 
-    strm.next_in = data;
-    strm.avail_in = size;
-    strm.avail_out = expectedSize;
-    unsigned char* decompressed = new unsigned char[expectedSize];
-    strm.next_out = decompressed;   
+    unsigned char* decompressed = allocateOutput(expectedSize, arena);
     inflateInit(&strm);
-    inflate(&strm, Z_FINISH);
+    decompress(&strm, chunks, decompressed, expectedSize);
     inflateEnd(&strm);
 
     return decompressed;
-}
\ No newline at end of file
+}
+
+std::pair<unsigned char*, uint64_t> compressParallel(const unsigned char* data, uint64_t size, int level, int strategy,
+                                                     uint32_t segmentSize, unsigned threads, Arena* arena,
+                                                     ChunkCRC* chunkCRC) {
+    const uint32_t windowSize = 32768;
+    if (segmentSize == 0)
+        segmentSize = 128 * 1024;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    uint64_t segmentCount = size == 0 ? 1 : (size + segmentSize - 1) / segmentSize;
+    auto getSegmentLength = [&](uint64_t i) {
+        return uint32_t(size - i * segmentSize < segmentSize ? size - i * segmentSize : segmentSize);
+    };
+
+    // Segments are deflated straight into disjoint slices of output, each as large as its bound,
+    // and moved together once all of them are done; slices start after 2 bytes of zlib header
+    std::vector<uint64_t> offsets(segmentCount);
+    {
+        z_stream strm{};
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+            throw std::runtime_error("Parallel deflate failed");
+        uint64_t offset = 2;
+        for (uint64_t i = 0; i < segmentCount; ++i) {
+            offsets[i] = offset;
+            // Sync flush adds an empty stored block the bound does not count
+            offset += deflateBound(&strm, getSegmentLength(i)) + 16;
+        }
+        deflateEnd(&strm);
+        offsets.push_back(offset);
+    }
+    unsigned char* compressed = allocateOutput(offsets.back() + 4, arena);
+    std::vector<uint64_t> sizes(segmentCount);
+    std::vector<uLong> checksums(segmentCount);
+    std::atomic<uint64_t> nextSegment(0);
+    std::atomic<bool> failed(false);
+
+    // Every segment is a raw deflate stream primed with the 32 KiB of input before it,
+    // ending with a sync flush (byte aligned, not final) except the last one
+    auto work = [&]() {
+        z_stream strm{};
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+            failed = true;
+            return;
+        }
+        for (uint64_t i = nextSegment++; i < segmentCount; i = nextSegment++) {
+            uint64_t start = i * segmentSize;
+            uint32_t length = getSegmentLength(i);
+            bool last = i + 1 == segmentCount;
+
+            deflateReset(&strm);
+            if (start > 0) {
+                uint32_t dictionarySize = start < windowSize ? uint32_t(start) : windowSize;
+                deflateSetDictionary(&strm, data + start - dictionarySize, dictionarySize);
+            }
+            strm.next_in = const_cast<Bytef*>(data + start);
+            strm.avail_in = length;
+            strm.next_out = compressed + offsets[i];
+            strm.avail_out = uInt(offsets[i + 1] - offsets[i]);
+            int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+            if (ret != (last ? Z_STREAM_END : Z_OK) || strm.avail_in != 0)
+                failed = true;
+            sizes[i] = offsets[i + 1] - offsets[i] - strm.avail_out;
+
+            checksums[i] = adler32(adler32(0L, Z_NULL, 0), data + start, length);
+        }
+        deflateEnd(&strm);
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads && i < segmentCount; ++i)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+    if (failed) {
+        if (arena == nullptr)
+            delete[] compressed;
+        throw std::runtime_error("Parallel deflate failed");
+    }
+
+    // zlib header: 32 KiB window, compression level hint, check bits
+    int levelFlags = level == 1 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    if (level == Z_DEFAULT_COMPRESSION)
+        levelFlags = 2;
+    uint32_t header = (0x78 << 8) | (levelFlags << 6);
+    header += 31 - header % 31;
+
+    compressed[0] = header >> 8;
+    compressed[1] = header & 0xFF;
+    uint64_t offset = 2;
+    if (chunkCRC != nullptr)
+        chunkCRC->update(compressed, 2);
+    uLong checksum = adler32(0L, Z_NULL, 0);
+    for (uint64_t i = 0; i < segmentCount; ++i) {
+        // Segments only move towards the start, first of them not at all
+        if (offset != offsets[i])
+            memmove(compressed + offset, compressed + offsets[i], sizes[i]);
+        // Segment is checksummed right after it is moved, while it is still in cache
+        if (chunkCRC != nullptr)
+            chunkCRC->update(compressed + offset, sizes[i]);
+        offset += sizes[i];
+        checksum = adler32_combine(checksum, checksums[i], z_off_t(getSegmentLength(i)));
+    }
+    // Adler-32 of whole data, most significant byte first
+    uint32_t trailer = swapEdian(uint32_t(checksum));
+    memcpy(compressed + offset, &trailer, 4);
+    if (chunkCRC != nullptr)
+        chunkCRC->update(compressed + offset, 4);
+
+    return std::pair<unsigned char*, uint64_t>(compressed, offset + 4);
+}
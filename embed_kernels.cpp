@@ -0,0 +1,348 @@
+#include "utils.hpp"
+#include <cstring>
+#include <cstdlib>
+
+// Kernels moving one payload byte per 8 pixels, most significant bit first into the first pixel.
+// Pixel layout is a template parameter: Bpp bytes per pixel, carrier (LSB) byte at Off within pixel,
+// so every carrier position is a compile time constant and inner loops have no branches.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define EMBED_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+struct ReverseTable {
+    uint8_t values[256];
+    constexpr ReverseTable() : values() {
+        for (int i = 0; i < 256; ++i) {
+            uint8_t r = 0;
+            for (int bit = 0; bit < 8; ++bit)
+                if (i & (1 << bit)) r |= 0x80 >> bit;
+            values[i] = r;
+        }
+    }
+};
+
+// Bit order is reversed between pixel order (first pixel lowest) and payload bytes (first pixel highest)
+constexpr ReverseTable reverseBits;
+
+inline uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline void store64(uint8_t* p, uint64_t v) {
+    memcpy(p, &v, 8);
+}
+
+// Byte order of 64 bit words is little endian on all supported targets
+constexpr bool isCarrier(int Bpp, int Off, int byte) {
+    return byte % Bpp == Off;
+}
+
+// Carrier LSB bits of each of the Bpp 64 bit words of 8 pixels, and their count.
+// Kept in constant tables, as compilers do not always fold constexpr calls inside loops.
+template <int Bpp, int Off>
+struct WordMasks {
+    uint64_t mask[Bpp];
+    int bits[Bpp];
+    constexpr WordMasks() : mask(), bits() {
+        for (int w = 0; w < Bpp; ++w) {
+            for (int i = 0; i < 8; ++i) {
+                if (isCarrier(Bpp, Off, w * 8 + i)) {
+                    mask[w] |= uint64_t(1) << (i * 8);
+                    bits[w]++;
+                }
+            }
+        }
+    }
+};
+
+// ---- Portable word at a time ----
+
+template <int Bpp, int Off>
+struct WordKernel {
+    static inline uint8_t extract(const uint8_t* p) {
+        if (Bpp == 1) {
+            // LSB of byte k lands in bit 63 - k, without carries between products
+            return uint8_t(((load64(p) & 0x0101010101010101ull) * 0x8040201008040201ull) >> 56);
+        }
+        uint8_t value = 0;
+        for (int k = 0; k < 8; ++k)
+            value = (value << 1) | (p[k * Bpp + Off] & 1);
+        return value;
+    }
+
+    static inline void embed(uint8_t* p, uint8_t value) {
+        if (Bpp == 1) {
+            // Lane k gets bit k of reversed value, which is then turned into 0 or 1
+            uint64_t lanes = (uint64_t(reverseBits.values[value]) * 0x0101010101010101ull) & 0x8040201008040201ull;
+            lanes = ((lanes + 0x7F7F7F7F7F7F7F7Full) & 0x8080808080808080ull) >> 7;
+            store64(p, (load64(p) & ~0x0101010101010101ull) | lanes);
+            return;
+        }
+        for (int k = 0; k < 8; ++k)
+            p[k * Bpp + Off] = (p[k * Bpp + Off] & 0xFE) | ((value >> (7 - k)) & 1);
+    }
+};
+
+#ifdef EMBED_SIMD
+
+// ---- BMI2: pext and pdep over the Bpp words of 8 pixels ----
+
+template <int Bpp, int Off>
+struct Bmi2Kernel {
+    static constexpr WordMasks<Bpp, Off> masks{};
+
+    __attribute__((target("bmi2")))
+    static inline uint8_t extract(const uint8_t* p) {
+        uint32_t bits = 0;
+        int shift = 0;
+        for (int w = 0; w < Bpp; ++w) {
+            bits |= uint32_t(_pext_u64(load64(p + w * 8), masks.mask[w])) << shift;
+            shift += masks.bits[w];
+        }
+        return reverseBits.values[bits];
+    }
+
+    __attribute__((target("bmi2")))
+    static inline void embed(uint8_t* p, uint8_t value) {
+        uint32_t bits = reverseBits.values[value];
+        for (int w = 0; w < Bpp; ++w) {
+            uint64_t word = load64(p + w * 8);
+            store64(p + w * 8, (word & ~masks.mask[w]) | _pdep_u64(bits, masks.mask[w]));
+            bits >>= masks.bits[w];
+        }
+    }
+};
+
+// ---- SSE: 16 byte windows over 8 pixels; last window is moved back to end at pixel 8 ----
+
+template <int Bpp, int Off>
+struct Windows {
+    static constexpr int span = 8 * Bpp;
+    static constexpr int count = span <= 16 ? 1 : (span + 15) / 16;
+    static constexpr int start(int w) {
+        return span <= 16 ? 0 : (w == count - 1 ? span - 16 : w * 16);
+    }
+    // Lane of pixel k in extraction shuffle of window w, or -1 if another window takes it
+    static constexpr int shuffleLane(int w, int k) {
+        return (k * Bpp + Off >= start(w) && k * Bpp + Off < start(w) + 16 &&
+                (w == 0 || k * Bpp + Off >= start(w - 1) + 16)) ? k * Bpp + Off - start(w) : -1;
+    }
+    // Bit of payload value (after reversal) that goes into byte j of window w, or 0
+    static constexpr int laneBit(int w, int j) {
+        return (start(w) + j < span && isCarrier(Bpp, Off, start(w) + j)) ? 0x80 >> ((start(w) + j) / Bpp) : 0;
+    }
+};
+
+template <int Bpp, int Off, int W>
+inline __m128i shuffleControl() {
+    typedef Windows<Bpp, Off> L;
+    return _mm_setr_epi8(
+        L::shuffleLane(W, 0), L::shuffleLane(W, 1), L::shuffleLane(W, 2), L::shuffleLane(W, 3),
+        L::shuffleLane(W, 4), L::shuffleLane(W, 5), L::shuffleLane(W, 6), L::shuffleLane(W, 7),
+        -1, -1, -1, -1, -1, -1, -1, -1);
+}
+
+template <int Bpp, int Off, int W>
+inline __m128i laneBits() {
+    typedef Windows<Bpp, Off> L;
+    return _mm_setr_epi8(
+        char(L::laneBit(W, 0)), char(L::laneBit(W, 1)), char(L::laneBit(W, 2)), char(L::laneBit(W, 3)),
+        char(L::laneBit(W, 4)), char(L::laneBit(W, 5)), char(L::laneBit(W, 6)), char(L::laneBit(W, 7)),
+        char(L::laneBit(W, 8)), char(L::laneBit(W, 9)), char(L::laneBit(W, 10)), char(L::laneBit(W, 11)),
+        char(L::laneBit(W, 12)), char(L::laneBit(W, 13)), char(L::laneBit(W, 14)), char(L::laneBit(W, 15)));
+}
+
+template <int Bpp, int Off>
+inline __m128i loadWindow(const uint8_t* p, int w) {
+    if (Windows<Bpp, Off>::span < 16)
+        return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + Windows<Bpp, Off>::start(w)));
+}
+
+template <int Bpp, int Off>
+inline void storeWindow(uint8_t* p, int w, __m128i x) {
+    if (Windows<Bpp, Off>::span < 16)
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), x);
+    else
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p + Windows<Bpp, Off>::start(w)), x);
+}
+
+template <int Bpp, int Off, int W>
+struct SseWindow {
+    // Gathers carrier bytes of window W into lanes of their pixels
+    __attribute__((target("ssse3")))
+    static inline __m128i gather(const uint8_t* p) {
+        __m128i lanes = _mm_shuffle_epi8(loadWindow<Bpp, Off>(p, W), shuffleControl<Bpp, Off, W>());
+        if (W + 1 < Windows<Bpp, Off>::count)
+            return _mm_or_si128(lanes, SseWindow<Bpp, Off, (W + 1 < Windows<Bpp, Off>::count ? W + 1 : W)>::gather(p));
+        return lanes;
+    }
+
+    // Sets carrier LSBs of window W from value broadcast to every lane
+    static inline void scatter(uint8_t* p, __m128i value) {
+        __m128i bits = laneBits<Bpp, Off, W>();
+        __m128i carriers = _mm_min_epu8(bits, _mm_set1_epi8(1)); // 1 in carrier lanes
+        __m128i set = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(value, bits), bits), carriers);
+        __m128i x = loadWindow<Bpp, Off>(p, W);
+        storeWindow<Bpp, Off>(p, W, _mm_or_si128(_mm_andnot_si128(carriers, x), set));
+        if (W + 1 < Windows<Bpp, Off>::count)
+            SseWindow<Bpp, Off, (W + 1 < Windows<Bpp, Off>::count ? W + 1 : W)>::scatter(p, value);
+    }
+};
+
+template <int Bpp, int Off>
+struct SseKernel {
+    __attribute__((target("ssse3")))
+    static inline uint8_t extract(const uint8_t* p) {
+        __m128i lanes = SseWindow<Bpp, Off, 0>::gather(p);
+        int bits = _mm_movemask_epi8(_mm_slli_epi16(lanes, 7)) & 0xFF;
+        return reverseBits.values[bits];
+    }
+
+    static inline void embed(uint8_t* p, uint8_t value) {
+        SseWindow<Bpp, Off, 0>::scatter(p, _mm_set1_epi8(char(value)));
+    }
+};
+
+#endif
+
+// Runs over count payload bytes; each target gets its own instance so kernels inline into the loop
+template <typename Kernel, int Bpp>
+void embedRun(uint8_t* pixels, const uint8_t* payload, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i)
+        Kernel::embed(pixels + i * 8 * Bpp, payload[i]);
+}
+
+template <typename Kernel, int Bpp>
+void extractRun(const uint8_t* pixels, uint8_t* payload, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i)
+        payload[i] = Kernel::extract(pixels + i * 8 * Bpp);
+}
+
+#ifdef EMBED_SIMD
+template <int Bpp, int Off>
+__attribute__((target("bmi2")))
+void embedRunBmi2(uint8_t* pixels, const uint8_t* payload, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i)
+        Bmi2Kernel<Bpp, Off>::embed(pixels + i * 8 * Bpp, payload[i]);
+}
+
+template <int Bpp, int Off>
+__attribute__((target("bmi2")))
+void extractRunBmi2(const uint8_t* pixels, uint8_t* payload, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i)
+        payload[i] = Bmi2Kernel<Bpp, Off>::extract(pixels + i * 8 * Bpp);
+}
+
+template <int Bpp, int Off>
+__attribute__((target("ssse3")))
+void extractRunSsse3(const uint8_t* pixels, uint8_t* payload, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i)
+        payload[i] = SseKernel<Bpp, Off>::extract(pixels + i * 8 * Bpp);
+}
+#endif
+
+typedef void (*EmbedRun)(uint8_t*, const uint8_t*, uint64_t);
+typedef void (*ExtractRun)(const uint8_t*, uint8_t*, uint64_t);
+
+enum class BitISA { Word, Sse, Bmi2 };
+
+BitISA detectISA() {
+#ifdef EMBED_SIMD
+    if (std::getenv("STEG_NO_SIMD") != nullptr)
+        return BitISA::Word;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2"))
+        return BitISA::Bmi2;
+    if (__builtin_cpu_supports("ssse3"))
+        return BitISA::Sse;
+#endif
+    return BitISA::Word;
+}
+
+BitISA isa() {
+    static const BitISA value = detectISA();
+    return value;
+}
+
+template <int Bpp, int Off>
+EmbedRun pickEmbed() {
+#ifdef EMBED_SIMD
+    if (isa() == BitISA::Bmi2) return embedRunBmi2<Bpp, Off>;
+    // SSE2 is enough for embedding, but SSSE3 hosts are the ones without BMI2 worth a vector path
+    if (isa() == BitISA::Sse) return embedRun<SseKernel<Bpp, Off>, Bpp>;
+#endif
+    return embedRun<WordKernel<Bpp, Off>, Bpp>;
+}
+
+template <int Bpp, int Off>
+ExtractRun pickExtract() {
+#ifdef EMBED_SIMD
+    if (isa() == BitISA::Bmi2) return extractRunBmi2<Bpp, Off>;
+    if (isa() == BitISA::Sse) return extractRunSsse3<Bpp, Off>;
+#endif
+    return extractRun<WordKernel<Bpp, Off>, Bpp>;
+}
+
+// Layouts of all whole byte PNG pixel formats: bytes per pixel and offset of carrier byte
+#define EMBED_LAYOUTS(X) \
+    X(1, 0) X(2, 0) X(3, 0) X(4, 0) \
+    X(2, 1) X(4, 1) X(6, 1) X(8, 1)
+
+}
+
+
+bool embedBytes(uint8_t* pixels, const uint8_t* payload, uint64_t count, int bpp, int offset) {
+    static const EmbedRun runs[] = {
+#define EMBED_ENTRY(B, O) pickEmbed<B, O>(),
+        EMBED_LAYOUTS(EMBED_ENTRY)
+#undef EMBED_ENTRY
+    };
+    static const int layouts[][2] = {
+#define LAYOUT_ENTRY(B, O) {B, O},
+        EMBED_LAYOUTS(LAYOUT_ENTRY)
+#undef LAYOUT_ENTRY
+    };
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+        if (layouts[i][0] == bpp && layouts[i][1] == offset) {
+            runs[i](pixels, payload, count);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool extractBytes(const uint8_t* pixels, uint8_t* payload, uint64_t count, int bpp, int offset) {
+    static const ExtractRun runs[] = {
+#define EXTRACT_ENTRY(B, O) pickExtract<B, O>(),
+        EMBED_LAYOUTS(EXTRACT_ENTRY)
+#undef EXTRACT_ENTRY
+    };
+    static const int layouts[][2] = {
+#define LAYOUT_ENTRY(B, O) {B, O},
+        EMBED_LAYOUTS(LAYOUT_ENTRY)
+#undef LAYOUT_ENTRY
+    };
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+        if (layouts[i][0] == bpp && layouts[i][1] == offset) {
+            runs[i](pixels, payload, count);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+const char* getEmbedISA() {
+    switch (isa()) {
+        case BitISA::Bmi2: return "bmi2";
+        case BitISA::Sse: return "ssse3";
+        default: return "word";
+    }
+}
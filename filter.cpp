@@ -1,80 +1,239 @@
 #include "utils.hpp"
-#include <memory.h>
-
-void filter(uint8_t* data, const uint32_t size, const m_data& metadata, bool decode) {
-    uint32_t bpScanline = size / metadata.height; // scanline size including filter byte
-    int bpp = (metadata.bitDepth * metadata.channels + 7) / 8; // bytes per pixel
-    int factor = decode ? 1 : -1;
-
-    uint8_t* filteredData = new uint8_t[size];
-
-    for (uint32_t line = 0; line < metadata.height; ++line) {
-        uint32_t lineStart = line * bpScanline;
-        int filterType = data[lineStart];
-
-        // Copy filter type
-        filteredData[lineStart] = filterType;
-
-        for (uint32_t i = 1; i < bpScanline; ++i) {
-            uint32_t byteIndex = lineStart + i;
-
-            int left = 0, up = 0, upLeft = 0;
-
-            if (i > bpp) {
-                if (decode)
-                    left = filteredData[byteIndex - bpp]; // reconstructed previous pixel
-                else
-                    left = data[byteIndex - bpp]; // original
-            }
-
-            if (line > 0) {
-                if (decode)
-                    up = filteredData[byteIndex - bpScanline]; // reconstructed previous row
-                else
-                    up = data[byteIndex - bpScanline]; // original
-            }
-
-            if (line > 0 && i > bpp) {
-                if (decode)
-                    upLeft = filteredData[byteIndex - bpScanline - bpp]; // reconstructed prev. row and prev. pixel
-                else
-                    upLeft = data[byteIndex - bpScanline - bpp];
-            }
-
-            int predictor = 0;
-
-            switch (filterType) {
-                case 0: // None
-                    predictor = 0;
-                    break;
-                case 1: // Sub
-                    predictor = left;
-                    break;
-                case 2: // Up
-                    predictor = up;
-                    break;
-                case 3: // Average
-                    predictor = (left + up) / 2;
-                    break;
-                case 4: // Paeth
-                {
-                    int p = left + up - upLeft;
-                    int pa = std::abs(p - left);
-                    int pb = std::abs(p - up);
-                    int pc = std::abs(p - upLeft);
-
-                    if (pa <= pb && pa <= pc) predictor = left;
-                    else if (pb <= pc) predictor = up;
-                    else predictor = upLeft;
-                    break;
-                }
-            }
-
-            int val = (int)data[byteIndex] - factor * predictor;
-            filteredData[byteIndex] = (uint8_t)(val & 0xFF);
+#include "FilterSelector.hpp"
+#include "PixelFormat.hpp"
+#include <atomic>
+#include <stdexcept>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Reconstructs or filters row of length bytes with one filter type; bytes per pixel, filter type and
+// presence of the row above are template parameters, so the inner loop has no branches on them
+template <uint32_t Bpp, int Type, bool Decode, bool HasPrevious>
+void filterRow(uint8_t* row, const uint8_t* previous, uint32_t length) {
+    auto predict = [&](int64_t i) -> int {
+        int left = i >= int64_t(Bpp) ? row[i - Bpp] : 0;
+        int up = HasPrevious ? previous[i] : 0;
+        int upLeft = HasPrevious && i >= int64_t(Bpp) ? previous[i - Bpp] : 0;
+        if (Type == 1) // Sub
+            return left;
+        if (Type == 2) // Up
+            return up;
+        if (Type == 3) // Average
+            return (left + up) / 2;
+        // Paeth
+        int p = left + up - upLeft;
+        int pa = std::abs(p - left);
+        int pb = std::abs(p - up);
+        int pc = std::abs(p - upLeft);
+        if (pa <= pb && pa <= pc) return left;
+        if (pb <= pc) return up;
+        return upLeft;
+    };
+
+    // Reconstruction needs the already reconstructed left neighbour, so it goes left to right.
+    // Filtering needs the original left neighbour, so it goes right to left to stay in place.
+    if (Decode) {
+        for (int64_t i = 0; i < int64_t(length); ++i)
+            row[i] = uint8_t(row[i] + predict(i));
+    } else {
+        for (int64_t i = int64_t(length) - 1; i >= 0; --i)
+            row[i] = uint8_t(row[i] - predict(i));
+    }
+}
+
+template <uint32_t Bpp, bool Decode, bool HasPrevious>
+void filterLine(uint8_t* line, const uint8_t* previous, uint32_t length) {
+    uint8_t* row = line + 1;
+    const uint8_t* above = HasPrevious ? previous + 1 : nullptr;
+    switch (line[0]) {
+        case 1: filterRow<Bpp, 1, Decode, HasPrevious>(row, above, length); break;
+        case 2: filterRow<Bpp, 2, Decode, HasPrevious>(row, above, length); break;
+        case 3: filterRow<Bpp, 3, Decode, HasPrevious>(row, above, length); break;
+        case 4: filterRow<Bpp, 4, Decode, HasPrevious>(row, above, length); break;
+        default: break; // None, and unknown types are left as they are
+    }
+}
+
+template <uint32_t Bpp>
+void filterLine(uint8_t* line, const uint8_t* previous, uint32_t length, bool decode) {
+    if (previous == nullptr)
+        decode ? filterLine<Bpp, true, false>(line, previous, length) : filterLine<Bpp, false, false>(line, previous, length);
+    else
+        decode ? filterLine<Bpp, true, true>(line, previous, length) : filterLine<Bpp, false, true>(line, previous, length);
+}
+
+}
+
+
+void filterScanlineScalar(uint8_t* line, const uint8_t* previous, const uint32_t length, const int bpp, bool decode) {
+    // Every PixelFormat has one of these pixel sizes
+    switch (bpp) {
+        case 1: filterLine<1>(line, previous, length, decode); break;
+        case 2: filterLine<2>(line, previous, length, decode); break;
+        case 3: filterLine<3>(line, previous, length, decode); break;
+        case 4: filterLine<4>(line, previous, length, decode); break;
+        case 6: filterLine<6>(line, previous, length, decode); break;
+        case 8: filterLine<8>(line, previous, length, decode); break;
+        default: throw std::runtime_error("Unsupported pixel size");
+    }
+}
+
+
+void filterScanline(uint8_t* line, const uint8_t* previous, const uint32_t length, const int bpp, bool decode) {
+    if (!filterScanlineSIMD(line, previous, length, bpp, decode))
+        filterScanlineScalar(line, previous, length, bpp, decode);
+}
+
+
+namespace {
+
+unsigned getThreadCount(unsigned threads) {
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    return threads == 0 ? 1 : threads;
+}
+
+// Runs work for every pass with rows on up to threads threads, largest passes first,
+// so the last pass to start is a small one
+template <typename Work>
+void forEachPass(const ImagePass* passes, uint32_t count, unsigned threads, Work work) {
+    auto size = [&](uint32_t pass) { return passes[pass].rowSize * passes[pass].height; };
+    uint32_t order[ADAM7_PASS_COUNT];
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (passes[i].height == 0)
+            continue;
+        // Insertion keeps order sorted by size, there are at most seven passes
+        uint32_t position = used++;
+        for (; position > 0 && size(order[position - 1]) < size(i); --position)
+            order[position] = order[position - 1];
+        order[position] = i;
+    }
+
+    std::atomic<uint32_t> next(0);
+    auto run = [&]() {
+        for (uint32_t i = next++; i < used; i = next++)
+            work(passes[order[i]]);
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < getThreadCount(threads) && i < used; ++i)
+        workers.emplace_back(run);
+    run();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+// Pixel size of format is known, so rows vector kernels decline use the scalar loop of that size directly
+template <typename Format>
+void filterPass(uint8_t* data, const ImagePass& pass, bool decode) {
+    constexpr uint32_t bpp = Format::BYTES_PER_PIXEL;
+    auto filterCurrent = [&](uint8_t* current, const uint8_t* previous) {
+        if (!filterScanlineSIMD(current, previous, pass.rowSize - 1, bpp, decode))
+            filterLine<bpp>(current, previous, pass.rowSize - 1, decode);
+    };
+    uint8_t* first = data + pass.offset;
+    if (decode) {
+        // Every row is reconstructed from the row above it, which is already reconstructed
+        for (uint64_t line = 0; line < pass.height; ++line) {
+            uint8_t* current = first + line * pass.rowSize;
+            const uint8_t* previous = line > 0 ? current - pass.rowSize : nullptr;
+            filterCurrent(current, previous);
+        }
+    } else {
+        // Every row is filtered against the original row above it, so go bottom up
+        for (uint64_t line = pass.height; line-- > 0;) {
+            uint8_t* current = first + line * pass.rowSize;
+            const uint8_t* previous = line > 0 ? current - pass.rowSize : nullptr;
+            filterCurrent(current, previous);
         }
     }
+}
+
+// Rows are found from metadata, so buffer has to hold all of them
+void checkImageSize(const uint64_t size, const m_data& metadata) {
+    if (size < getImageSize(metadata))
+        throw std::runtime_error("Image data is shorter than image");
+}
+
+void choosePassFilters(uint8_t* data, const ImagePass& pass, FilterSelector& selector) {
+    uint8_t* first = data + pass.offset;
+    for (uint32_t line = 0; line < pass.height; ++line) {
+        uint8_t* current = first + uint64_t(line) * pass.rowSize;
+        const uint8_t* previous = line > 0 ? current - pass.rowSize : nullptr;
+        current[0] = selector.choose(current, previous, pass.rowSize - 1);
+    }
+}
+
+}
+
+
+void filter(uint8_t* data, const uint64_t size, const m_data& metadata, bool decode, unsigned threads) {
+    checkImageSize(size, metadata);
+    ImagePass passes[ADAM7_PASS_COUNT];
+    uint32_t count = getImagePasses(metadata, passes);
+
+    visitPixelFormat(metadata, [&](auto format) {
+        if (count == 1) {
+            filterPass<decltype(format)>(data, passes[0], decode);
+            return;
+        }
+        forEachPass(passes, count, threads, [&](const ImagePass& pass) {
+            filterPass<decltype(format)>(data, pass, decode);
+        });
+    });
+}
+
+
+void chooseFilters(uint8_t* data, const uint64_t size, const m_data& metadata, FilterStrategy strategy, unsigned threads) {
+    checkImageSize(size, metadata);
+    if (strategy == FilterStrategy::Keep || metadata.height == 0)
+        return;
+
+    ImagePass passes[ADAM7_PASS_COUNT];
+    int bpp = getBytesPerPixel(metadata);
+    if (getImagePasses(metadata, passes) > 1) {
+        // Passes are independent, every one gets a selector for its row size
+        forEachPass(passes, ADAM7_PASS_COUNT, threads, [&](const ImagePass& pass) {
+            FilterSelector selector(pass.rowSize - 1, bpp, strategy);
+            choosePassFilters(data, pass, selector);
+        });
+        return;
+    }
+
+    uint64_t bpScanline = passes[0].rowSize; // scanline size including filter byte
+    threads = getThreadCount(threads);
+    if (threads > metadata.height)
+        threads = metadata.height;
+
+    // Choice for a row only reads unfiltered rows, so rows are split into independent ranges
+    auto work = [&](uint32_t firstLine, uint32_t lastLine) {
+        FilterSelector selector(bpScanline - 1, bpp, strategy);
+        for (uint32_t line = firstLine; line < lastLine; ++line) {
+            uint8_t* current = data + line * bpScanline;
+            const uint8_t* previous = line > 0 ? current - bpScanline : nullptr;
+            current[0] = selector.choose(current, previous);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    uint32_t linesPerThread = (metadata.height + threads - 1) / threads;
+    for (uint32_t first = linesPerThread; first < metadata.height; first += linesPerThread) {
+        uint32_t last = first + linesPerThread < metadata.height ? first + linesPerThread : metadata.height;
+        workers.emplace_back(work, first, last);
+    }
+    work(0, linesPerThread < metadata.height ? linesPerThread : metadata.height);
+    for (auto& worker : workers)
+        worker.join();
+}
+
 
-    memcpy(data, filteredData, size);
-    delete[] filteredData;
-}
\ No newline at end of file
+void chooseFilters(uint8_t* data, const uint64_t size, const m_data& metadata, FilterSelector& selector) {
+    checkImageSize(size, metadata);
+    ImagePass passes[ADAM7_PASS_COUNT];
+    uint32_t count = getImagePasses(metadata, passes);
+    for (uint32_t i = 0; i < count; ++i)
+        choosePassFilters(data, passes[i], selector);
+}
@@ -0,0 +1,438 @@
+#include "utils.hpp"
+#include <cstring>
+#include <cstdlib>
+
+// Vectorized filter kernels for x86. Reconstruction of Sub, Average and Paeth depends on
+// the reconstructed left pixel, so those go one pixel per step for bpp 3, 4, 6 and 8 (as libpng does)
+// or use a prefix sum for Sub. Filtering only reads original bytes, so every type is done 16 or 32 bytes at a time.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define FILTER_SIMD 1
+#include <immintrin.h>
+#endif
+
+#ifdef FILTER_SIMD
+
+namespace {
+
+struct CpuFeatures {
+    bool ssse3;
+    bool avx2;
+    CpuFeatures() {
+        __builtin_cpu_init();
+        this->ssse3 = __builtin_cpu_supports("ssse3");
+        this->avx2 = __builtin_cpu_supports("avx2");
+        // STEG_NO_SIMD forces scalar filters, useful for comparing results
+        if (std::getenv("STEG_NO_SIMD") != nullptr)
+            this->ssse3 = this->avx2 = false;
+    }
+};
+
+const CpuFeatures& cpu() {
+    static const CpuFeatures features;
+    return features;
+}
+
+inline int paethPredictor(int left, int up, int upLeft) {
+    int p = left + up - upLeft;
+    int pa = std::abs(p - left);
+    int pb = std::abs(p - up);
+    int pc = std::abs(p - upLeft);
+
+    if (pa <= pb && pa <= pc) return left;
+    else if (pb <= pc) return up;
+    return upLeft;
+}
+
+// Bytes read by loadPixel; 3 and 6 byte pixels are read with one wider load
+template <int Bpp>
+constexpr uint32_t loadSize() {
+    return Bpp == 3 ? 4 : Bpp == 6 ? 8 : Bpp;
+}
+
+template <int Bpp>
+inline __m128i loadPixel(const uint8_t* p) {
+    if (loadSize<Bpp>() == 4) {
+        int32_t v;
+        memcpy(&v, p, 4);
+        return _mm_cvtsi32_si128(v);
+    }
+    return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+}
+
+template <int Bpp>
+inline void storePixel(uint8_t* p, __m128i x) {
+    if (loadSize<Bpp>() == 4) {
+        int32_t v = _mm_cvtsi128_si32(x);
+        memcpy(p, &v, Bpp);
+        return;
+    }
+    uint64_t v;
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(&v), x);
+    memcpy(p, &v, Bpp);
+}
+
+inline __m128i load16(const uint8_t* p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+inline void store16(uint8_t* p, __m128i x) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), x);
+}
+
+// floor((a + b) / 2) for unsigned bytes; pavgb rounds up, so the carried low bit is removed
+inline __m128i averageFloor(__m128i a, __m128i b) {
+    __m128i lowBit = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), lowBit);
+}
+
+inline __m128i select16(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+inline __m128i abs16SSE2(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// Picks Paeth predictor of 16 bit lanes given distances pa, pb and pc
+inline __m128i paethSelect(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc) {
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i nearest = select16(_mm_cmpeq_epi16(smallest, pb), b, c);
+    return select16(_mm_cmpeq_epi16(smallest, pa), a, nearest);
+}
+
+// Paeth predictor of 8 bytes at once using 16 bit lanes
+inline __m128i paethSSE2(__m128i a8, __m128i b8, __m128i c8) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_unpacklo_epi8(a8, zero);
+    __m128i b = _mm_unpacklo_epi8(b8, zero);
+    __m128i c = _mm_unpacklo_epi8(c8, zero);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = abs16SSE2(pa);
+    pb = abs16SSE2(pb);
+    pc = abs16SSE2(pc);
+    return _mm_packus_epi16(paethSelect(a, b, c, pa, pb, pc), zero);
+}
+
+__attribute__((target("ssse3")))
+inline __m128i paethSSSE3(__m128i a8, __m128i b8, __m128i c8) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_unpacklo_epi8(a8, zero);
+    __m128i b = _mm_unpacklo_epi8(b8, zero);
+    __m128i c = _mm_unpacklo_epi8(c8, zero);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = _mm_abs_epi16(pa);
+    pb = _mm_abs_epi16(pb);
+    pc = _mm_abs_epi16(pc);
+    return _mm_packus_epi16(paethSelect(a, b, c, pa, pb, pc), zero);
+}
+
+// ---- Reconstruction ----
+
+void upDecodeSSE2(uint8_t* row, const uint8_t* prev, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        store16(row + i, _mm_add_epi8(load16(row + i), load16(prev + i)));
+    for (; i < n; ++i)
+        row[i] += prev[i];
+}
+
+__attribute__((target("avx2")))
+void upDecodeAVX2(uint8_t* row, const uint8_t* prev, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + i), _mm256_add_epi8(x, y));
+    }
+    upDecodeSSE2(row + i, prev + i, n - i);
+}
+
+// Prefix sum over 16 bytes with stride Bpp, carrying the last reconstructed pixel between blocks
+template <int Bpp>
+void subDecodeScan(uint8_t* row, uint32_t n) {
+    uint32_t i = Bpp;
+    __m128i carry = _mm_setzero_si128();
+    if (n >= Bpp) {
+        if (Bpp == 1) carry = _mm_set1_epi8(row[0]);
+        if (Bpp == 2) { uint16_t v; memcpy(&v, row, 2); carry = _mm_set1_epi16(v); }
+        if (Bpp == 4) { int32_t v; memcpy(&v, row, 4); carry = _mm_set1_epi32(v); }
+        if (Bpp == 8) { carry = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row)); carry = _mm_unpacklo_epi64(carry, carry); }
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = load16(row + i);
+        if (Bpp <= 1) x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+        if (Bpp <= 2) x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+        if (Bpp <= 4) x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi8(x, carry);
+        store16(row + i, x);
+        // Broadcasting last pixel of block
+        if (Bpp == 1) carry = _mm_set1_epi8(char(row[i + 15]));
+        if (Bpp == 2) {
+            carry = _mm_shufflehi_epi16(_mm_unpackhi_epi64(x, x), 0xFF);
+            carry = _mm_shuffle_epi32(carry, 0xFF);
+        }
+        if (Bpp == 4) carry = _mm_shuffle_epi32(x, 0xFF);
+        if (Bpp == 8) carry = _mm_unpackhi_epi64(x, x);
+    }
+    for (; i < n; ++i)
+        row[i] += row[i - Bpp];
+}
+
+// One pixel per step for sizes that do not divide 16
+template <int Bpp>
+void subDecodePixel(uint8_t* row, uint32_t n) {
+    uint32_t i = Bpp;
+    __m128i a = loadPixel<Bpp>(row);
+    for (; i + loadSize<Bpp>() <= n; i += Bpp) {
+        a = _mm_add_epi8(loadPixel<Bpp>(row + i), a);
+        storePixel<Bpp>(row + i, a);
+    }
+    for (; i < n; ++i)
+        row[i] += row[i - Bpp];
+}
+
+template <int Bpp>
+void avgDecode(uint8_t* row, const uint8_t* prev, uint32_t n) {
+    uint32_t i = 0;
+    for (; i < Bpp && i < n; ++i)
+        row[i] += prev[i] >> 1;
+    __m128i a = loadPixel<Bpp>(row);
+    for (; i + loadSize<Bpp>() <= n; i += Bpp) {
+        __m128i b = loadPixel<Bpp>(prev + i);
+        a = _mm_add_epi8(loadPixel<Bpp>(row + i), averageFloor(a, b));
+        storePixel<Bpp>(row + i, a);
+    }
+    for (; i < n; ++i)
+        row[i] += (row[i - Bpp] + prev[i]) >> 1;
+}
+
+template <int Bpp>
+void paethDecodeSSE2(uint8_t* row, const uint8_t* prev, uint32_t n) {
+    uint32_t i = 0;
+    // First pixel has no left neighbours, so predictor is the pixel above
+    for (; i < Bpp && i < n; ++i)
+        row[i] += prev[i];
+    __m128i a = loadPixel<Bpp>(row);
+    __m128i c = loadPixel<Bpp>(prev);
+    for (; i + loadSize<Bpp>() <= n; i += Bpp) {
+        __m128i b = loadPixel<Bpp>(prev + i);
+        a = _mm_add_epi8(loadPixel<Bpp>(row + i), paethSSE2(a, b, c));
+        storePixel<Bpp>(row + i, a);
+        c = b;
+    }
+    for (; i < n; ++i)
+        row[i] += paethPredictor(row[i - Bpp], prev[i], prev[i - Bpp]);
+}
+
+// Same as paethDecodeSSE2 with pabsw for distances
+template <int Bpp>
+__attribute__((target("ssse3")))
+void paethDecodeSSSE3(uint8_t* row, const uint8_t* prev, uint32_t n) {
+    uint32_t i = 0;
+    for (; i < Bpp && i < n; ++i)
+        row[i] += prev[i];
+    __m128i a = loadPixel<Bpp>(row);
+    __m128i c = loadPixel<Bpp>(prev);
+    for (; i + loadSize<Bpp>() <= n; i += Bpp) {
+        __m128i b = loadPixel<Bpp>(prev + i);
+        a = _mm_add_epi8(loadPixel<Bpp>(row + i), paethSSSE3(a, b, c));
+        storePixel<Bpp>(row + i, a);
+        c = b;
+    }
+    for (; i < n; ++i)
+        row[i] += paethPredictor(row[i - Bpp], prev[i], prev[i - Bpp]);
+}
+
+// ---- Filtering ----
+// Blocks go right to left, so left neighbours are still original when they are loaded
+
+void upEncodeSSE2(uint8_t* row, const uint8_t* prev, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        store16(row + i, _mm_sub_epi8(load16(row + i), load16(prev + i)));
+    for (; i < n; ++i)
+        row[i] -= prev[i];
+}
+
+__attribute__((target("avx2")))
+void upEncodeAVX2(uint8_t* row, const uint8_t* prev, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + i), _mm256_sub_epi8(x, y));
+    }
+    upEncodeSSE2(row + i, prev + i, n - i);
+}
+
+// Scalar filtering of [0, end) going right to left
+void encodeHead(uint8_t* row, const uint8_t* prev, uint32_t end, int bpp, int filterType) {
+    for (uint32_t i = end; i-- > 0;) {
+        int left = i >= uint32_t(bpp) ? row[i - bpp] : 0;
+        int upLeft = i >= uint32_t(bpp) ? prev[i - bpp] : 0;
+        int predictor = 0;
+        if (filterType == 1) predictor = left;
+        else if (filterType == 3) predictor = (left + prev[i]) >> 1;
+        else if (filterType == 4) predictor = paethPredictor(left, prev[i], upLeft);
+        row[i] -= predictor;
+    }
+}
+
+// Sub, Average and Paeth filtering 16 bytes per step
+void encodeSSE2(uint8_t* row, const uint8_t* prev, uint32_t n, int bpp, int filterType) {
+    int64_t i = int64_t(n) - 16;
+    for (; i >= bpp; i -= 16) {
+        __m128i x = load16(row + i);
+        __m128i a = load16(row + i - bpp);
+        __m128i predictor;
+        if (filterType == 1) {
+            predictor = a;
+        } else if (filterType == 3) {
+            predictor = averageFloor(a, load16(prev + i));
+        } else {
+            __m128i b = load16(prev + i);
+            __m128i c = load16(prev + i - bpp);
+            __m128i low = paethSSE2(a, b, c);
+            __m128i high = paethSSE2(_mm_srli_si128(a, 8), _mm_srli_si128(b, 8), _mm_srli_si128(c, 8));
+            predictor = _mm_unpacklo_epi64(low, high);
+        }
+        store16(row + i, _mm_sub_epi8(x, predictor));
+    }
+    encodeHead(row, prev, uint32_t(i + 16), bpp, filterType);
+}
+
+__attribute__((target("avx2")))
+void encodeAVX2(uint8_t* row, const uint8_t* prev, uint32_t n, int bpp, int filterType) {
+    int64_t i = int64_t(n) - 32;
+    for (; i >= bpp; i -= 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i - bpp));
+        __m256i predictor;
+        if (filterType == 1) {
+            predictor = a;
+        } else if (filterType == 3) {
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+            __m256i lowBit = _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1));
+            predictor = _mm256_sub_epi8(_mm256_avg_epu8(a, b), lowBit);
+        } else {
+            __m256i zero = _mm256_setzero_si256();
+            __m256i b8 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i));
+            __m256i c8 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prev + i - bpp));
+            __m256i parts[2];
+            for (int half = 0; half < 2; ++half) {
+                __m256i a16 = half ? _mm256_unpackhi_epi8(a, zero) : _mm256_unpacklo_epi8(a, zero);
+                __m256i b16 = half ? _mm256_unpackhi_epi8(b8, zero) : _mm256_unpacklo_epi8(b8, zero);
+                __m256i c16 = half ? _mm256_unpackhi_epi8(c8, zero) : _mm256_unpacklo_epi8(c8, zero);
+                __m256i pa = _mm256_sub_epi16(b16, c16);
+                __m256i pb = _mm256_sub_epi16(a16, c16);
+                __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+                pa = _mm256_abs_epi16(pa);
+                pb = _mm256_abs_epi16(pb);
+                __m256i smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+                __m256i nearest = _mm256_blendv_epi8(c16, b16, _mm256_cmpeq_epi16(smallest, pb));
+                parts[half] = _mm256_blendv_epi8(nearest, a16, _mm256_cmpeq_epi16(smallest, pa));
+            }
+            // Unpack and pack both work within 128 bit lanes, so the byte order is restored
+            predictor = _mm256_packus_epi16(parts[0], parts[1]);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row + i), _mm256_sub_epi8(x, predictor));
+    }
+    encodeSSE2(row, prev, uint32_t(i + 32), bpp, filterType);
+}
+
+bool decodeSIMD(uint8_t* row, const uint8_t* prev, uint32_t n, int bpp, int filterType) {
+    const CpuFeatures& features = cpu();
+    switch (filterType) {
+        case 2:
+            if (features.avx2) upDecodeAVX2(row, prev, n);
+            else upDecodeSSE2(row, prev, n);
+            return true;
+        case 1:
+            switch (bpp) {
+                case 1: subDecodeScan<1>(row, n); return true;
+                case 2: subDecodeScan<2>(row, n); return true;
+                case 3: subDecodePixel<3>(row, n); return true;
+                case 4: subDecodeScan<4>(row, n); return true;
+                case 6: subDecodePixel<6>(row, n); return true;
+                case 8: subDecodeScan<8>(row, n); return true;
+            }
+            return false;
+        case 3:
+            switch (bpp) {
+                case 3: avgDecode<3>(row, prev, n); return true;
+                case 4: avgDecode<4>(row, prev, n); return true;
+                case 6: avgDecode<6>(row, prev, n); return true;
+                case 8: avgDecode<8>(row, prev, n); return true;
+            }
+            return false;
+        case 4:
+            if (features.ssse3) {
+                switch (bpp) {
+                    case 3: paethDecodeSSSE3<3>(row, prev, n); return true;
+                    case 4: paethDecodeSSSE3<4>(row, prev, n); return true;
+                    case 6: paethDecodeSSSE3<6>(row, prev, n); return true;
+                    case 8: paethDecodeSSSE3<8>(row, prev, n); return true;
+                }
+            } else {
+                switch (bpp) {
+                    case 3: paethDecodeSSE2<3>(row, prev, n); return true;
+                    case 4: paethDecodeSSE2<4>(row, prev, n); return true;
+                    case 6: paethDecodeSSE2<6>(row, prev, n); return true;
+                    case 8: paethDecodeSSE2<8>(row, prev, n); return true;
+                }
+            }
+            return false;
+    }
+    return false;
+}
+
+bool encodeSIMD(uint8_t* row, const uint8_t* prev, uint32_t n, int bpp, int filterType) {
+    const CpuFeatures& features = cpu();
+    switch (filterType) {
+        case 2:
+            if (features.avx2) upEncodeAVX2(row, prev, n);
+            else upEncodeSSE2(row, prev, n);
+            return true;
+        case 1:
+        case 3:
+        case 4:
+            if (features.avx2) encodeAVX2(row, prev, n, bpp, filterType);
+            else encodeSSE2(row, prev, n, bpp, filterType);
+            return true;
+    }
+    return false;
+}
+
+}
+
+bool filterScanlineSIMD(uint8_t* line, const uint8_t* previous, const uint32_t length, const int bpp, bool decode) {
+    // First row and very short rows are cheap, scalar handles missing row above and short loads
+    if (previous == nullptr || length < 16)
+        return false;
+    if (decode)
+        return decodeSIMD(line + 1, previous + 1, length, bpp, line[0]);
+    return encodeSIMD(line + 1, previous + 1, length, bpp, line[0]);
+}
+
+const char* getFilterISA() {
+    if (cpu().avx2) return "avx2";
+    if (cpu().ssse3) return "ssse3";
+    return "sse2";
+}
+
+#else
+
+bool filterScanlineSIMD(uint8_t*, const uint8_t*, const uint32_t, const int, bool) {
+    return false;
+}
+
+const char* getFilterISA() {
+    return "scalar";
+}
+
+#endif
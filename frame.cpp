@@ -0,0 +1,255 @@
+#include "utils.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// Frame header stored in front of every message:
+//   magic    3 bytes  "Stg"
+//   version  1 byte
+//   flags    1 byte   extensions present after the fixed part
+//   length   4 bytes  message bytes after header, least significant byte first
+// followed by fields of set flags:
+//   mode     1 byte   FRAME_FLAG_MODE: bits per sample in high, channel mask in low nibble
+//   shard    9 bytes  FRAME_FLAG_SHARD: payload id and shard index, 4 bytes each least significant byte first,
+//                     then 1 on the last shard of payload, otherwise 0
+//   packing  9 bytes  FRAME_FLAG_PACKED: codec of message, then length and CRC-32 of original message,
+//                     4 bytes each least significant byte first
+static const uint8_t FRAME_MAGIC[3] = {'S', 't', 'g'};
+
+// Deflate expands input at most about 1032 times (258 byte matches in 2 bit codes)
+static const uint64_t MAX_DEFLATE_RATIO = 1032;
+// Bytes first given to inflate of packed message, doubled whenever they are filled
+static const uint64_t INFLATE_STEP = 64 * 1024;
+
+
+FrameHeader createFrameHeader(uint32_t length, const EmbedMode& mode) {
+    FrameHeader header{};
+    header.version = FRAME_VERSION;
+    header.flags = 0;
+    header.length = length;
+    header.mode = mode;
+    // Default mode needs no field, so such frames stay readable by older versions
+    if (mode.bits != DEFAULT_EMBED_MODE.bits || mode.channels != DEFAULT_EMBED_MODE.channels)
+        header.flags |= FRAME_FLAG_MODE;
+    return header;
+}
+
+
+std::string framePayload(const std::string& message, const EmbedMode& mode) {
+    FrameHeader header = createFrameHeader(message.length(), mode);
+    uint32_t headerSize = getFrameHeaderSize(header.flags);
+    std::string payload;
+    payload.reserve(headerSize + message.length());
+    payload.resize(headerSize);
+    writeFrameHeader(header, reinterpret_cast<uint8_t*>(&payload[0]));
+    payload += message;
+    return payload;
+}
+
+
+std::string framePayload(const std::string& message, const EmbedMode& mode, bool packing, FrameHeader& header) {
+    header = createFrameHeader(message.length(), mode);
+    if (!packing)
+        return framePayload(message, mode);
+
+    header.flags |= FRAME_FLAG_PACKED;
+    header.packing.codec = FRAME_CODEC_STORED;
+    header.packing.length = uint32_t(message.length());
+    header.packing.crc = uint32_t(crc32(0, reinterpret_cast<const Bytef*>(message.data()), uInt(message.length())));
+    uint32_t headerSize = getFrameHeaderSize(header.flags);
+    // Deflated message is written right behind header, so it is copied only once
+    auto deflated = compress(reinterpret_cast<const uint8_t*>(message.data()), message.length());
+    std::string payload;
+    if (deflated.second < message.length()) {
+        header.packing.codec = FRAME_CODEC_DEFLATE;
+        header.length = uint32_t(deflated.second);
+        payload.reserve(headerSize + deflated.second);
+        payload.resize(headerSize);
+        payload.append(reinterpret_cast<const char*>(deflated.first), deflated.second);
+    } else {
+        payload.reserve(headerSize + message.length());
+        payload.resize(headerSize);
+        payload += message;
+    }
+    delete[] deflated.first;
+    writeFrameHeader(header, reinterpret_cast<uint8_t*>(&payload[0]));
+    return payload;
+}
+
+
+std::string unpackMessage(std::string message, const FrameHeader& header) {
+    if (!(header.flags & FRAME_FLAG_PACKED))
+        return message;
+    if (header.packing.codec == FRAME_CODEC_DEFLATE) {
+        // Length comes from image, so it is trusted no further than deflate can expand stored message
+        if (header.packing.length > uint64_t(message.length()) * MAX_DEFLATE_RATIO)
+            throw std::runtime_error("Message is corrupted");
+        z_stream strm{};
+        if (inflateInit(&strm) != Z_OK)
+            throw std::runtime_error("Could not initialize inflate");
+        strm.next_in = reinterpret_cast<Bytef*>(&message[0]);
+        strm.avail_in = uInt(message.length());
+        // Output grows as it arrives; one byte over original length tells longer stream apart
+        uint64_t limit = uint64_t(header.packing.length) + 1;
+        std::string original;
+        int status = Z_OK;
+        while (status == Z_OK && original.length() < limit) {
+            size_t filled = original.length();
+            original.resize(size_t(std::min<uint64_t>(limit, std::max<uint64_t>(uint64_t(filled) * 2, INFLATE_STEP))));
+            strm.next_out = reinterpret_cast<Bytef*>(&original[filled]);
+            strm.avail_out = uInt(original.length() - filled);
+            status = inflate(&strm, Z_NO_FLUSH);
+            original.resize(original.length() - strm.avail_out);
+        }
+        inflateEnd(&strm);
+        if (status != Z_STREAM_END)
+            throw std::runtime_error("Message is corrupted");
+        message.swap(original);
+    }
+    uint32_t crc = uint32_t(crc32(0, reinterpret_cast<const Bytef*>(message.data()), uInt(message.length())));
+    if (message.length() != header.packing.length || crc != header.packing.crc)
+        throw std::runtime_error("Message is corrupted");
+    return message;
+}
+
+
+uint32_t getFrameHeaderSize(uint8_t flags) {
+    uint32_t size = FRAME_HEADER_SIZE;
+    if (flags & FRAME_FLAG_MODE)
+        size += 1;
+    if (flags & FRAME_FLAG_SHARD)
+        size += 9;
+    if (flags & FRAME_FLAG_PACKED)
+        size += 9;
+    return size;
+}
+
+
+void writeFrameHeader(const FrameHeader& header, uint8_t* bytes) {
+    memcpy(bytes, FRAME_MAGIC, 3);
+    bytes[3] = header.version;
+    bytes[4] = header.flags;
+    for (int i = 0; i < 4; ++i)
+        bytes[5 + i] = (header.length >> (8 * i)) & 0xFF;
+
+    uint8_t* field = bytes + FRAME_HEADER_SIZE;
+    if (header.flags & FRAME_FLAG_MODE)
+        *field++ = (header.mode.bits << 4) | (header.mode.channels & 0x0F);
+    if (header.flags & FRAME_FLAG_SHARD) {
+        for (int i = 0; i < 4; ++i)
+            field[i] = (header.shard.id >> (8 * i)) & 0xFF;
+        for (int i = 0; i < 4; ++i)
+            field[4 + i] = (header.shard.index >> (8 * i)) & 0xFF;
+        field[8] = header.shard.last ? 1 : 0;
+        field += 9;
+    }
+    if (header.flags & FRAME_FLAG_PACKED) {
+        field[0] = header.packing.codec;
+        for (int i = 0; i < 4; ++i) {
+            field[1 + i] = (header.packing.length >> (8 * i)) & 0xFF;
+            field[5 + i] = (header.packing.crc >> (8 * i)) & 0xFF;
+        }
+        field += 9;
+    }
+}
+
+
+bool checkFrameMagic(const uint8_t* bytes) {
+    return memcmp(bytes, FRAME_MAGIC, 3) == 0;
+}
+
+
+bool readFrameHeader(const uint8_t* bytes, FrameHeader& header) {
+    if (!checkFrameMagic(bytes) || bytes[3] != FRAME_VERSION)
+        return false;
+    // Size of unknown fields is unknown, so nothing after them could be read
+    if (bytes[4] & ~FRAME_KNOWN_FLAGS)
+        return false;
+    header.version = bytes[3];
+    header.flags = bytes[4];
+    header.length = 0;
+    for (int i = 0; i < 4; ++i)
+        header.length |= uint32_t(bytes[5 + i]) << (8 * i);
+    header.mode = DEFAULT_EMBED_MODE;
+    header.shard = FrameShard{};
+    header.packing = FramePacking{};
+    return true;
+}
+
+
+bool readFrameExtensions(const uint8_t* bytes, FrameHeader& header) {
+    const uint8_t* field = bytes + FRAME_HEADER_SIZE;
+    if (header.flags & FRAME_FLAG_MODE) {
+        header.mode.bits = *field >> 4;
+        header.mode.channels = *field & 0x0F;
+        field++;
+        if (header.mode.bits < 1 || header.mode.bits > 4 || header.mode.channels == 0)
+            return false;
+    }
+    if (header.flags & FRAME_FLAG_SHARD) {
+        header.shard.id = 0;
+        header.shard.index = 0;
+        for (int i = 0; i < 4; ++i) {
+            header.shard.id |= uint32_t(field[i]) << (8 * i);
+            header.shard.index |= uint32_t(field[4 + i]) << (8 * i);
+        }
+        if (field[8] > 1)
+            return false;
+        header.shard.last = field[8] == 1;
+        field += 9;
+    }
+    if (header.flags & FRAME_FLAG_PACKED) {
+        header.packing.codec = field[0];
+        header.packing.length = 0;
+        header.packing.crc = 0;
+        for (int i = 0; i < 4; ++i) {
+            header.packing.length |= uint32_t(field[1 + i]) << (8 * i);
+            header.packing.crc |= uint32_t(field[5 + i]) << (8 * i);
+        }
+        field += 9;
+        if (header.packing.codec > FRAME_CODEC_DEFLATE)
+            return false;
+    }
+    return true;
+}
+
+
+EmbedLayout getEmbedLayout(const FrameHeader& header) {
+    EmbedLayout layout;
+    layout.mode = header.mode;
+    layout.headerBits = uint64_t(getFrameHeaderSize(header.flags)) * 8;
+    return layout;
+}
+
+
+void maskPayload(uint8_t* bytes, uint64_t size, uint64_t offset, const std::string& password) {
+    if (password.empty())
+        return;
+    // Word i of keystream is splitmix64 output for counter i, so masking may start anywhere in payload
+    uint64_t seed = 0xcbf29ce484222325ull; // FNV-1a of password
+    for (unsigned char c : password) {
+        seed ^= c;
+        seed *= 0x100000001b3ull;
+    }
+    auto keyWord = [seed](uint64_t index) {
+        uint64_t z = seed + (index + 1) * 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    };
+    uint64_t done = 0;
+    // Bytes up to the next whole word, then word by word, then what is left
+    for (; done < size && (offset + done) % 8 != 0; ++done)
+        bytes[done] ^= uint8_t(keyWord((offset + done) / 8) >> ((offset + done) % 8 * 8));
+    for (; size - done >= 8; done += 8) {
+        uint64_t key = keyWord((offset + done) / 8);
+        uint8_t keyBytes[8];
+        for (int i = 0; i < 8; ++i)
+            keyBytes[i] = uint8_t(key >> (i * 8));
+        for (int i = 0; i < 8; ++i)
+            bytes[done + i] ^= keyBytes[i];
+    }
+    for (; done < size; ++done)
+        bytes[done] ^= uint8_t(keyWord((offset + done) / 8) >> ((offset + done) % 8 * 8));
+}
@@ -0,0 +1,94 @@
+#include "utils.hpp"
+#include <cstring>
+
+namespace {
+
+// First column, first row, column step and row step of pixels in every Adam7 pass
+const uint8_t ADAM7[ADAM7_PASS_COUNT][4] = {
+    {0, 0, 8, 8},
+    {4, 0, 8, 8},
+    {0, 4, 4, 8},
+    {2, 0, 4, 4},
+    {0, 2, 2, 4},
+    {1, 0, 2, 2},
+    {0, 1, 1, 2}
+};
+
+// Copies pixels of row y between raster row and pass rows holding them;
+// pixels smaller than a byte are moved bit by bit, most significant bits first as in PNG
+template <bool Scatter>
+void copyInterlacedRow(uint8_t* data, const m_data& metadata, uint32_t y, uint8_t* row) {
+    ImagePass passes[ADAM7_PASS_COUNT];
+    getImagePasses(metadata, passes);
+    uint32_t bitsPerPixel = metadata.bitDepth * metadata.channels;
+    uint32_t bpp = bitsPerPixel / 8;
+
+    for (uint32_t i = 0; i < ADAM7_PASS_COUNT; ++i) {
+        const ImagePass& pass = passes[i];
+        uint32_t firstX = ADAM7[i][0], firstY = ADAM7[i][1], stepX = ADAM7[i][2], stepY = ADAM7[i][3];
+        if (pass.height == 0 || y < firstY || (y - firstY) % stepY != 0)
+            continue;
+        uint8_t* passRow = data + pass.offset + (y - firstY) / stepY * pass.rowSize + 1;
+
+        if (bitsPerPixel >= 8) {
+            for (uint32_t x = 0; x < pass.width; ++x) {
+                uint8_t* inPass = passRow + uint64_t(x) * bpp;
+                uint8_t* inRow = row + (firstX + uint64_t(x) * stepX) * bpp;
+                if (Scatter)
+                    memcpy(inPass, inRow, bpp);
+                else
+                    memcpy(inRow, inPass, bpp);
+            }
+            continue;
+        }
+
+        uint8_t mask = (1 << bitsPerPixel) - 1;
+        for (uint32_t x = 0; x < pass.width; ++x) {
+            uint64_t passBit = uint64_t(x) * bitsPerPixel;
+            uint64_t rowBit = (firstX + uint64_t(x) * stepX) * bitsPerPixel;
+            uint8_t* to = Scatter ? passRow + passBit / 8 : row + rowBit / 8;
+            const uint8_t* from = Scatter ? row + rowBit / 8 : passRow + passBit / 8;
+            uint32_t toShift = 8 - bitsPerPixel - (Scatter ? passBit : rowBit) % 8;
+            uint32_t fromShift = 8 - bitsPerPixel - (Scatter ? rowBit : passBit) % 8;
+            uint8_t pixel = (*from >> fromShift) & mask;
+            *to = (*to & ~(mask << toShift)) | (pixel << toShift);
+        }
+    }
+}
+
+}
+
+
+uint32_t getImagePasses(const m_data& data, ImagePass passes[ADAM7_PASS_COUNT]) {
+    uint64_t bitsPerPixel = data.bitDepth * data.channels;
+    if (data.interlance == 0) {
+        passes[0] = {data.width, data.height, 0, getScanlineSize(data) + 1};
+        return 1;
+    }
+
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < ADAM7_PASS_COUNT; ++i) {
+        uint32_t firstX = ADAM7[i][0], firstY = ADAM7[i][1], stepX = ADAM7[i][2], stepY = ADAM7[i][3];
+        ImagePass& pass = passes[i];
+        pass.width = data.width > firstX ? (data.width - firstX + stepX - 1) / stepX : 0;
+        pass.height = data.height > firstY ? (data.height - firstY + stepY - 1) / stepY : 0;
+        // Pass without columns has no rows either, not even filter bytes
+        if (pass.width == 0)
+            pass.height = 0;
+        pass.offset = offset;
+        pass.rowSize = (pass.width * bitsPerPixel + 7) / 8 + 1;
+        offset += pass.rowSize * pass.height;
+    }
+    return ADAM7_PASS_COUNT;
+}
+
+
+void gatherInterlacedRow(const uint8_t* data, const m_data& metadata, uint32_t y, uint8_t* row) {
+    // Data is only read when gathering
+    copyInterlacedRow<false>(const_cast<uint8_t*>(data), metadata, y, row);
+}
+
+
+void scatterInterlacedRow(const uint8_t* row, uint8_t* data, const m_data& metadata, uint32_t y) {
+    copyInterlacedRow<true>(data, metadata, y, const_cast<uint8_t*>(row));
+}
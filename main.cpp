@@ -4,78 +4,347 @@
 #include <cstring>
 #include <vector> // std::vector
 #include <utility> // std::pair
-#include <iomanip> // for std::hex and std::setw
+#include <memory> // std::unique_ptr
+#include <cstdlib> // strtoul
+#include <filesystem>
+#include <new> // std::bad_alloc, std::nothrow_t
+#include "Batch.hpp"
+#include "Codec.hpp"
 #include "Image.hpp"
+#include "MappedFile.hpp"
+#include "PNGWriter.hpp"
+#include "Stats.hpp"
+#include "Stego.hpp"
 #include "utils.hpp"
 
-//TODO add option of adding password
-
 using namespace std;
 
 
-inline uint32_t getMaxMessageSize(const m_data& metadata) {
-    return (metadata.height * metadata.width / 8) - (4 * 8); // Only 1 bit per pixel and 4 bytes for message length
+#ifdef STEG_COUNT_ALLOCATIONS
+// Every heap allocation of the program is counted for --stats; aligned variants keep their default implementation.
+// Only this program replaces them, so programs linking the library keep their own allocator
+void* operator new(size_t size) {
+    void* pointer = allocateCounted(size);
+    if (pointer == nullptr)
+        throw bad_alloc();
+    return pointer;
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    return allocateCounted(size);
+}
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return allocateCounted(size);
+}
+void operator delete(void* pointer) noexcept {
+    releaseCounted(pointer);
+}
+void operator delete[](void* pointer) noexcept {
+    releaseCounted(pointer);
+}
+void operator delete(void* pointer, size_t) noexcept {
+    releaseCounted(pointer);
+}
+void operator delete[](void* pointer, size_t) noexcept {
+    releaseCounted(pointer);
+}
+void operator delete(void* pointer, const nothrow_t&) noexcept {
+    releaseCounted(pointer);
 }
+void operator delete[](void* pointer, const nothrow_t&) noexcept {
+    releaseCounted(pointer);
+}
+#endif
 
 
-int main() {
-    fstream fs;
-    fs.open("NewTux.png", ios::in | ios::binary); // Opening file for reading in binary mod
+// Returns filter strategy by its name given on command line
+FilterStrategy parseFilterStrategy(const char* name) {
+    if (strcmp(name, "keep") == 0) return FilterStrategy::Keep;
+    if (strcmp(name, "minsum") == 0) return FilterStrategy::MinSum;
+    if (strcmp(name, "brute") == 0) return FilterStrategy::BruteForce;
+    throw runtime_error(string("Unknown filter strategy ") + name);
+}
 
-    if (fs) {
-        unsigned char sign[8];
-        // Reading signature of file
-        fs.read(reinterpret_cast<char*>(sign), sizeof(sign));
-        // Displaying signature of file
-        for (int i = 0; i < 8; ++i)
-        cout << static_cast<int>(sign[i]) << ' ';
-        cout << endl;
-        
-        unsigned char type[5] = {0}; // Setting all characters to 0
-        unsigned char crc[4];
-        m_data metadata = {};
-        Image image;
-        do {
-            chunk currentChunk{};
-            uint32_t chunkLength = 0;
-            
-            // Reading chunk length
-            fs.read(reinterpret_cast<char*>(&chunkLength), sizeof(chunkLength));
-            // Reading chunk type
-            fs.read(reinterpret_cast<char*>(type), 4);
-            type[4] = '\0';
-            memcpy(currentChunk.type, type, 4);
-            
-            // Swaping Edian, because png writes values as MSB is on the right side
-            chunkLength = swapEdian(chunkLength);
-            currentChunk.data = new unsigned char[chunkLength];
-            currentChunk.length = chunkLength;
-
-            unsigned char data[chunkLength] = {0};
-            // Reading chunk data
-            fs.read(reinterpret_cast<char*>(data), chunkLength);
-            memcpy(currentChunk.data, data, chunkLength);
-            // Reading chunk CRC
-            fs.read(reinterpret_cast<char*>(crc), 4);
-            memcpy(currentChunk.crc, crc, 4);
-
-            // for (int i = 0; i < 4; ++i)
-            // cout << type[i];
-            // cout << endl;
-            
-            // cout << "Lenght: " << chunkLength  << " bytes" << endl;
-            // cout << '\n';
-            if (strcmp(reinterpret_cast<const char*>(type), "IDAT") == 0)
-                image.addIDATChunk(data, chunkLength); // Adding data from IDAT chunk into total image
+
+// Prints size of compressed image data for every filter strategy
+void reportFilterStrategies(const uint8_t* rawData, uint64_t rawSize, const m_data& metadata) {
+    const pair<const char*, FilterStrategy> strategies[] = {
+        {"keep", FilterStrategy::Keep},
+        {"minsum", FilterStrategy::MinSum},
+        {"brute", FilterStrategy::BruteForce}
+    };
+    vector<uint8_t> copy(rawSize);
+    for (auto& strategy : strategies) {
+        memcpy(copy.data(), rawData, rawSize);
+        chooseFilters(copy.data(), rawSize, metadata, strategy.second);
+        filter(copy.data(), rawSize, metadata, false);
+        auto p = compress(copy.data(), rawSize);
+        cout << "Filter strategy " << strategy.first << ": " << p.second << " bytes" << endl;
+        delete[] p.first;
+    }
+}
+
+
+// Writes bytes as hex, starting new line with every row, the same way for any size of image
+void dumpHex(const char* path, const uint8_t* data, uint64_t size, uint64_t rowSize) {
+    static const char digits[] = "0123456789abcdef";
+    string text;
+    text.reserve(size * 3 + size / rowSize + 1);
+    for (uint64_t i = 0; i < size; ++i) {
+        if (i % rowSize == 0)
+            text += '\n';
+        text += digits[data[i] >> 4];
+        text += digits[data[i] & 0x0F];
+        text += ' ';
+    }
+    ofstream output(path, ios::out | ios::binary);
+    if (!output.is_open()) {
+        cerr << "Could not open dump file " << path << endl;
+        return;
+    }
+    output.write(text.data(), text.size());
+}
+
+
+// Returns inflated image data of PNG file, reconstructed if unfiltering
+vector<uint8_t> readImageData(const uint8_t* png, size_t size, bool unfiltering) {
+    Image image;
+    m_data metadata = readPNG(png, size, image, false);
+    vector<uint8_t> data(getImageSize(metadata));
+    unsigned char* inflated = decompress(image.getIDATChunks(), data.size());
+    memcpy(data.data(), inflated, data.size());
+    delete[] inflated;
+    if (unfiltering)
+        filter(data.data(), data.size(), metadata, true);
+    return data;
+}
+
+
+// Prints stats and writes trace if they were asked for
+void reportStats(const Stats* stats, bool printing, const char* tracePath) {
+    if (stats == nullptr)
+        return;
+    if (printing)
+        stats->print(cout);
+    if (tracePath != nullptr) {
+        ofstream trace(tracePath);
+        if (!trace.is_open()) {
+            cerr << "Could not open trace file " << tracePath << endl;
+            return;
+        }
+        stats->writeJSON(trace);
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+    // --input and --output replace default image paths; BMP, PGM and PPM inputs are copied to output
+    // and embedded into in place, output of the same path as input changes it
+    // --extract prints embedded message, --detect only checks whether image carries one
+    // --stream processes image one scanline at a time instead of holding it whole in memory
+    // --filter keep|minsum|brute picks filter types of output rows
+    // --filter-report prints compressed size for every filter strategy
+    // --codec picks compression profile of output (best, filtered, default, rle, fast, store)
+    // --threads and --segment-size tune parallel compression of output
+    // --trust-input skips checking CRCs of chunks of input images
+    // --idat-size sets bytes per IDAT chunk of output (8192 by default), 0 writes image data as one chunk
+    // --bits 1-4 low bits of every sample and --channels (letters like rgba) carrying message
+    // --password spreads message over image in order derived from it, extracting needs the same password
+    // --pack deflates message when that leaves fewer pixels to change and adds CRC-32 checked on extraction
+    // --chunk stores message in private chunk instead of pixels, copying image data unchanged; extracting finds it by itself
+    // --batch manifest embeds every job of tab separated manifest (cover, payload file, output),
+    // --batch-dir directory embeds --payload file into every PNG of directory, writing into --output-dir,
+    // --shard-dir directory splits --payload file (- for stdin) over PNGs of directory the same way, each carrying what fits;
+    // jobs run concurrently on --threads workers
+    // --join-dir directory writes --payload file (- for stdout) rebuilt from shards in PNGs of directory
+    // --stats prints time, CPU time and bytes of every stage, compression ratio and, when built with STEG_COUNT_ALLOCATIONS,
+    // peak allocated memory and allocations of every stage,
+    // --trace file.json writes them together with every timed run as JSON trace
+    // --dump writes hex dumps of image data before embedding and after filtering (10x50_2.txt, 10x50_3.txt)
+    const char* inputPath = "NewTux.png";
+    const char* outputPath = "NewTux2.png";
+    bool extracting = false;
+    bool detecting = false;
+    bool streaming = false;
+    bool filterReport = false;
+    FilterStrategy strategy = FilterStrategy::MinSum;
+    string codecName = "best";
+    CodecOptions codecOptions;
+    uint32_t idatSize = 8192;
+    bool checkingCRC = true;
+    EmbedMode mode = DEFAULT_EMBED_MODE;
+    const char* channelNames = nullptr;
+    string password;
+    bool packing = false;
+    bool inChunk = false;
+    const char* manifestPath = nullptr;
+    const char* batchDirectory = nullptr;
+    const char* shardDirectory = nullptr;
+    const char* joinDirectory = nullptr;
+    const char* payloadPath = nullptr;
+    const char* outputDirectory = nullptr;
+    bool printingStats = false;
+    const char* tracePath = nullptr;
+    bool dumping = false;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+                inputPath = argv[++i];
+            else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+                outputPath = argv[++i];
+            else if (strcmp(argv[i], "--extract") == 0)
+                extracting = true;
+            else if (strcmp(argv[i], "--detect") == 0)
+                detecting = true;
+            else if (strcmp(argv[i], "--stream") == 0)
+                streaming = true;
+            else if (strcmp(argv[i], "--filter-report") == 0)
+                filterReport = true;
+            else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+                strategy = parseFilterStrategy(argv[++i]);
+            else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+                codecOptions.threads = strtoul(argv[++i], nullptr, 10);
+            else if (strcmp(argv[i], "--segment-size") == 0 && i + 1 < argc)
+                codecOptions.segmentSize = strtoul(argv[++i], nullptr, 10);
+            else if (strcmp(argv[i], "--trust-input") == 0)
+                checkingCRC = false;
+            else if (strcmp(argv[i], "--idat-size") == 0 && i + 1 < argc)
+                idatSize = strtoul(argv[++i], nullptr, 10);
+            else if (strcmp(argv[i], "--codec") == 0 && i + 1 < argc)
+                codecName = argv[++i];
+            else if (strcmp(argv[i], "--bits") == 0 && i + 1 < argc)
+                mode.bits = strtoul(argv[++i], nullptr, 10);
+            else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc)
+                channelNames = argv[++i];
+            else if (strcmp(argv[i], "--password") == 0 && i + 1 < argc)
+                password = argv[++i];
+            else if (strcmp(argv[i], "--pack") == 0)
+                packing = true;
+            else if (strcmp(argv[i], "--chunk") == 0)
+                inChunk = true;
+            else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+                manifestPath = argv[++i];
+            else if (strcmp(argv[i], "--batch-dir") == 0 && i + 1 < argc)
+                batchDirectory = argv[++i];
+            else if (strcmp(argv[i], "--shard-dir") == 0 && i + 1 < argc)
+                shardDirectory = argv[++i];
+            else if (strcmp(argv[i], "--join-dir") == 0 && i + 1 < argc)
+                joinDirectory = argv[++i];
+            else if (strcmp(argv[i], "--payload") == 0 && i + 1 < argc)
+                payloadPath = argv[++i];
+            else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc)
+                outputDirectory = argv[++i];
+            else if (strcmp(argv[i], "--stats") == 0)
+                printingStats = true;
+            else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+                tracePath = argv[++i];
+            else if (strcmp(argv[i], "--dump") == 0)
+                dumping = true;
             else
-                image.addChunk(currentChunk);
-
-            if (strcmp(reinterpret_cast<const char*>(type), "IHDR") == 0)
-                metadata = getMetadata(data, chunkLength);
-        
-        } while (strcmp(reinterpret_cast<const char*>(type), "IEND") != 0);
-        fs.close();
-        //TODO add specification for indexed colors
+                throw runtime_error(string("Unknown option ") + argv[i]);
+        }
+        if (idatSize > ChunkCRC::MAX_CHUNK_SIZE)
+            throw runtime_error("--idat-size is larger than PNG chunks can be");
+
+        // Nothing is timed unless stats are asked for
+        unique_ptr<Stats> stats;
+        if (printingStats || tracePath != nullptr)
+            stats.reset(new Stats(tracePath != nullptr));
+
+        // Unknown profile is reported before any image is read
+        createCodec(codecName, codecOptions);
+
+        if (joinDirectory != nullptr) {
+            if (payloadPath == nullptr)
+                throw runtime_error("--join-dir needs --payload");
+            uint64_t length;
+            if (strcmp(payloadPath, "-") == 0) {
+                length = joinShards(joinDirectory, cout, password);
+                cout.flush();
+            } else {
+                ofstream payload(payloadPath, ios::out | ios::binary);
+                if (!payload.is_open())
+                    throw runtime_error(string("Could not open payload ") + payloadPath);
+                length = joinShards(joinDirectory, payload, password);
+            }
+            cerr << "Payload of " << length << " bytes joined" << endl;
+            return 0;
+        }
+
+        if (manifestPath != nullptr || batchDirectory != nullptr || shardDirectory != nullptr) {
+            BatchOptions batchOptions;
+            batchOptions.bits = mode.bits;
+            batchOptions.channels = channelNames != nullptr ? channelNames : "";
+            batchOptions.password = password;
+            batchOptions.packing = packing;
+            batchOptions.strategy = strategy;
+            batchOptions.codecName = codecName;
+            batchOptions.idatSize = idatSize;
+            batchOptions.checkingCRC = checkingCRC;
+            batchOptions.threads = codecOptions.threads;
+            batchOptions.stats = stats.get();
+            Batch batch(batchOptions);
+            if (manifestPath != nullptr)
+                batch.readManifest(manifestPath);
+            if (batchDirectory != nullptr) {
+                if (payloadPath == nullptr || outputDirectory == nullptr)
+                    throw runtime_error("--batch-dir needs --payload and --output-dir");
+                batch.addDirectory(batchDirectory, payloadPath, outputDirectory);
+            }
+            size_t failed;
+            if (shardDirectory != nullptr) {
+                if (payloadPath == nullptr || outputDirectory == nullptr || batch.getJobCount() != 0)
+                    throw runtime_error("--shard-dir needs --payload and --output-dir and no other jobs");
+                // Shards are cut to capacity of covers before deflate could tell how much they shrink
+                if (packing)
+                    throw runtime_error("--pack does not apply to --shard-dir");
+                batch.addDirectory(shardDirectory, "", outputDirectory);
+                if (strcmp(payloadPath, "-") == 0) {
+                    failed = batch.runShards(cin, cout);
+                } else {
+                    ifstream payload(payloadPath, ios::in | ios::binary);
+                    if (!payload.is_open())
+                        throw runtime_error(string("Could not open payload ") + payloadPath);
+                    failed = batch.runShards(payload, cout);
+                }
+            } else {
+                failed = batch.run(cout);
+            }
+            reportStats(stats.get(), printingStats, tracePath);
+            return failed == 0 ? 0 : 1;
+        }
+
+        StageTimer timer(stats.get(), Stage::Read);
+        MappedFile file(inputPath); // Mapping whole file for reading
+        timer.setBytesOut(file.getSize());
+        // Chunks are only referenced inside the mapping, so it has to outlive the image
+        timer.restart(Stage::Parse, file.getSize());
+        // Uncompressed covers have no chunks; their pixels are found in place
+        bool raw = isRawImage(file.getData(), file.getSize());
+        const char* channelLetters = nullptr;
+        Image image;
+        m_data metadata;
+        if (raw) {
+            RawLayout layout = readRawImage(file.getData(), file.getSize());
+            metadata = layout.metadata;
+            channelLetters = layout.channels;
+        } else {
+            metadata = readPNG(file.getData(), file.getSize(), image, checkingCRC, codecOptions.threads);
+            timer.setBytesOut(image.getIDATSize());
+        }
+        timer.stop();
+
+        const unsigned char* sign = file.getData();
+        // Displaying signature of file
+        if (!raw) {
+            for (int i = 0; i < 8; ++i)
+                cout << static_cast<int>(sign[i]) << ' ';
+            cout << endl;
+        }
+
         cout << "width: " << metadata.width << endl;
         cout << "height: " << metadata.height << endl;
         cout << "bitDepth:" << static_cast<int>(metadata.bitDepth) << endl;
@@ -84,142 +353,110 @@ int main() {
         cout << "filter: " << static_cast<int>(metadata.filter) << endl;
         cout << "interlance: " << static_cast<int>(metadata.interlance) << endl;
         cout << "channels: " << static_cast<int>(metadata.channels) << endl;
+        if (const chunk* plte = image.findChunk("PLTE"))
+            cout << "palette: " << plte->length / 3 << endl;
+
+        // Channel letters depend on color type of image
+        if (channelNames != nullptr)
+            mode.channels = parseChannels(channelNames, metadata, channelLetters);
 
-        auto IDAT_chunks = image.getIDATChunks();
-        auto otherChunks = image.getOtherChunks();
-        uint32_t total_IDAT_size = image.getIDATSize();
-        unsigned char* compressedData = new unsigned char[total_IDAT_size];
-        
-        size_t offset = 0;
-        for (auto& chunk : IDAT_chunks) {
-            memcpy(compressedData + offset, chunk.first, chunk.second);
-            offset += chunk.second;
+        // Chunks were checked when parsed above, the library works on the same mapping
+        ExtractOptions extractOptions;
+        extractOptions.password = password;
+        extractOptions.checkingCRC = false;
+        extractOptions.threads = codecOptions.threads;
+        extractOptions.stats = stats.get();
+
+        // Both stop inflating as soon as the rows they need are decoded
+        if (detecting) {
+            StegoResult result = detect(file.getData(), file.getSize(), extractOptions);
+            if (result.error != StegoError::None && result.error != StegoError::NoMessage)
+                throw runtime_error(result.description);
+            bool found = result.error == StegoError::None;
+            cout << (found ? "Image carries a message" : "Image carries no message") << endl;
+            reportStats(stats.get(), printingStats, tracePath);
+            return found ? 0 : 2;
+        }
+        if (extracting) {
+            StegoResult result = extract(file.getData(), file.getSize(), extractOptions);
+            if (result.error != StegoError::None)
+                throw runtime_error(result.description);
+            cout << "Message length: " << result.message.length() << endl;
+            cout << "Given message: " << result.message << endl;
+            reportStats(stats.get(), printingStats, tracePath);
+            return 0;
         }
-        std::cout << image.getIDATSize() << endl;
-        uint32_t inflatedSize = getImageSize(metadata);
-        
-        unsigned char* inflatedData = decompress(compressedData, total_IDAT_size, inflatedSize);
-        
-        // Filtering to get raw data
-        filter(inflatedData, inflatedSize, metadata, true);
-
-        uint32_t maxMessageLegth = getMaxMessageSize(metadata);
+
+        // Passes of interlaced image are spread over whole image data, so it cannot be streamed;
+        // neither can keyed order, which jumps between all rows
+        if (streaming && inChunk)
+            cout << "Image data is copied as it is" << endl;
+        else if (streaming && raw)
+            cout << "Uncompressed image is embedded into in place" << endl;
+        else if (streaming && metadata.interlance != 0)
+            cout << "Interlaced image is processed whole" << endl;
+        else if (streaming && !password.empty())
+            cout << "Keyed image is processed whole" << endl;
+
+        // Chunk holds as much as frame length can tell
+        uint64_t maxMessageLegth = inChunk ? UINT32_MAX : getMessageCapacity(metadata, mode);
         cout << "Max size for message is: " << maxMessageLegth << endl;
         string message;
         std::getline(cin, message);
-        std::cout << "Message is: " << message << endl;
-        std::cout << "Length of message is: " << message.length() << endl;
-        uint32_t messageLength = message.length();
-        std::cout << (int)message[0] << endl;
-        // TODO add check if message fits into image
-        std::cout << endl;
-
-        fstream output;
 
-        output.open("10x50_2.txt", ios::out);
-        if (!output.is_open()) cerr << "could not open file\n";
-        std::cout << endl;
-        output << std::hex;
-        for (size_t i = 0; i < inflatedSize; ++i) {
-            if (i % (((metadata.bitDepth + 7) / 8) * metadata.width * metadata.channels + 1) == 0)
-                output << "\n";
-            output << std::setfill('0') << std::setw(2)
-                    << (int)inflatedData[i] << " ";
-            
+        if (dumping && !raw) {
+            vector<uint8_t> before = readImageData(file.getData(), file.getSize(), true);
+            dumpHex("10x50_2.txt", before.data(), before.size(), getScanlineSize(metadata) + 1);
         }
-        output.close();
-
-        // encodeMessage(inflatedData, inflatedSize, message, metadata.width, 
-        //     metadata.height, metadata.channels);
-        encodeMessage(inflatedData, inflatedSize, message, metadata);
-        string msg = decodeMessage(inflatedData, inflatedSize, metadata);
 
-        std::cout << "Given message: " << msg << endl;
-        cout << "Size of given message: " << msg.length() << endl; 
+        EmbedOptions embedOptions;
+        embedOptions.mode = mode;
+        embedOptions.password = password;
+        embedOptions.packing = packing;
+        embedOptions.inChunk = inChunk;
+        embedOptions.strategy = strategy;
+        embedOptions.codecName = codecName;
+        embedOptions.codecOptions = codecOptions;
+        embedOptions.idatSize = idatSize;
+        embedOptions.checkingCRC = false;
+        embedOptions.streaming = streaming;
+        embedOptions.stats = stats.get();
+        // Embedding is not decoded again here; packed messages carry CRC-32 checked on extraction instead
+        StegoResult result;
+        if (raw) {
+            // Copy is made on disk and embedded into there, cover of the same path is changed itself
+            error_code error;
+            bool copying = !filesystem::equivalent(inputPath, outputPath, error);
+            if (copying)
+                filesystem::copy_file(inputPath, outputPath, filesystem::copy_options::overwrite_existing);
+            result = embedInPlace(outputPath, message, embedOptions);
+            if (result.error != StegoError::None && copying)
+                filesystem::remove(outputPath, error);
+        } else {
+            result = embedToFile(file.getData(), file.getSize(), message, outputPath, embedOptions);
+        }
+        if (result.error != StegoError::None)
+            throw runtime_error(result.description);
 
         std::cout << endl;
-        
-        // Filtering to potentially get better compression
-        filter(inflatedData, inflatedSize, metadata, false);
-        
-        auto p = compress(inflatedData, inflatedSize);
-
-        unsigned char* deflatedData = p.first;
-        uint32_t deflatedSize = p.second;
-        
-        // fstream output;
-        output.open("NewTux2.png", ios::out | ios::binary);
-        
-        if (output.is_open()) {
-            // Writing PNG signature into output file
-            output.write(reinterpret_cast<char*>(sign), 8);
-            // Writing all other chunks except IEND
-            for (auto it = otherChunks.begin(); it != otherChunks.end() - 1; ++it) {
-                uint32_t chunkLen = swapEdian(it->length);
-                output.write(reinterpret_cast<const char*>(&chunkLen), 4);
-                output.write(reinterpret_cast<const char*>(it->type), 4);
-                output.write(reinterpret_cast<char*>(it->data), it->length);
-                output.write(reinterpret_cast<const char*>(it->crc), 4);
+
+        // Reports read image data back from output, so embedding itself is not slowed down by them
+        if ((filterReport || dumping) && !raw) {
+            MappedFile output(outputPath);
+            if (filterReport) {
+                vector<uint8_t> embedded = readImageData(output.getData(), output.getSize(), true);
+                reportFilterStrategies(embedded.data(), embedded.size(), metadata);
             }
-            uint32_t MAX_SIZE = 8192;
-
-            size_t offset = 0;
-            uint32_t chunkLength = 0;
-            unsigned char* chunkData = nullptr;
-            // Writing all IDAT chunks
-            for (int i = 0 ; i < int(deflatedSize / MAX_SIZE) + 1; ++i) {
-                if (deflatedSize < (i + 1) * MAX_SIZE) {
-                    chunkLength = deflatedSize - (i * MAX_SIZE);
-                } else {
-                    chunkLength = MAX_SIZE;
-                }
-                unsigned char* chunkData = new unsigned char[chunkLength];
-                memcpy(chunkData, (deflatedData + i * MAX_SIZE), chunkLength);
-                uint32_t edianLength = swapEdian(chunkLength);
-                // Writing length of IDAT chunk
-                output.write(reinterpret_cast<char*>(&edianLength), 4);
-                // Writing chunk type
-                output.write("IDAT", 4);
-                // Writing chunk data
-                output.write(reinterpret_cast<char*>(chunkData), chunkLength);
-                // Writing chunk crc
-                uint32_t crc = swapEdian(calculate_crc("IDAT", chunkData, chunkLength));
-
-                output.write(reinterpret_cast<char*>(&crc), 4);
-                delete[] chunkData;
+            if (dumping) {
+                vector<uint8_t> after = readImageData(output.getData(), output.getSize(), false);
+                dumpHex("10x50_3.txt", after.data(), after.size(), getScanlineSize(metadata) + 1);
             }
-
-            // Writing IEND chunk    
-            uint32_t crc = swapEdian(calculate_crc("IEND", nullptr, 0));
-            uint32_t IEND_length = 0;
-
-            output.write(reinterpret_cast<char*>(&IEND_length), 4);
-            output.write("IEND", 4);
-            output.write(reinterpret_cast<char*>(&crc), 4);
-
-        } else 
-            cerr << "Could not open output file\n";
-        
-        output.close();
-
-        output.open("10x50_3.txt", ios::out);
-        if (!output.is_open()) cerr << "could not open file\n";
-        std::cout << endl;
-        output << std::hex;
-        for (size_t i = 0; i < inflatedSize; ++i) {
-            if (i % (((metadata.bitDepth + 7) / 8) * metadata.width * metadata.channels + 1) == 0)
-                output << "\n";
-            output << std::setfill('0') << std::setw(2)
-                    << (int)inflatedData[i] << " ";
-            
         }
-        output.close();
-        // Freeing memory
-        delete inflatedData;
-        delete deflatedData;
-    } else 
-        cerr << "Could not open file\n";
-    
+        reportStats(stats.get(), printingStats, tracePath);
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
     
     return 0;
 }
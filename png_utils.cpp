@@ -1,14 +1,20 @@
 #include "utils.hpp"
+#include "Image.hpp"
+#include "PixelFormat.hpp"
 #include <zlib.h>
-#include <cmath>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 uint32_t calculate_crc(const char* type, const uint8_t* data, size_t length) {
-    if (data == nullptr) {
-        return 0xAE426082;
-    }
     uint32_t crc = crc32(0L, Z_NULL, 0);             // Start CRC
     crc = crc32(crc, reinterpret_cast<const Bytef*>(type), 4);  // Chunk type
-    crc = crc32(crc, data, length);                  // Chunk data
+    // zlib treats null data as request for initial value, so empty chunks stop at their type
+    for (size_t done = 0; done < length; done += UINT32_MAX)
+        crc = crc32(crc, data + done, uInt(length - done < UINT32_MAX ? length - done : UINT32_MAX)); // Chunk data
     return crc;
 }
 
@@ -65,10 +71,173 @@ m_data getMetadata(const unsigned char* data, uint8_t size) {
 }
 
 
-uint32_t getImageSize(const m_data& data) {
-    uint32_t bitsPerPixel = data.bitDepth * data.channels;
-    uint32_t bytesPerScanline = ceil((data.width * bitsPerPixel) / 8);
-    uint32_t inflatedSize = (bytesPerScanline + 1) * data.height;
+uint64_t getScanlineSize(const m_data& data) {
+    uint64_t bitsPerPixel = data.bitDepth * data.channels;
+    // Rows of samples smaller than a byte end with a partly used byte
+    return (data.width * bitsPerPixel + 7) / 8;
+}
+
+
+uint64_t getImageSize(const m_data& data) {
+    ImagePass passes[ADAM7_PASS_COUNT];
+    uint32_t count = getImagePasses(data, passes);
+    // Passes follow each other, so image data ends where the last one ends
+    return passes[count - 1].offset + passes[count - 1].rowSize * passes[count - 1].height;
+}
+
+
+int getBytesPerPixel(const m_data& data) {
+    return (data.bitDepth * data.channels + 7) / 8;
+}
+
+
+void writeChunk(std::ostream& output, const char* type, const uint8_t* data, uint32_t length) {
+    uint32_t edianLength = swapEdian(length);
+    uint32_t crc = swapEdian(calculate_crc(type, data, length));
+
+    output.write(reinterpret_cast<const char*>(&edianLength), 4);
+    output.write(type, 4);
+    output.write(reinterpret_cast<const char*>(data), length);
+    output.write(reinterpret_cast<const char*>(&crc), 4);
+}
+
+namespace {
+
+// IDAT data below this size is checked serially, starting threads would take longer than checking it
+const uint64_t PARALLEL_CRC_SIZE = 4 * 1024 * 1024;
+// Bytes one thread checks at a time; chunks larger than this are cut and their CRCs combined
+const uint32_t CRC_SLICE_SIZE = 1024 * 1024;
+
+// Type and data of chunk starting at its type field, followed by stored CRC
+struct CheckedChunk {
+    const uint8_t* type;
+    uint32_t length;
+};
+
+uint32_t readStoredCRC(const CheckedChunk& chunk) {
+    uint32_t crc = 0;
+    memcpy(&crc, chunk.type + 4 + chunk.length, 4);
+    return swapEdian(crc);
+}
+
+void throwWrongCRC(const uint8_t* type) {
+    throw std::runtime_error("PNG chunk " + std::string(reinterpret_cast<const char*>(type), 4) + " has wrong CRC");
+}
+
+void checkCRC(const CheckedChunk& chunk) {
+    if (calculate_crc(reinterpret_cast<const char*>(chunk.type), chunk.type + 4, chunk.length) != readStoredCRC(chunk))
+        throwWrongCRC(chunk.type);
+}
+
+// Checks CRCs of IDAT chunks; large runs are cut into slices checked on threads (0 means one per core),
+// CRCs of slices of one chunk are joined by crc32_combine
+void checkIDATCRCs(const std::vector<CheckedChunk>& chunks, uint64_t size, unsigned threads) {
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (size < PARALLEL_CRC_SIZE || threads <= 1) {
+        for (auto& chunk : chunks)
+            checkCRC(chunk);
+        return;
+    }
+
+    struct Slice {
+        size_t chunk;
+        const uint8_t* data;
+        uint32_t length;
+        uLong crc;
+    };
+    std::vector<Slice> slices;
+    slices.reserve(chunks.size() + size / CRC_SLICE_SIZE);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        // Type field is covered by CRC as well, so it starts the first slice
+        uint64_t length = uint64_t(chunks[i].length) + 4;
+        for (uint64_t offset = 0; offset < length; offset += CRC_SLICE_SIZE) {
+            uint32_t sliceLength = uint32_t(length - offset < CRC_SLICE_SIZE ? length - offset : CRC_SLICE_SIZE);
+            slices.push_back({i, chunks[i].type + offset, sliceLength, 0});
+        }
+    }
+
+    std::atomic<size_t> nextSlice(0);
+    auto work = [&]() {
+        for (size_t i = nextSlice++; i < slices.size(); i = nextSlice++)
+            slices[i].crc = crc32(crc32(0L, Z_NULL, 0), slices[i].data, slices[i].length);
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads && i < slices.size(); ++i)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+
+    for (size_t i = 0; i < slices.size();) {
+        size_t chunk = slices[i].chunk;
+        uLong crc = slices[i].crc;
+        for (++i; i < slices.size() && slices[i].chunk == chunk; ++i)
+            crc = crc32_combine(crc, slices[i].crc, z_off_t(slices[i].length));
+        if (uint32_t(crc) != readStoredCRC(chunks[chunk]))
+            throwWrongCRC(chunks[chunk].type);
+    }
+}
+
+}
+
+m_data readPNG(const uint8_t* file, size_t size, Image& image, bool checkingCRC, unsigned threads) {
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (size < 8 || memcmp(file, signature, 8) != 0)
+        throw std::runtime_error("File is not a PNG image");
+
+    image.clear();
+    m_data metadata = {};
+    bool hasHeader = false;
+    // IDAT chunks are checked together once their run is known, so a large run can be checked on threads
+    std::vector<CheckedChunk> idatChunks;
+    size_t offset = 8;
+    for (;;) {
+        // Every chunk has at least length, type and crc
+        if (size - offset < 12)
+            throw std::runtime_error("PNG file is truncated");
+
+        chunk currentChunk{};
+        uint32_t chunkLength = 0;
+        memcpy(&chunkLength, file + offset, 4);
+        chunkLength = swapEdian(chunkLength);
+        if (size - offset - 12 < chunkLength)
+            throw std::runtime_error("PNG file is truncated");
+
+        currentChunk.length = chunkLength;
+        memcpy(currentChunk.type, file + offset + 4, 4);
+        currentChunk.data = file + offset + 8;
+        memcpy(currentChunk.crc, file + offset + 8 + chunkLength, 4);
+        CheckedChunk checked = {file + offset + 4, chunkLength};
+        offset += 12 + size_t(chunkLength);
 
-    return inflatedSize;
+        if (memcmp(currentChunk.type, "IDAT", 4) == 0) {
+            image.addIDATChunk(currentChunk.data, chunkLength); // Adding data from IDAT chunk into total image
+            if (checkingCRC)
+                idatChunks.push_back(checked);
+            continue;
+        }
+        if (checkingCRC)
+            checkCRC(checked);
+        image.addChunk(currentChunk);
+
+        if (memcmp(currentChunk.type, "IHDR", 4) == 0) {
+            if (chunkLength < 13)
+                throw std::runtime_error("IHDR chunk is too short");
+            metadata = getMetadata(currentChunk.data, chunkLength);
+            hasHeader = true;
+        }
+        if (memcmp(currentChunk.type, "IEND", 4) == 0)
+            break;
+    }
+
+    if (!hasHeader)
+        throw std::runtime_error("PNG file has no IHDR chunk");
+    if (checkingCRC)
+        checkIDATCRCs(idatChunks, image.getIDATSize(), threads);
+    if (metadata.interlance > 1)
+        throw std::runtime_error("Unknown interlace method");
+    // Rejects formats no sample loop is specialized for before anything is decoded
+    visitPixelFormat(metadata, [](auto) {});
+    return metadata;
 }
\ No newline at end of file
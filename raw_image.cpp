@@ -0,0 +1,132 @@
+#include "utils.hpp"
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+// BITMAPFILEHEADER followed by BITMAPINFOHEADER, the smallest header describing pixels
+const size_t BMP_HEADER_SIZE = 54;
+
+// Little endian fields of BMP headers
+uint32_t readLE32(const uint8_t* field) {
+    return uint32_t(field[0]) | uint32_t(field[1]) << 8 | uint32_t(field[2]) << 16 | uint32_t(field[3]) << 24;
+}
+
+uint16_t readLE16(const uint8_t* field) {
+    return uint16_t(field[0] | field[1] << 8);
+}
+
+m_data createMetadata(uint32_t width, uint32_t height, uint8_t bitDepth, uint8_t color) {
+    m_data metadata = {0};
+    metadata.width = width;
+    metadata.height = height;
+    metadata.bitDepth = bitDepth;
+    metadata.color = color;
+    metadata.channels = getChannels(color);
+    return metadata;
+}
+
+// Uncompressed 24 or 32 bit BMP; rows are padded to 4 bytes and stored bottom up unless height is negative
+RawLayout readBMP(const uint8_t* file, size_t size) {
+    if (size < BMP_HEADER_SIZE)
+        throw std::runtime_error("BMP header is truncated");
+    uint32_t offset = readLE32(file + 10);
+    uint32_t infoSize = readLE32(file + 14);
+    int32_t width = int32_t(readLE32(file + 18));
+    int32_t height = int32_t(readLE32(file + 22));
+    uint16_t bitCount = readLE16(file + 28);
+    uint32_t compression = readLE32(file + 30);
+    if (infoSize < 40 || readLE16(file + 26) != 1 || width <= 0 || height == 0 || height == INT32_MIN)
+        throw std::runtime_error("BMP header is malformed");
+
+    RawLayout layout;
+    if (bitCount == 24 && compression == 0) {
+        layout.metadata = createMetadata(uint32_t(width), 0, 8, 2);
+        layout.channels = "bgr";
+    } else if (bitCount == 32 && (compression == 0 || compression == 3)) {
+        // Bit fields follow info header or are its part, at the same place either way
+        if (compression == 3 && (size < BMP_HEADER_SIZE + 12 || readLE32(file + 54) != 0x00FF0000 ||
+                                 readLE32(file + 58) != 0x0000FF00 || readLE32(file + 62) != 0x000000FF))
+            throw std::runtime_error("Only BMP with bytes in blue, green, red, alpha order is supported");
+        layout.metadata = createMetadata(uint32_t(width), 0, 8, 6);
+        layout.channels = "bgra";
+    } else {
+        throw std::runtime_error("Only uncompressed 24 and 32 bit BMP is supported");
+    }
+
+    bool topDown = height < 0;
+    uint32_t rows = uint32_t(topDown ? -int64_t(height) : height);
+    layout.metadata.height = rows;
+    uint64_t rowSize = (uint64_t(width) * bitCount + 31) / 32 * 4;
+    if (offset < BMP_HEADER_SIZE || offset > size || rows > (size - offset) / rowSize)
+        throw std::runtime_error("BMP pixel data is truncated");
+    layout.offset = topDown ? offset : offset + rowSize * (rows - 1);
+    layout.stride = topDown ? int64_t(rowSize) : -int64_t(rowSize);
+    return layout;
+}
+
+bool isSpace(uint8_t byte) {
+    return byte == ' ' || byte == '\t' || byte == '\n' || byte == '\r' || byte == '\v' || byte == '\f';
+}
+
+// Reads decimal field of PNM header at position, skipping whitespace and comments before it
+uint32_t readPNMField(const uint8_t* file, size_t size, size_t& position) {
+    while (position < size && (isSpace(file[position]) || file[position] == '#')) {
+        if (file[position] == '#')
+            while (position < size && file[position] != '\n' && file[position] != '\r')
+                ++position;
+        else
+            ++position;
+    }
+    if (position == size || file[position] < '0' || file[position] > '9')
+        throw std::runtime_error("PNM header is malformed");
+    uint64_t value = 0;
+    while (position < size && file[position] >= '0' && file[position] <= '9') {
+        value = value * 10 + (file[position++] - '0');
+        if (value > UINT32_MAX)
+            throw std::runtime_error("PNM header is malformed");
+    }
+    return uint32_t(value);
+}
+
+// Binary PGM (P5) or PPM (P6); samples of maxval 65535 are two bytes, most significant first as in PNG
+RawLayout readPNM(const uint8_t* file, size_t size) {
+    size_t position = 2;
+    uint32_t width = readPNMField(file, size, position);
+    uint32_t height = readPNMField(file, size, position);
+    uint32_t maxval = readPNMField(file, size, position);
+    // Exactly one whitespace byte separates header from pixels
+    if (position == size || !isSpace(file[position]) || width == 0 || height == 0)
+        throw std::runtime_error("PNM header is malformed");
+    ++position;
+    // Changed low bits of samples below other maxvals could leave their range
+    if (maxval != 255 && maxval != 65535)
+        throw std::runtime_error("Only PNM with maxval 255 or 65535 is supported");
+
+    bool color = file[1] == '6';
+    RawLayout layout;
+    layout.metadata = createMetadata(width, height, maxval == 255 ? 8 : 16, color ? 2 : 0);
+    layout.channels = color ? "rgb" : "g";
+    uint64_t rowSize = getScanlineSize(layout.metadata);
+    if (height > (size - position) / rowSize)
+        throw std::runtime_error("PNM pixel data is truncated");
+    layout.offset = position;
+    layout.stride = int64_t(rowSize);
+    return layout;
+}
+
+}
+
+
+bool isRawImage(const uint8_t* file, size_t size) {
+    if (size < 2)
+        return false;
+    return (file[0] == 'B' && file[1] == 'M') || (file[0] == 'P' && (file[1] == '5' || file[1] == '6'));
+}
+
+
+RawLayout readRawImage(const uint8_t* file, size_t size) {
+    if (!isRawImage(file, size))
+        throw std::runtime_error("Image is not BMP, PGM or PPM");
+    return file[0] == 'B' ? readBMP(file, size) : readPNM(file, size);
+}
@@ -1,5 +1,13 @@
 #include "utils.hpp"
-#include <iostream>
+#include "PixelFormat.hpp"
+#include "Scanline.hpp"
+#include "ScatterOrder.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <vector>
 
 // #include <cstdint>
 // #include <cstring>
@@ -89,82 +97,690 @@
 //     throw std::runtime_error("Payload not fully embedded");
 // }
 
-void encodeMessage(uint8_t* rawData, const uint32_t rawSize, std::string message, const m_data& metadata) {
-    uint32_t bpScanline = rawSize / metadata.height - 1; // scanline size without filter byte
-    uint32_t bpp = (metadata.bitDepth * metadata.channels + 7) / 8; // bytes per pixel
-    uint32_t bitOffset = ((metadata.bitDepth + 7) / 8) - 1; // LSB byte offset in channel
-    uint32_t pixelsPerScanline = bpScanline / bpp;
-
-    uint32_t messageLength = message.length();
-    message = std::string(reinterpret_cast<char*>(&messageLength), 4) + message; // prefix length
-    uint32_t offset = 0;
-    uint32_t pixelIndex = 0;
-    uint32_t scanlineStart = 0;
-
-    for (uint32_t c = 0; c < message.length(); c++) {
-        uint8_t curChar = message[c];
-        for (uint8_t i = 0; i < 8; ++i) {
-            if (pixelIndex >= pixelsPerScanline) {
-                offset++;
-                pixelIndex = 0;
-                scanlineStart = offset * (bpScanline + 1);
+namespace {
+
+bool isDefaultMode(const EmbedMode& mode) {
+    return mode.bits == DEFAULT_EMBED_MODE.bits && mode.channels == DEFAULT_EMBED_MODE.channels;
+}
+
+// Payload bits carried by one pixel after frame header
+uint32_t getModeBitsPerPixel(const EmbedMode& mode) {
+    uint32_t channels = 0;
+    for (uint8_t mask = mode.channels; mask != 0; mask >>= 1)
+        channels += mask & 1;
+    return channels * mode.bits;
+}
+
+// Sets payload bits [bitIndex, bitEnd) one per slot into LSB of byte at offset, starting at slot;
+// slots are stride bytes apart and row has slotCount of them; returns index of the next bit to encode
+uint64_t encodeSlots(uint8_t* row, uint32_t stride, uint32_t offset, uint64_t slot, uint64_t slotCount,
+                     const uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd) {
+    auto encodeBit = [&]() {
+        uint8_t curBit = (payload[bitIndex / 8] >> (7 - bitIndex % 8)) & 1;
+        uint64_t byteIndex = slot * stride + offset;
+        row[byteIndex] = (row[byteIndex] & 0xFE) | curBit;
+        slot++;
+        bitIndex++;
+    };
+
+    // Single bits until payload is byte aligned, whole bytes by 8 slots, then the rest
+    while (slot < slotCount && bitIndex < bitEnd && bitIndex % 8 != 0)
+        encodeBit();
+    uint64_t bytes = std::min<uint64_t>((slotCount - slot) / 8, (bitEnd - bitIndex) / 8);
+    if (bytes > 0 && embedBytes(row + slot * stride, payload + bitIndex / 8, bytes, stride, offset)) {
+        slot += bytes * 8;
+        bitIndex += bytes * 8;
+    }
+    while (slot < slotCount && bitIndex < bitEnd)
+        encodeBit();
+    return bitIndex;
+}
+
+uint64_t decodeSlots(const uint8_t* row, uint32_t stride, uint32_t offset, uint64_t slot, uint64_t slotCount,
+                     uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd) {
+    auto decodeBit = [&]() {
+        uint8_t curBit = row[slot * stride + offset] & 1;
+        payload[bitIndex / 8] = (payload[bitIndex / 8] << 1) | curBit;
+        slot++;
+        bitIndex++;
+    };
+
+    while (slot < slotCount && bitIndex < bitEnd && bitIndex % 8 != 0)
+        decodeBit();
+    uint64_t bytes = std::min<uint64_t>((slotCount - slot) / 8, (bitEnd - bitIndex) / 8);
+    if (bytes > 0 && extractBytes(row + slot * stride, payload + bitIndex / 8, bytes, stride, offset)) {
+        slot += bytes * 8;
+        bitIndex += bytes * 8;
+    }
+    while (slot < slotCount && bitIndex < bitEnd)
+        decodeBit();
+    return bitIndex;
+}
+
+// Sets bits payload bits into low bits of every sample of channels mask, starting at pixel;
+// last field is padded with zero bits
+template <typename Format>
+uint64_t encodeSamples(uint8_t* row, uint32_t width, uint64_t pixel, uint8_t channels, uint8_t bits,
+                       const uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd) {
+    uint8_t mask = (1 << bits) - 1;
+    for (; pixel < width && bitIndex < bitEnd; ++pixel) {
+        for (uint32_t channel = 0; channel < Format::CHANNELS && bitIndex < bitEnd; ++channel) {
+            if (!((channels >> channel) & 1))
+                continue;
+            // Field can start in one payload byte and end in the next one
+            uint64_t byte = bitIndex / 8;
+            uint32_t window = uint32_t(payload[byte]) << 8;
+            if (bitIndex % 8 + bits > 8 && (byte + 1) * 8 < bitEnd)
+                window |= payload[byte + 1];
+            uint8_t field = (window >> (16 - bitIndex % 8 - bits)) & mask;
+            uint64_t sample = pixel * Format::CHANNELS + channel;
+            uint32_t shift = Format::lowShift(sample);
+            uint8_t& target = row[Format::lowByte(sample)];
+            target = (target & ~(mask << shift)) | (field << shift);
+            bitIndex += bits;
+        }
+    }
+    return std::min(bitIndex, bitEnd);
+}
+
+template <typename Format>
+uint64_t decodeSamples(const uint8_t* row, uint32_t width, uint64_t pixel, uint8_t channels, uint8_t bits,
+                       uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd) {
+    uint8_t mask = (1 << bits) - 1;
+    for (; pixel < width && bitIndex < bitEnd; ++pixel) {
+        for (uint32_t channel = 0; channel < Format::CHANNELS && bitIndex < bitEnd; ++channel) {
+            if (!((channels >> channel) & 1))
+                continue;
+            uint64_t sample = pixel * Format::CHANNELS + channel;
+            uint32_t count = std::min<uint64_t>(bits, bitEnd - bitIndex);
+            uint8_t field = ((row[Format::lowByte(sample)] >> Format::lowShift(sample)) & mask) >> (bits - count);
+            // Bits are shifted into payload bytes, as single bits are
+            uint64_t byte = bitIndex / 8;
+            uint32_t space = 8 - bitIndex % 8;
+            if (count <= space) {
+                payload[byte] = (payload[byte] << count) | field;
+            } else {
+                payload[byte] = (payload[byte] << space) | (field >> (count - space));
+                payload[byte + 1] = field & ((1 << (count - space)) - 1);
             }
-            uint32_t byteIndex = scanlineStart + pixelIndex * bpp + bitOffset + 1;
-            uint8_t curBit = (curChar & 0x80) ? 1 : 0;
-            rawData[byteIndex] = (rawData[byteIndex] & 0xFE) | curBit;
-            curChar <<= 1;
-            pixelIndex++;
+            bitIndex += count;
         }
     }
+    return bitIndex;
+}
+
+// Sets payload bits one per pixel into low bit of its first sample, starting at pixel
+template <typename Format>
+uint64_t encodePixels(uint8_t* row, uint32_t width, uint64_t pixel, const uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd) {
+    if (!Format::PACKED)
+        return encodeSlots(row, Format::BYTES_PER_PIXEL, Format::BYTES_PER_SAMPLE - 1, pixel, width, payload, bitIndex, bitEnd);
+    if (Format::DEPTH == 1 && pixel % 8 == bitIndex % 8) {
+        // Every bit of row is a pixel, so once both are byte aligned payload bytes are row bytes
+        bitIndex = encodeSamples<Format>(row, width, pixel, 1, 1, payload, bitIndex, std::min(bitEnd, (bitIndex + 7) / 8 * 8));
+        pixel = (pixel + 7) / 8 * 8;
+        uint64_t bytes = pixel < width ? std::min<uint64_t>((width - pixel) / 8, (bitEnd - bitIndex) / 8) : 0;
+        memcpy(row + pixel / 8, payload + bitIndex / 8, bytes);
+        pixel += bytes * 8;
+        bitIndex += bytes * 8;
+    }
+    return encodeSamples<Format>(row, width, pixel, 1, 1, payload, bitIndex, bitEnd);
 }
 
-std::string decodeMessage(const uint8_t* rawData, const uint32_t rawSize, const m_data& metadata) {
-    std::string output;
-    uint8_t messageLengthStr[4] = {0};
+template <typename Format>
+uint64_t decodePixels(const uint8_t* row, uint32_t width, uint64_t pixel, uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd) {
+    if (!Format::PACKED)
+        return decodeSlots(row, Format::BYTES_PER_PIXEL, Format::BYTES_PER_SAMPLE - 1, pixel, width, payload, bitIndex, bitEnd);
+    if (Format::DEPTH == 1 && pixel % 8 == bitIndex % 8) {
+        bitIndex = decodeSamples<Format>(row, width, pixel, 1, 1, payload, bitIndex, std::min(bitEnd, (bitIndex + 7) / 8 * 8));
+        pixel = (pixel + 7) / 8 * 8;
+        uint64_t bytes = pixel < width ? std::min<uint64_t>((width - pixel) / 8, (bitEnd - bitIndex) / 8) : 0;
+        memcpy(payload + bitIndex / 8, row + pixel / 8, bytes);
+        pixel += bytes * 8;
+        bitIndex += bytes * 8;
+    }
+    return decodeSamples<Format>(row, width, pixel, 1, 1, payload, bitIndex, bitEnd);
+}
 
-    uint32_t bpScanline = rawSize / metadata.height - 1; // scanline size without filter byte
-    uint32_t bpp = (metadata.bitDepth * metadata.channels + 7) / 8; // bytes per pixel
-    uint32_t bitOffset = ((metadata.bitDepth + 7) / 8) - 1;
-    uint32_t pixelsPerScanline = bpScanline / bpp;
+template <typename Format>
+uint64_t encodeRow(uint8_t* row, uint32_t width, const uint8_t* payload, uint64_t payloadBits, uint64_t bitIndex,
+                   const EmbedLayout& layout) {
+    uint64_t rowStart = getPixelOfBit(bitIndex, layout) / width * width;
 
-    uint32_t offset = 0;
-    uint32_t pixelIndex = 0;
-    uint32_t scanlineStart = 0;
+    // Frame header, and whole payload in default mode, has one bit per pixel
+    bool singleBit = isDefaultMode(layout.mode);
+    if (singleBit || bitIndex < layout.headerBits) {
+        uint64_t end = singleBit ? payloadBits : std::min(layout.headerBits, payloadBits);
+        bitIndex = encodePixels<Format>(row, width, bitIndex - rowStart, payload, bitIndex, end);
+        if (singleBit || bitIndex < layout.headerBits)
+            return bitIndex;
+    }
 
-    // Read message length (4 bytes)
-    for (uint32_t num = 0; num < 4; ++num) {
-        uint8_t byteVal = 0;
-        for (uint32_t i = 0; i < 8; ++i) {
-            if (pixelIndex >= pixelsPerScanline) {
-                offset++;
-                pixelIndex = 0;
-                scanlineStart = offset * (bpScanline + 1);
-            }
-            uint32_t byteIndex = scanlineStart + pixelIndex * bpp + bitOffset + 1;
-            uint8_t curBit = rawData[byteIndex] & 1;
-            byteVal = (byteVal << 1) | curBit;
-            pixelIndex++;
+    uint64_t pixel = getPixelOfBit(bitIndex, layout) - rowStart;
+    if (pixel >= width)
+        return bitIndex;
+    // Every byte sample carries one bit, so samples can be handled like pixels of one sample
+    if (!Format::PACKED && layout.mode.bits == 1 && layout.mode.channels == (1 << Format::CHANNELS) - 1)
+        return encodeSlots(row, Format::BYTES_PER_SAMPLE, Format::BYTES_PER_SAMPLE - 1, pixel * Format::CHANNELS,
+                           uint64_t(width) * Format::CHANNELS, payload, bitIndex, payloadBits);
+    return encodeSamples<Format>(row, width, pixel, layout.mode.channels, layout.mode.bits, payload, bitIndex, payloadBits);
+}
+
+template <typename Format>
+uint64_t decodeRow(const uint8_t* row, uint32_t width, uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd,
+                   const EmbedLayout& layout) {
+    uint64_t rowStart = getPixelOfBit(bitIndex, layout) / width * width;
+
+    bool singleBit = isDefaultMode(layout.mode);
+    if (singleBit || bitIndex < layout.headerBits) {
+        uint64_t end = singleBit ? bitEnd : std::min(layout.headerBits, bitEnd);
+        bitIndex = decodePixels<Format>(row, width, bitIndex - rowStart, payload, bitIndex, end);
+        if (singleBit || bitIndex < layout.headerBits)
+            return bitIndex;
+    }
+
+    uint64_t pixel = getPixelOfBit(bitIndex, layout) - rowStart;
+    if (pixel >= width)
+        return bitIndex;
+    if (!Format::PACKED && layout.mode.bits == 1 && layout.mode.channels == (1 << Format::CHANNELS) - 1)
+        return decodeSlots(row, Format::BYTES_PER_SAMPLE, Format::BYTES_PER_SAMPLE - 1, pixel * Format::CHANNELS,
+                           uint64_t(width) * Format::CHANNELS, payload, bitIndex, bitEnd);
+    return decodeSamples<Format>(row, width, pixel, layout.mode.channels, layout.mode.bits, payload, bitIndex, bitEnd);
+}
+
+// Sets payload bit into low bit of first sample of pixel, for pixels visited one at a time
+template <typename Format>
+void encodeBit(uint8_t* row, uint64_t pixel, const uint8_t* payload, uint64_t bitIndex) {
+    uint64_t sample = pixel * Format::CHANNELS;
+    uint32_t shift = Format::lowShift(sample);
+    uint8_t& target = row[Format::lowByte(sample)];
+    target = (target & ~(1 << shift)) | (((payload[bitIndex / 8] >> (7 - bitIndex % 8)) & 1) << shift);
+}
+
+template <typename Format>
+void decodeBit(const uint8_t* row, uint64_t pixel, uint8_t* payload, uint64_t bitIndex) {
+    uint64_t sample = pixel * Format::CHANNELS;
+    uint8_t& byte = payload[bitIndex / 8];
+    byte = (byte << 1) | ((row[Format::lowByte(sample)] >> Format::lowShift(sample)) & 1);
+}
+
+// Encodes payload bits from bitIndex into pixels of rows (without filter bytes, stride bytes apart) in keyed order;
+// returns index of the next bit to encode, which is short of payloadBits if image ran out of pixels
+template <typename Format>
+uint64_t encodeKeyed(uint8_t* data, int64_t stride, const ScatterOrder& order, const uint8_t* payload,
+                     uint64_t payloadBits, uint64_t bitIndex, const EmbedLayout& layout) {
+    bool singleBit = isDefaultMode(layout.mode);
+    uint64_t headerEnd = singleBit ? payloadBits : std::min(layout.headerBits, payloadBits);
+    order.forEachPixel(getPixelOfBit(bitIndex, layout), [&](uint32_t row, uint32_t column) {
+        uint8_t* line = data + row * stride;
+        if (bitIndex < headerEnd)
+            encodeBit<Format>(line, column, payload, bitIndex++);
+        else
+            bitIndex = encodeSamples<Format>(line, column + 1, column, layout.mode.channels, layout.mode.bits,
+                                             payload, bitIndex, payloadBits);
+        return bitIndex < payloadBits;
+    });
+    return bitIndex;
+}
+
+template <typename Format>
+uint64_t decodeKeyed(const uint8_t* data, int64_t stride, const ScatterOrder& order, uint8_t* payload,
+                     uint64_t bitIndex, uint64_t bitEnd, const EmbedLayout& layout) {
+    bool singleBit = isDefaultMode(layout.mode);
+    uint64_t headerEnd = singleBit ? bitEnd : std::min(layout.headerBits, bitEnd);
+    order.forEachPixel(getPixelOfBit(bitIndex, layout), [&](uint32_t row, uint32_t column) {
+        const uint8_t* line = data + row * stride;
+        if (bitIndex < headerEnd)
+            decodeBit<Format>(line, column, payload, bitIndex++);
+        else
+            bitIndex = decodeSamples<Format>(line, column + 1, column, layout.mode.channels, layout.mode.bits,
+                                             payload, bitIndex, bitEnd);
+        return bitIndex < bitEnd;
+    });
+    return bitIndex;
+}
+
+// Keyed order jumps between all rows, so rows of interlaced image are gathered from passes into one buffer
+std::vector<uint8_t> gatherInterlaced(const uint8_t* data, const m_data& metadata) {
+    uint64_t scanline = getScanlineSize(metadata);
+    std::vector<uint8_t> rows(scanline * metadata.height);
+    for (uint32_t y = 0; y < metadata.height; ++y)
+        gatherInterlacedRow(data, metadata, y, rows.data() + y * scanline);
+    return rows;
+}
+
+}
+
+
+bool checkEmbedMode(const m_data& metadata, const EmbedMode& mode) {
+    // Fields are never wider than samples, so 1 bit samples carry single bits only
+    return mode.bits >= 1 && mode.bits <= 4 && mode.bits <= metadata.bitDepth &&
+           mode.channels != 0 && mode.channels < (1 << metadata.channels);
+}
+
+
+uint8_t parseChannels(const char* names, const m_data& metadata, const char* letters) {
+    if (letters == nullptr) {
+        letters = "";
+        switch (metadata.color) {
+            case 0: letters = "g"; break;
+            case 2: letters = "rgb"; break;
+            case 3: letters = "i"; break;
+            case 4: letters = "ga"; break;
+            case 6: letters = "rgba"; break;
         }
-        messageLengthStr[num] = byteVal;
-    }
-    uint32_t messageLength = 0;
-    memcpy(&messageLength, messageLengthStr, sizeof(messageLength));
-    std::cout << "Message length: " << messageLength << std::endl;
-
-    for (uint32_t i = 0; i < messageLength; ++i) {
-        uint8_t c = 0;
-        for (uint8_t j = 0; j < 8; ++j) {
-            if (pixelIndex >= pixelsPerScanline) {
-                offset++;
-                pixelIndex = 0;
-                scanlineStart = offset * (bpScanline + 1);
-            }
-            uint32_t byteIndex = scanlineStart + pixelIndex * bpp + bitOffset + 1;
-            uint8_t curBit = rawData[byteIndex] & 1;
-            c = (c << 1) | curBit;
-            pixelIndex++;
+    }
+    uint8_t mask = 0;
+    for (const char* name = names; *name != '\0'; ++name) {
+        const char* letter = strchr(letters, *name);
+        if (letter == nullptr)
+            throw std::runtime_error(std::string("Image has no channel ") + *name);
+        mask |= 1 << (letter - letters);
+    }
+    return mask;
+}
+
+
+uint64_t getMessageCapacity(const m_data& metadata, const EmbedMode& mode, uint8_t flags) {
+    uint64_t pixels = uint64_t(metadata.width) * metadata.height;
+    FrameHeader header = createFrameHeader(0, mode);
+    header.flags |= flags;
+    uint64_t headerBits = getEmbedLayout(header).headerBits;
+    if (pixels < headerBits)
+        return 0;
+    // Message bytes may end in the middle of a pixel, but never in the middle of a field
+    return (pixels - headerBits) * getModeBitsPerPixel(mode) / 8;
+}
+
+
+uint64_t getPixelOfBit(uint64_t bitIndex, const EmbedLayout& layout) {
+    if (bitIndex < layout.headerBits || isDefaultMode(layout.mode))
+        return bitIndex;
+    return layout.headerBits + (bitIndex - layout.headerBits) / getModeBitsPerPixel(layout.mode);
+}
+
+
+uint64_t encodeScanline(uint8_t* scanline, const m_data& metadata, const std::string& payload, uint64_t bitIndex,
+                        const EmbedLayout& layout) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(payload.data());
+    uint64_t payloadBits = uint64_t(payload.length()) * 8;
+    // Sample layout is resolved once per row, loops over samples are specialized for it
+    return visitPixelFormat(metadata, [&](auto format) {
+        return encodeRow<decltype(format)>(scanline, metadata.width, bytes, payloadBits, bitIndex, layout);
+    });
+}
+
+
+uint64_t decodeScanline(const uint8_t* scanline, const m_data& metadata, uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd,
+                        const EmbedLayout& layout) {
+    return visitPixelFormat(metadata, [&](auto format) {
+        return decodeRow<decltype(format)>(scanline, metadata.width, payload, bitIndex, bitEnd, layout);
+    });
+}
+
+
+void encodeMessage(uint8_t* rawData, const uint64_t rawSize, const std::string& message, const m_data& metadata,
+                   const EmbedMode& mode, const std::string& password, bool packing) {
+    if (message.length() > UINT32_MAX)
+        throw std::runtime_error("Message does not fit into image");
+    FrameHeader header{};
+    std::string payload = framePayload(message, mode, packing, header);
+    encodeFrame(rawData, rawSize, payload, header, metadata, password);
+}
+
+
+namespace {
+
+void checkFrame(const std::string& payload, const FrameHeader& header, const m_data& metadata) {
+    if (!checkEmbedMode(metadata, header.mode))
+        throw std::runtime_error("Embed mode does not fit image");
+    if (header.length > getMessageCapacity(metadata, header.mode, header.flags))
+        throw std::runtime_error("Message does not fit into image");
+    if (payload.length() != uint64_t(getFrameHeaderSize(header.flags)) + header.length)
+        throw std::runtime_error("Payload does not match its frame header");
+}
+
+}
+
+
+void encodeFrame(uint8_t* rawData, const uint64_t rawSize, const std::string& payload, const FrameHeader& header,
+                 const m_data& metadata, const std::string& password) {
+    uint64_t bpScanline = rawSize / metadata.height; // scanline size including filter byte
+    if (metadata.interlance == 0) {
+        encodeRows(rawData + 1, int64_t(bpScanline), payload, header, metadata, password);
+        return;
+    }
+    checkFrame(payload, header, metadata);
+
+    uint64_t scanline = getScanlineSize(metadata);
+    if (!password.empty()) {
+        std::vector<uint8_t> rows = gatherInterlaced(rawData, metadata);
+        encodeRows(rows.data(), int64_t(scanline), payload, header, metadata, password);
+        for (uint32_t y = 0; y < metadata.height; ++y)
+            scatterInterlacedRow(rows.data() + y * scanline, rawData, metadata, y);
+        return;
+    }
+    // Pixels are taken in the same order as from non interlaced image, row by row,
+    // so only rows carrying payload are gathered from passes and scattered back
+    EmbedLayout layout = getEmbedLayout(header);
+    uint64_t payloadBits = uint64_t(payload.length()) * 8;
+    uint64_t bitIndex = 0;
+    std::vector<uint8_t> row(scanline);
+    while (bitIndex < payloadBits) {
+        uint32_t line = uint32_t(getPixelOfBit(bitIndex, layout) / metadata.width);
+        gatherInterlacedRow(rawData, metadata, line, row.data());
+        bitIndex = encodeScanline(row.data(), metadata, payload, bitIndex, layout);
+        scatterInterlacedRow(row.data(), rawData, metadata, line);
+    }
+}
+
+
+void encodeRows(uint8_t* data, int64_t stride, const std::string& payload, const FrameHeader& header,
+                const m_data& metadata, const std::string& password) {
+    checkFrame(payload, header, metadata);
+    EmbedLayout layout = getEmbedLayout(header);
+    uint64_t payloadBits = uint64_t(payload.length()) * 8;
+    if (!password.empty()) {
+        ScatterOrder order(metadata, password);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(payload.data());
+        visitPixelFormat(metadata, [&](auto format) {
+            return encodeKeyed<decltype(format)>(data, stride, order, bytes, payloadBits, 0, layout);
+        });
+        return;
+    }
+    uint64_t bitIndex = 0;
+    while (bitIndex < payloadBits) {
+        uint64_t line = getPixelOfBit(bitIndex, layout) / metadata.width;
+        bitIndex = encodeScanline(data + int64_t(line) * stride, metadata, payload, bitIndex, layout);
+    }
+}
+
+namespace {
+
+// Rows of whole reconstructed image in memory, without filter bytes and stride bytes apart
+struct BufferRows {
+    const uint8_t* data;
+    int64_t stride;
+    uint32_t height;
+    const uint8_t* get(uint64_t line) {
+        return line < this->height ? this->data + int64_t(line) * this->stride : nullptr;
+    }
+};
+
+// Rows of whole reconstructed interlaced image, gathered from passes when requested
+struct InterlacedRows {
+    const uint8_t* data;
+    const m_data& metadata;
+    std::vector<uint8_t> row;
+    uint64_t line; // Row held in row buffer
+    InterlacedRows(const uint8_t* data, const m_data& metadata)
+        : data(data), metadata(metadata), row(getScanlineSize(metadata)), line(UINT64_MAX) {}
+    const uint8_t* get(uint64_t line) {
+        if (line >= this->metadata.height)
+            return nullptr;
+        if (line != this->line) {
+            gatherInterlacedRow(this->data, this->metadata, uint32_t(line), this->row.data());
+            this->line = line;
         }
-        output += c;
+        return this->row.data();
+    }
+};
+
+// Raw image data from which extraction decodes rows on a pipeline of threads
+const uint64_t PIPELINE_MIN_SIZE = 1 << 20;
+
+// Rows inflated and reconstructed on demand by Reader; lines have to be requested in increasing order
+template <typename Reader>
+struct LazyRows {
+    Reader reader;
+    uint64_t nextLine;
+    const uint8_t* row;
+    LazyRows(Image& image, const m_data& metadata, Stats* stats = nullptr)
+        : reader(image, metadata, stats), nextLine(0), row(nullptr) {}
+    const uint8_t* get(uint64_t line) {
+        while (this->nextLine <= line) {
+            this->row = this->reader.next();
+            this->nextLine++;
+            if (this->row == nullptr)
+                return nullptr;
+        }
+        return this->row + 1;
+    }
+};
+
+template <typename Rows>
+uint64_t decodeBits(Rows& rows, const m_data& metadata, uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd,
+                    const EmbedLayout& layout) {
+    while (bitIndex < bitEnd) {
+        const uint8_t* row = rows.get(getPixelOfBit(bitIndex, layout) / metadata.width);
+        if (row == nullptr)
+            throw std::runtime_error("Message is longer than image");
+        bitIndex = decodeScanline(row, metadata, payload, bitIndex, bitEnd, layout);
+    }
+    return bitIndex;
+}
+
+// Pixels of whole reconstructed image (rows without filter bytes) visited in keyed order
+struct KeyedPixels {
+    const uint8_t* data;
+    int64_t stride;
+    ScatterOrder order;
+};
+
+uint64_t decodeBits(KeyedPixels& pixels, const m_data& metadata, uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd,
+                    const EmbedLayout& layout) {
+    bitIndex = visitPixelFormat(metadata, [&](auto format) {
+        return decodeKeyed<decltype(format)>(pixels.data, pixels.stride, pixels.order, payload, bitIndex, bitEnd, layout);
+    });
+    if (bitIndex < bitEnd)
+        throw std::runtime_error("Message is longer than image");
+    return bitIndex;
+}
+
+// Decodes frame header with its fields into headerBytes; returns false as soon as bits do not match it
+template <typename Rows>
+bool decodeHeader(Rows& rows, const m_data& metadata, FrameHeader& header, std::vector<uint8_t>& headerBytes) {
+    uint64_t pixels = uint64_t(metadata.width) * metadata.height;
+    if (pixels < FRAME_HEADER_SIZE * 8)
+        return false; // Too small to carry any message
+    // Header is always one bit per pixel, so it is read before its mode is known
+    headerBytes.assign(FRAME_HEADER_SIZE, 0);
+    // Magic comes first, so images without message are rejected after 24 pixels
+    uint64_t bitIndex = decodeBits(rows, metadata, headerBytes.data(), 0, 24, DEFAULT_EMBED_LAYOUT);
+    if (!checkFrameMagic(headerBytes.data()))
+        return false;
+    bitIndex = decodeBits(rows, metadata, headerBytes.data(), bitIndex, FRAME_HEADER_SIZE * 8, DEFAULT_EMBED_LAYOUT);
+    if (!readFrameHeader(headerBytes.data(), header))
+        return false;
+
+    uint32_t headerSize = getFrameHeaderSize(header.flags);
+    if (pixels < uint64_t(headerSize) * 8)
+        return false;
+    headerBytes.resize(headerSize, 0);
+    decodeBits(rows, metadata, headerBytes.data(), bitIndex, uint64_t(headerSize) * 8, DEFAULT_EMBED_LAYOUT);
+    return readFrameExtensions(headerBytes.data(), header) && checkEmbedMode(metadata, header.mode);
+}
+
+// Decodes message of frame whose header was read into headerBytes
+template <typename Rows>
+std::string decodeBody(Rows& rows, const m_data& metadata, const FrameHeader& header, const std::vector<uint8_t>& headerBytes) {
+    if (header.length > getMessageCapacity(metadata, header.mode, header.flags))
+        throw std::runtime_error("Message length is larger than image capacity");
+
+    EmbedLayout layout = getEmbedLayout(header);
+    std::string output(headerBytes.size() + header.length, '\0');
+    uint8_t* payload = reinterpret_cast<uint8_t*>(&output[0]);
+    decodeBits(rows, metadata, payload, layout.headerBits, layout.headerBits + uint64_t(header.length) * 8, layout);
+    output.erase(0, headerBytes.size());
+    return unpackMessage(std::move(output), header);
+}
+
+template <typename Rows>
+std::string decodeFrame(Rows& rows, const m_data& metadata, FrameHeader& header) {
+    std::vector<uint8_t> headerBytes;
+    if (!decodeHeader(rows, metadata, header, headerBytes))
+        throw std::runtime_error("Image carries no message");
+    return decodeBody(rows, metadata, header, headerBytes);
+}
+
+// Decodes frame into message; returns false if rows do not start with frame header
+template <typename Rows>
+bool decodeFoundFrame(Rows& rows, const m_data& metadata, FrameHeader& header, std::string& message) {
+    std::vector<uint8_t> headerBytes;
+    if (!decodeHeader(rows, metadata, header, headerBytes))
+        return false;
+    message = decodeBody(rows, metadata, header, headerBytes);
+    return true;
+}
+
+// Every pass holds pixels of the first rows, so interlaced image is inflated and reconstructed whole;
+// so is keyed image, whose pixels are spread over all rows
+std::vector<uint8_t> readWhole(Image& image, const m_data& metadata) {
+    std::vector<uint8_t> data(getImageSize(metadata));
+    z_stream strm{};
+    if (inflateInit(&strm) != Z_OK)
+        throw std::runtime_error("Could not initialize inflate");
+    bool complete = decompress(&strm, image.getIDATChunks(), data.data(), data.size());
+    inflateEnd(&strm);
+    if (!complete)
+        throw ImageDataError("Image data is truncated or corrupted");
+    filter(data.data(), data.size(), metadata, true);
+    return data;
+}
+
+// Calls use with keyed pixels of whole reconstructed image data and returns its result
+template <typename Use>
+auto useKeyedPixels(const uint8_t* rawData, uint64_t rawSize, const m_data& metadata, const std::string& password, Use use) {
+    KeyedPixels pixels = {rawData + 1, int64_t(rawSize / metadata.height), ScatterOrder(metadata, password)};
+    std::vector<uint8_t> rows;
+    if (metadata.interlance != 0) {
+        rows = gatherInterlaced(rawData, metadata);
+        pixels.data = rows.data();
+        pixels.stride = int64_t(getScanlineSize(metadata));
+    }
+    return use(pixels);
+}
+
+template <typename Rows>
+bool detectFrame(Rows& rows, const m_data& metadata, FrameHeader& header) {
+    std::vector<uint8_t> headerBytes;
+    return decodeHeader(rows, metadata, header, headerBytes);
+}
+
+}
+
+
+std::string decodeMessage(const uint8_t* rawData, const uint64_t rawSize, const m_data& metadata,
+                          const std::string& password) {
+    FrameHeader header{};
+    if (!password.empty())
+        return useKeyedPixels(rawData, rawSize, metadata, password, [&](KeyedPixels& pixels) {
+            return decodeFrame(pixels, metadata, header);
+        });
+    if (metadata.interlance != 0) {
+        InterlacedRows rows(rawData, metadata);
+        return decodeFrame(rows, metadata, header);
+    }
+    BufferRows rows = {rawData + 1, int64_t(rawSize / metadata.height), metadata.height};
+    return decodeFrame(rows, metadata, header);
+}
+
+
+std::string decodeRows(const uint8_t* data, int64_t stride, const m_data& metadata, FrameHeader& header,
+                       const std::string& password) {
+    if (!password.empty()) {
+        KeyedPixels pixels = {data, stride, ScatterOrder(metadata, password)};
+        return decodeFrame(pixels, metadata, header);
+    }
+    BufferRows rows = {data, stride, metadata.height};
+    return decodeFrame(rows, metadata, header);
+}
+
+
+bool detectRows(const uint8_t* data, int64_t stride, const m_data& metadata, FrameHeader& header,
+                const std::string& password) {
+    try {
+        if (!password.empty()) {
+            KeyedPixels pixels = {data, stride, ScatterOrder(metadata, password)};
+            return detectFrame(pixels, metadata, header);
+        }
+        BufferRows rows = {data, stride, metadata.height};
+        return detectFrame(rows, metadata, header);
+    } catch (const std::runtime_error&) {
+        return false; // Image is too small to hold header
+    }
+}
+
+
+std::string extractMessage(Image& image, const m_data& metadata, const std::string& password, Stats* stats) {
+    FrameHeader header{};
+    return extractFrame(image, metadata, header, password, stats);
+}
+
+
+std::string extractFrame(Image& image, const m_data& metadata, FrameHeader& header, const std::string& password,
+                         Stats* stats) {
+    if (!password.empty()) {
+        std::vector<uint8_t> data = readWhole(image, metadata);
+        return useKeyedPixels(data.data(), data.size(), metadata, password, [&](KeyedPixels& pixels) {
+            return decodeFrame(pixels, metadata, header);
+        });
+    }
+    if (metadata.interlance != 0) {
+        std::vector<uint8_t> data = readWhole(image, metadata);
+        InterlacedRows rows(data.data(), metadata);
+        return decodeFrame(rows, metadata, header);
+    }
+    // Threads pay off once rows take longer than handing them over; a single core gains nothing
+    if (getImageSize(metadata) >= PIPELINE_MIN_SIZE && std::thread::hardware_concurrency() > 1) {
+        LazyRows<PipelinedReader> rows(image, metadata, stats);
+        return decodeFrame(rows, metadata, header);
+    }
+    LazyRows<ScanlineReader> rows(image, metadata, stats);
+    return decodeFrame(rows, metadata, header);
+}
+
+
+bool tryExtractFrame(Image& image, const m_data& metadata, FrameHeader& header, std::string& message,
+                     const std::string& password, Stats* stats) {
+    // Header and message are read from the same reconstructed image
+    if (!password.empty() || metadata.interlance != 0) {
+        std::vector<uint8_t> data = readWhole(image, metadata);
+        if (!password.empty())
+            return useKeyedPixels(data.data(), data.size(), metadata, password, [&](KeyedPixels& pixels) {
+                return decodeFoundFrame(pixels, metadata, header, message);
+            });
+        InterlacedRows rows(data.data(), metadata);
+        return decodeFoundFrame(rows, metadata, header, message);
+    }
+    if (getImageSize(metadata) >= PIPELINE_MIN_SIZE && std::thread::hardware_concurrency() > 1) {
+        LazyRows<PipelinedReader> rows(image, metadata, stats);
+        return decodeFoundFrame(rows, metadata, header, message);
+    }
+    LazyRows<ScanlineReader> rows(image, metadata, stats);
+    return decodeFoundFrame(rows, metadata, header, message);
+}
+
+
+bool detectPayload(Image& image, const m_data& metadata, const std::string& password) {
+    FrameHeader header{};
+    return detectPayload(image, metadata, header, password);
+}
+
+
+bool detectPayload(Image& image, const m_data& metadata, FrameHeader& header, const std::string& password) {
+    // Images too small to hold header are told by decodeHeader, errors left are those of image data
+    if (!password.empty()) {
+        std::vector<uint8_t> data = readWhole(image, metadata);
+        return useKeyedPixels(data.data(), data.size(), metadata, password, [&](KeyedPixels& pixels) {
+            return detectFrame(pixels, metadata, header);
+        });
+    }
+    if (metadata.interlance != 0) {
+        std::vector<uint8_t> data = readWhole(image, metadata);
+        InterlacedRows rows(data.data(), metadata);
+        return detectFrame(rows, metadata, header);
     }
-    return output;
+    // Only the first rows are needed, so they are not worth threads
+    LazyRows<ScanlineReader> rows(image, metadata);
+    return detectFrame(rows, metadata, header);
 }
@@ -5,6 +5,23 @@
 #include <stdint.h> // uint8_t, uint32_t
 #include <utility> // std::pair
 #include <string>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+class Image;
+class Arena;
+class ChunkCRC;
+class FilterSelector;
+class Stats;
+struct z_stream_s;
+
+// Thrown when compressed image data cannot be inflated or ends before image does,
+// so callers tell broken image apart from message that cannot be read
+class ImageDataError : public std::runtime_error {
+    public:
+        using std::runtime_error::runtime_error;
+};
 
 // Meta data of image
 struct m_data {
@@ -18,15 +35,142 @@ struct m_data {
     uint8_t interlance;
 };
 
+// Passes of Adam7 interlaced image
+const uint32_t ADAM7_PASS_COUNT = 7;
+
+// Part of image data whose rows are filtered against each other:
+// whole image, or one reduced image (pass) of Adam7 interlaced image
+struct ImagePass {
+    uint32_t width;   // Pixels of one row
+    uint32_t height;  // Rows, 0 for passes of small images that get no pixels
+    uint64_t offset;  // Position of first row in image data
+    uint64_t rowSize; // Bytes of one row including filter byte
+};
+
+// Version of embedded frame format
+const uint8_t FRAME_VERSION = 1;
+// Bytes of frame header in front of message
+const uint32_t FRAME_HEADER_SIZE = 9;
+
+// Flags of frame header; every set flag adds its fields after the fixed part, in flag order
+const uint8_t FRAME_FLAG_MODE = 0x01;  // 1 byte: embed mode of message (bits in high, channels in low nibble)
+const uint8_t FRAME_FLAG_SHARD = 0x02; // 9 bytes: message is one shard of a payload split over several images
+const uint8_t FRAME_FLAG_PACKED = 0x04; // 9 bytes: codec of stored message, length and CRC-32 of original message
+const uint8_t FRAME_KNOWN_FLAGS = FRAME_FLAG_MODE | FRAME_FLAG_SHARD | FRAME_FLAG_PACKED;
+
+// Codecs of packed messages
+const uint8_t FRAME_CODEC_STORED = 0;  // Message as it is, when deflate would not make it shorter
+const uint8_t FRAME_CODEC_DEFLATE = 1; // zlib stream
+
+// Private ancillary chunk carrying frame instead of pixels, safe to copy by editors that do not know it;
+// frame larger than a chunk goes on in the following ones
+const char PAYLOAD_CHUNK_TYPE[5] = "stEg";
+
+// Which bits of pixels carry message after frame header
+struct EmbedMode {
+    uint8_t bits;     // Low bits used in every chosen sample, 1 to 4
+    uint8_t channels; // Mask of chosen channels, bit 0 is first channel (gray or red)
+};
+
+// One bit per pixel in first channel; frame header is always stored like this
+const EmbedMode DEFAULT_EMBED_MODE = {1, 0x01};
+
+// Place of message in payload split over several images
+struct FrameShard {
+    uint32_t id;    // Shared by all shards of one payload
+    uint32_t index; // Position of shard in payload, from 0
+    bool last;      // Payload ends with this shard
+};
+
+// How message of frame is stored, and original message it restores to
+struct FramePacking {
+    uint8_t codec;
+    uint32_t length; // Bytes of original message
+    uint32_t crc;    // CRC-32 of original message
+};
+
+// Header of embedded frame, found in first bits of carrier image
+struct FrameHeader {
+    uint8_t version;
+    uint8_t flags;
+    uint32_t length;      // Message bytes following header
+    EmbedMode mode;       // DEFAULT_EMBED_MODE unless FRAME_FLAG_MODE is set
+    FrameShard shard;     // Set only with FRAME_FLAG_SHARD
+    FramePacking packing; // Set only with FRAME_FLAG_PACKED
+};
+
+// Positions of payload bits: first headerBits one per pixel by DEFAULT_EMBED_MODE, rest by mode
+struct EmbedLayout {
+    EmbedMode mode;
+    uint64_t headerBits;
+};
+
+const EmbedLayout DEFAULT_EMBED_LAYOUT = {DEFAULT_EMBED_MODE, FRAME_HEADER_SIZE * 8};
+
+// How filter types are picked when image is filtered again
+enum class FilterStrategy {
+    Keep,       // Filter type each row had in source image
+    MinSum,     // Type with minimal sum of absolute filtered values
+    BruteForce  // Type whose row compresses to the fewest bytes
+};
+
 /*Calculates crc of chunk*/
 uint32_t calculate_crc(const char* type, const uint8_t* data, size_t length);
 
-/*Performs deflate compression; 
+/*Performs deflate compression with zlib level and strategy (9 and Z_DEFAULT_STRATEGY by default);
 returns pointer to the data and deflated size*/
-std::pair<uint8_t*, uint32_t> compress(uint8_t* data, uint32_t size);
+std::pair<uint8_t*, uint64_t> compress(const uint8_t* data, uint64_t size, int level = 9, int strategy = 0);
+
+/*Performs deflate compression with stream set up by deflateInit2, which is reset first,
+so one stream can be reused for many images; returns pointer to the data and deflated size.
+Output is allocated from arena if given, otherwise by new[], and fed into chunkCRC of IDAT chunks while it is
+produced if they are given; the same holds for functions below*/
+std::pair<uint8_t*, uint64_t> compress(z_stream_s* strm, const uint8_t* data, uint64_t size, Arena* arena = nullptr,
+                                       ChunkCRC* chunkCRC = nullptr);
+
+/*Wraps data into zlib stream of stored (uncompressed) blocks;
+returns pointer to the data and stream size*/
+std::pair<uint8_t*, uint64_t> compressStored(const uint8_t* data, uint64_t size, Arena* arena = nullptr,
+                                             ChunkCRC* chunkCRC = nullptr);
+
+/*Performs deflate compression of independent segments on threads (0 means one per core)
+and joins them into one zlib stream; returns pointer to the data and deflated size*/
+std::pair<uint8_t*, uint64_t> compressParallel(const uint8_t* data, uint64_t size, int level, int strategy,
+                                               uint32_t segmentSize = 128 * 1024, unsigned threads = 0,
+                                               Arena* arena = nullptr, ChunkCRC* chunkCRC = nullptr);
+
+/*Performs inflate decompression of data split over several chunks*/
+uint8_t* decompress(const std::vector<std::pair<const uint8_t*, uint32_t>>& chunks, uint64_t expectedSize,
+                    Arena* arena = nullptr);
 
-/*Performs inflate decompression*/
-uint8_t* decompress(uint8_t* data, uint32_t size, uint32_t expectedSize);
+/*Inflates data split over several chunks into size bytes of output with stream set up by inflateInit,
+which is reset first; returns false if data is shorter or corrupted*/
+bool decompress(z_stream_s* strm, const std::vector<std::pair<const uint8_t*, uint32_t>>& chunks,
+                uint8_t* output, uint64_t size);
+
+/*Parses PNG file in memory into image, which is cleared first and keeps views into file;
+returns metadata from IHDR chunk, throws std::runtime_error if file is malformed.
+CRC of every chunk is checked unless checkingCRC is false, so corrupt files fail before anything is inflated;
+large IDAT runs are checked on threads (0 means one per core)*/
+m_data readPNG(const uint8_t* file, size_t size, Image& image, bool checkingCRC = true, unsigned threads = 0);
+
+// Pixels of uncompressed image file, which message is embedded into in place
+struct RawLayout {
+    m_data metadata;      // Of PNG holding the same samples, never interlaced
+    uint64_t offset;      // Of top row in file
+    int64_t stride;       // Bytes from row to the one below it, negative for rows stored bottom up
+    const char* channels; // Letters of channels in order they are stored, for parseChannels
+};
+
+/*Returns true if file starts like BMP, binary PGM or binary PPM*/
+bool isRawImage(const uint8_t* file, size_t size);
+
+/*Returns layout of pixels of BMP (uncompressed 24 or 32 bit), binary PGM or binary PPM (maxval 255 or 65535) file;
+throws std::runtime_error if file is malformed, truncated or of other kind*/
+RawLayout readRawImage(const uint8_t* file, size_t size);
+
+/*Writes one PNG chunk (length, type, data and crc) into output*/
+void writeChunk(std::ostream& output, const char* type, const uint8_t* data, uint32_t length);
 
 /*Swaps edian of given value*/
 uint32_t swapEdian(uint32_t value);
@@ -63,16 +207,175 @@ IHDR chunk structure
 */
 m_data getMetadata(const uint8_t* data, uint8_t size);
 
-/*Returns the number of bytes of raw data of image*/
-uint32_t getImageSize(const m_data& data);
+/*Returns the number of bytes of raw data of image, with filter bytes of all passes*/
+uint64_t getImageSize(const m_data& data);
+
+/*Returns the number of bytes of one scanline without the filter byte*/
+uint64_t getScanlineSize(const m_data& data);
+
+/*Returns the number of bytes per complete pixel (at least 1), as used by filters*/
+int getBytesPerPixel(const m_data& data);
+
+/*Fills passes in the order they are stored in image data: seven Adam7 passes of interlaced image,
+otherwise one pass holding whole image; returns number of passes*/
+uint32_t getImagePasses(const m_data& data, ImagePass passes[ADAM7_PASS_COUNT]);
+
+/*Copies pixels of row y of interlaced image data, which are spread over passes,
+into row without filter byte*/
+void gatherInterlacedRow(const uint8_t* data, const m_data& metadata, uint32_t y, uint8_t* row);
+
+/*Copies pixels of row without filter byte back into passes of interlaced image data*/
+void scatterInterlacedRow(const uint8_t* row, uint8_t* data, const m_data& metadata, uint32_t y);
+
+/*Applies filter or reconstruction algorithm to one scanline in place;
+line starts with the filter byte, previous is the unfiltered row above (with filter byte) or nullptr*/
+void filterScanline(uint8_t* line, const uint8_t* previous, const uint32_t length, const int bpp, bool decode);
+
+/*Byte at a time implementation of filterScanline, used when no vector kernel applies*/
+void filterScanlineScalar(uint8_t* line, const uint8_t* previous, const uint32_t length, const int bpp, bool decode);
+
+/*Vector implementation of filterScanline picked by CPU features;
+returns false if there is no kernel for this filter type and bpp*/
+bool filterScanlineSIMD(uint8_t* line, const uint8_t* previous, const uint32_t length, const int bpp, bool decode);
+
+/*Returns name of instruction set used by filter kernels*/
+const char* getFilterISA();
+
+/*Sets filter byte of every unfiltered row by strategy, choosing rows (or passes of interlaced image)
+in parallel on threads (0 means one per core); throws std::runtime_error if size is less than getImageSize*/
+void chooseFilters(uint8_t* data, const uint64_t size, const m_data& metadata, FilterStrategy strategy, unsigned threads = 0);
+
+/*Sets filter byte of every unfiltered row on calling thread with selector made for rows of this image,
+so selector and its buffers can be kept for the next image of the same width*/
+void chooseFilters(uint8_t* data, const uint64_t size, const m_data& metadata, FilterSelector& selector);
+
+/*Applies filter or reconstruction algorithm based on decode;
+passes of interlaced image are independent, so they are processed in parallel on threads (0 means one per core);
+throws std::runtime_error if size is less than getImageSize*/
+void filter(uint8_t* data, const uint64_t size, const m_data& metadata, bool decode, unsigned threads = 0);
+
+/*Returns header of frame holding message of length bytes embedded by mode*/
+FrameHeader createFrameHeader(uint32_t length, const EmbedMode& mode = DEFAULT_EMBED_MODE);
+
+/*Returns message prefixed with frame header, as it is stored in the image*/
+std::string framePayload(const std::string& message, const EmbedMode& mode = DEFAULT_EMBED_MODE);
+
+/*Returns frame payload like framePayload, filling its header; when packing, message is deflated
+if that makes it shorter and header records codec, length and CRC-32 of original message*/
+std::string framePayload(const std::string& message, const EmbedMode& mode, bool packing, FrameHeader& header);
+
+/*Returns original message from message stored in frame: inflates it and checks its length and CRC-32
+if FRAME_FLAG_PACKED is set; throws std::runtime_error if message is corrupted*/
+std::string unpackMessage(std::string message, const FrameHeader& header);
+
+/*Returns number of header bytes, fixed part and fields of flags*/
+uint32_t getFrameHeaderSize(uint8_t flags);
+
+/*Writes getFrameHeaderSize(header.flags) bytes of header*/
+void writeFrameHeader(const FrameHeader& header, uint8_t* bytes);
+
+/*Returns true if bytes start with frame magic; needs only 3 bytes*/
+bool checkFrameMagic(const uint8_t* bytes);
+
+/*Reads fixed FRAME_HEADER_SIZE bytes of header; returns false if they are no frame header of known version and flags*/
+bool readFrameHeader(const uint8_t* bytes, FrameHeader& header);
+
+/*Reads fields of flags following fixed part of header (bytes point to whole header);
+returns false if they are malformed*/
+bool readFrameExtensions(const uint8_t* bytes, FrameHeader& header);
+
+/*Returns layout of payload bits of frame with given header*/
+EmbedLayout getEmbedLayout(const FrameHeader& header);
+
+/*XORs size bytes of payload, starting at its byte offset, with keystream derived from password, so masking again
+restores them; empty password leaves them as they are. Hides frame stored in chunk from readers without password,
+but is no encryption*/
+void maskPayload(uint8_t* bytes, uint64_t size, uint64_t offset, const std::string& password);
+
+/*Returns true if image has all channels and bits chosen by mode*/
+bool checkEmbedMode(const m_data& metadata, const EmbedMode& mode);
+
+/*Returns mask of channels named by letters in order of channels of image color type:
+g for gray, r, g and b for color, a for alpha, i for palette index; images storing channels in other order
+give their letters (like bgr, see RawLayout). Throws std::runtime_error for letters of channels image does not have*/
+uint8_t parseChannels(const char* names, const m_data& metadata, const char* letters = nullptr);
+
+/*Returns the number of message bytes image can carry by mode, frame header with fields of mode and flags excluded*/
+uint64_t getMessageCapacity(const m_data& metadata, const EmbedMode& mode = DEFAULT_EMBED_MODE, uint8_t flags = 0);
+
+/*Returns index of pixel (counted over whole image) holding payload bit bitIndex*/
+uint64_t getPixelOfBit(uint64_t bitIndex, const EmbedLayout& layout);
+
+/*Encodes payload bits from bitIndex into one scanline (without filter byte);
+returns index of the next bit to encode*/
+uint64_t encodeScanline(uint8_t* scanline, const m_data& metadata, const std::string& payload, uint64_t bitIndex,
+                        const EmbedLayout& layout = DEFAULT_EMBED_LAYOUT);
+
+/*Decodes payload bits [bitIndex, bitEnd) from one scanline (without filter byte);
+returns index of the next bit to decode*/
+uint64_t decodeScanline(const uint8_t* scanline, const m_data& metadata, uint8_t* payload, uint64_t bitIndex, uint64_t bitEnd,
+                        const EmbedLayout& layout = DEFAULT_EMBED_LAYOUT);
+
+/*Embeds count whole payload bytes into carrier LSBs of 8 * count consecutive pixels
+of bpp bytes with carrier byte at offset; returns false if there is no kernel for this layout*/
+bool embedBytes(uint8_t* pixels, const uint8_t* payload, uint64_t count, int bpp, int offset);
+
+/*Extracts count whole payload bytes from 8 * count consecutive pixels, see embedBytes*/
+bool extractBytes(const uint8_t* pixels, uint8_t* payload, uint64_t count, int bpp, int offset);
+
+/*Returns name of instruction set used by embed and extract kernels*/
+const char* getEmbedISA();
+
+/*Encodes message into image color channels chosen by mode; with password pixels are taken
+in order derived from it (see ScatterOrder), otherwise row by row from the first one;
+with packing message is deflated first when that saves pixels (see framePayload). Throws std::runtime_error if mode does not fit image or message does not fit into it*/
+void encodeMessage(uint8_t* rawData, const uint64_t rawSize, const std::string& message, const m_data& metadata,
+                   const EmbedMode& mode = DEFAULT_EMBED_MODE, const std::string& password = "", bool packing = false);
+
+/*Encodes payload holding header, written by writeFrameHeader, and its message right after it,
+so callers can read message straight behind header without copying it; see encodeMessage*/
+void encodeFrame(uint8_t* rawData, const uint64_t rawSize, const std::string& payload, const FrameHeader& header,
+                 const m_data& metadata, const std::string& password = "");
+
+/*Encodes payload like encodeFrame into pixel rows without PNG filter bytes or interlacing: row y starts at
+data + y * stride, so stride is negative for images stored bottom up. This is all encodeFrame does to image data
+that is not interlaced; uncompressed carriers (see readRawImage) are encoded in place this way*/
+void encodeRows(uint8_t* data, int64_t stride, const std::string& payload, const FrameHeader& header,
+                const m_data& metadata, const std::string& password = "");
+
+/*Decodes message from image color channels, mode is read from frame header; password has to be the one it was encoded with.
+Packed message is unpacked and checked. Throws std::runtime_error if image carries no message or it is corrupted*/
+std::string decodeMessage(const uint8_t* rawData, const uint64_t rawSize, const m_data& metadata,
+                          const std::string& password = "");
+
+/*Decodes message from pixel rows laid out as for encodeRows, filling header of its frame; see decodeMessage*/
+std::string decodeRows(const uint8_t* data, int64_t stride, const m_data& metadata, FrameHeader& header,
+                       const std::string& password = "");
+
+/*Returns true if pixel rows laid out as for encodeRows start with frame header, which is read into header*/
+bool detectRows(const uint8_t* data, int64_t stride, const m_data& metadata, FrameHeader& header,
+                const std::string& password = "");
+
+/*Decodes message inflating and reconstructing only scanlines that carry it (whole interlaced or keyed image);
+rows of large images are inflated and reconstructed on threads of their own while earlier rows are decoded.
+Inflating and reconstructing is recorded into stats when given; throws std::runtime_error if image carries no message*/
+std::string extractMessage(Image& image, const m_data& metadata, const std::string& password = "", Stats* stats = nullptr);
+
+/*Decodes message like extractMessage, filling header of its frame*/
+std::string extractFrame(Image& image, const m_data& metadata, FrameHeader& header, const std::string& password = "",
+                         Stats* stats = nullptr);
 
-/*Applies filter or reconstruction algorithm based on decode*/
-void filter(uint8_t* data, const uint32_t size, const m_data& metadata, bool decode);
+/*Decodes message like extractFrame into message, inflating whole interlaced or keyed image only once; returns false
+if image does not start with frame header, like detectPayload. Throws ImageDataError if image data is broken
+and std::runtime_error if message after header cannot be read*/
+bool tryExtractFrame(Image& image, const m_data& metadata, FrameHeader& header, std::string& message,
+                     const std::string& password = "", Stats* stats = nullptr);
 
-/*Encodes message into image color channels*/
-void encodeMessage(uint8_t* rawData, const uint32_t rawSize, std::string message, const m_data& metadata);
+/*Returns true if image starts with frame header, inflating only scanlines that hold it (whole interlaced or keyed image);
+throws ImageDataError if those cannot be inflated*/
+bool detectPayload(Image& image, const m_data& metadata, const std::string& password = "");
 
-/*Decodes message from image color channels*/
-std::string decodeMessage(const uint8_t* rawData, const uint32_t rawSize, const m_data& metadata);
+/*Returns true if image starts with frame header, which is read into header*/
+bool detectPayload(Image& image, const m_data& metadata, FrameHeader& header, const std::string& password = "");
 
 #endif
\ No newline at end of file